@@ -121,7 +121,9 @@
 #define FUNC_CODE_INST_CMP2             28
 #define FUNC_CODE_INST_VSELECT          29
 #define FUNC_CODE_INST_INBOUNDS_GEP_OLD 30
+#define FUNC_CODE_DEBUG_LOC_AGAIN       33
 #define FUNC_CODE_INST_CALL             34
+#define FUNC_CODE_DEBUG_LOC             35
 #define FUNC_CODE_INST_RESUME           39
 #define FUNC_CODE_INST_LANDINGPAD_OLD   40
 #define FUNC_CODE_INST_LOADATOMIC       41
@@ -132,6 +134,23 @@
 #define FUNC_CODE_INST_LANDINGPAD       47
 
 
+#define METADATA_STRING_OLD             1
+#define METADATA_VALUE                  2
+#define METADATA_NAME                   4
+#define METADATA_KIND                   6
+#define METADATA_LOCATION               7
+#define METADATA_NAMED_NODE            10
+#define METADATA_ATTACHMENT            11
+#define METADATA_FILE                  16
+#define METADATA_SUBPROGRAM            21
+#define METADATA_LEXICAL_BLOCK         22
+#define METADATA_LEXICAL_BLOCK_FILE    23
+#define METADATA_STRINGS               35
+#define METADATA_GLOBAL_DECL_ATTACHMENT 36
+#define METADATA_INDEX_OFFSET          38
+#define METADATA_INDEX                 39
+
+
 #define FCMP_FALSE  0
 #define FCMP_OEQ    1
 #define FCMP_OGT    2
@@ -2,6 +2,7 @@
 #include <getopt.h>
 
 #include <stdint.h>
+#include <inttypes.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -21,9 +22,47 @@ usage(const char *argv0)
   printf("  -p                  Dump parsed function(s)\n");
   printf("  -i                  List all functions\n");
   printf("  -n                  Don't try to run code\n");
+  printf("  -B FILE             Save basic block profile to FILE\n");
+  printf("  -P FILE             Lay out basic blocks using profile FILE\n");
+  printf("  -S FILE             Sample call stacks, save folded stacks to FILE\n");
+  printf("  -G FILE             Sample call stacks, save pprof profile to FILE\n");
+  printf("  -c                  Print per function call counts and time\n");
+  printf("  -C FILE             Save per function call counts and time as JSON\n");
+  printf("  -m                  Write /tmp/perf-<pid>.map for JIT'ed code\n");
+  printf("  -T                  Call functions via trampolines visible to perf\n");
+  printf("  -R FILE             Save binary trace of last executed instructions\n");
+  printf("  -D FILE             Decode binary trace FILE (implies -n)\n");
+  printf("  -M                  Print memory access profile\n");
+  printf("  -H                  Print heap allocation profile\n");
+  printf("  -q FILE             Save code quality stats to FILE\n");
   printf("\n");
 }
 
+static uint8_t *
+load_file(const char *path, size_t *sizep)
+{
+  int fd = open(path, O_RDONLY);
+  if(fd == -1) {
+    perror("open");
+    exit(1);
+  }
+
+  struct stat st;
+  if(fstat(fd, &st)) {
+    perror("stat");
+    exit(1);
+  }
+
+  uint8_t *buf = malloc(st.st_size);
+  if(read(fd, buf, st.st_size) != st.st_size) {
+    perror("read");
+    exit(1);
+  }
+  close(fd);
+  *sizep = st.st_size;
+  return buf;
+}
+
 static int64_t
 get_ts(void)
 {
@@ -46,8 +85,17 @@ dump_stats(ir_unit_t *iu)
   printf("       VM code size: %d\n", s->vm_code_size);
   printf("      JIT code size: %d\n", s->jit_code_size);
   printf("          Data size: %d\n", s->data_size);
+  printf("     Read-only data: %d%s\n", s->rodata_size,
+         s->rodata_shared ? " (shared)" : "");
   printf("     Peak heap size: %d\n", s->peak_heap_size);
   printf("   Peak stack usage: %d\n", s->peak_stack_size);
+  printf("  Realloc (inplace): %d\n", s->realloc_inplace);
+  printf("   Realloc (copied): %d (%"PRId64" bytes)\n", s->realloc_copied,
+         s->realloc_copied_bytes);
+  printf("Heap released to OS: %"PRId64"\n", s->heap_released_bytes);
+  printf("     Printf formats: %d\n", s->printf_formats_compiled);
+  printf("  Regframes (total): %d\n", s->regframe_size_total);
+  printf("    Regframes (max): %d\n", s->regframe_size_max);
   printf("\n");
   printf(" Code transformation stats\n");
   printf("\n");
@@ -58,11 +106,67 @@ dump_stats(ir_unit_t *iu)
   printf("Cmp+Select combined: %d\n", s->cmp_select_combine);
   printf("   Mul+Add combined: %d\n", s->mla_combine);
   printf(" Load+Cast combined: %d\n", s->load_cast_combine);
+  printf("Div/Rem by constant: %d\n", s->div_const_reduced);
+  printf("  Profile BB layout: %d\n", s->bb_profile_layouts);
+  printf("\n");
+  if(s->vm_instructions_executed) {
+    printf(" Execution stats\n");
+    printf("\n");
+    printf("    Instrs executed: %"PRId64"\n", s->vm_instructions_executed);
+    printf("     Moves executed: %"PRId64"\n", s->vm_moves_executed);
+    printf("\n");
+  }
+  printf(" Load time stats (ms)\n");
+  printf("\n");
+  int64_t total = 0;
+  for(int i = 0; i < VMIR_PHASE_NUM; i++) {
+    printf("%19s: %.3f\n", vmir_phase_name(i), s->phase_time[i] / 1e6);
+    total += s->phase_time[i];
+  }
+  printf("%19s: %.3f\n", "total", total / 1e6);
+  printf("\n");
+  printf(" Slowest functions to load (ms)\n");
+  printf("\n");
+  for(int i = 0; i < VMIR_STATS_SLOWEST_FUNCTIONS; i++) {
+    const vmir_function_load_time_t *f = &s->slowest_functions[i];
+    if(f->name == NULL)
+      break;
+    printf("%8.3f  temps:%-6d bbs:%-5d %s\n", f->time / 1e6,
+           f->temporaries, f->basic_blocks, f->name);
+  }
   printf("\n");
 }
 
 
 
+/**
+ * One "key value" pair per line, see test/gcc-torture/codequality
+ */
+static int
+save_stats(ir_unit_t *iu, const char *path)
+{
+  const vmir_stats_t *s = vmir_get_stats(iu);
+  FILE *fp = fopen(path, "w");
+  if(fp == NULL)
+    return -1;
+
+  fprintf(fp, "vm_code_size %d\n", s->vm_code_size);
+  fprintf(fp, "regframe_size_total %d\n", s->regframe_size_total);
+  fprintf(fp, "regframe_size_max %d\n", s->regframe_size_max);
+  fprintf(fp, "moves_killed %d\n", s->moves_killed);
+  fprintf(fp, "lea_load_combined %d\n", s->lea_load_combined);
+  fprintf(fp, "cmp_branch_combine %d\n", s->cmp_branch_combine);
+  fprintf(fp, "cmp_select_combine %d\n", s->cmp_select_combine);
+  fprintf(fp, "mla_combine %d\n", s->mla_combine);
+  fprintf(fp, "load_cast_combine %d\n", s->load_cast_combine);
+  fprintf(fp, "div_const_reduced %d\n", s->div_const_reduced);
+  fprintf(fp, "vm_instructions_executed %"PRId64"\n",
+          s->vm_instructions_executed);
+  fprintf(fp, "vm_moves_executed %"PRId64"\n", s->vm_moves_executed);
+  return fclose(fp) ? -1 : 0;
+}
+
+
 /**
  *
  */
@@ -72,10 +176,21 @@ main(int argc, char **argv)
   int debug_flags = 0;
   int run = 1;
   const char *debugged_function = NULL;
+  const char *profile_save = NULL;
+  const char *profile_load = NULL;
+  const char *sample_folded = NULL;
+  const char *sample_pprof = NULL;
+  const char *fprof_json = NULL;
+  const char *trace_save = NULL;
+  int memprof = 0;
+  int heapprof = 0;
+  const char *trace_decode = NULL;
+  int fprof_dump = 0;
   int opt;
   const char *argv0 = argv[0];
   int print_stats = 0;
-  while((opt = getopt(argc, argv, "plidf:nhrbsjI")) != -1) {
+  const char *stats_save = NULL;
+  while((opt = getopt(argc, argv, "plidf:nhrbsjIB:P:S:G:cC:mTR:D:MHq:")) != -1) {
     switch(opt) {
     case 'p':
       debug_flags |= VMIR_DBG_DUMP_PARSED_FUNCTION;
@@ -101,6 +216,49 @@ main(int argc, char **argv)
     case 'I':
       debug_flags |= VMIR_DBG_IGNORE_UNRESOLVED_FUNCTIONS;
       break;
+    case 'B':
+      debug_flags |= VMIR_DBG_BB_INSTRUMENT;
+      profile_save = optarg;
+      break;
+    case 'P':
+      profile_load = optarg;
+      break;
+    case 'S':
+      sample_folded = optarg;
+      break;
+    case 'G':
+      sample_pprof = optarg;
+      break;
+    case 'c':
+      debug_flags |= VMIR_DBG_FUNC_INSTRUMENT;
+      fprof_dump = 1;
+      break;
+    case 'C':
+      debug_flags |= VMIR_DBG_FUNC_INSTRUMENT;
+      fprof_json = optarg;
+      break;
+    case 'm':
+      debug_flags |= VMIR_DBG_PERF_MAP;
+      break;
+    case 'T':
+      debug_flags |= VMIR_DBG_PERF_TRAMPOLINE;
+      break;
+    case 'R':
+      trace_save = optarg;
+      break;
+    case 'D':
+      trace_decode = optarg;
+      run = 0;
+      break;
+    case 'M':
+      memprof = 1;
+      break;
+    case 'H':
+      heapprof = 1;
+      break;
+    case 'q':
+      stats_save = optarg;
+      break;
     case 'f':
       debugged_function = optarg;
       break;
@@ -127,24 +285,8 @@ main(int argc, char **argv)
   argc -= optind;
   argv += optind;
 
-  int fd = open(argv[0], O_RDONLY);
-  if(fd == -1) {
-    perror("open");
-    exit(1);
-  }
-
-  struct stat st;
-  if(fstat(fd, &st)) {
-    perror("stat");
-    exit(1);
-  }
-
-  uint8_t *buf = malloc(st.st_size);
-  if(read(fd, buf, st.st_size) != st.st_size) {
-    perror("read");
-    exit(1);
-  }
-  close(fd);
+  size_t size;
+  uint8_t *buf = load_file(argv[0], &size);
 
 #define MB(x) ((x) * 1024 * 1024)
 
@@ -154,8 +296,17 @@ main(int argc, char **argv)
 
   vmir_set_debug_flags(iu, debug_flags);
   vmir_set_debugged_function(iu, debugged_function);
+  if(heapprof)
+    vmir_heap_profile_enable(iu);
 
-  if(vmir_load(iu, buf, st.st_size)) {
+  if(profile_load != NULL) {
+    size_t profile_size;
+    uint8_t *profile = load_file(profile_load, &profile_size);
+    vmir_set_bb_profile(iu, (const char *)profile, profile_size);
+    free(profile);
+  }
+
+  if(vmir_load(iu, buf, size)) {
     free(mem);
     free(buf);
     vmir_destroy(iu);
@@ -163,18 +314,56 @@ main(int argc, char **argv)
   }
   free(buf);
 
+  if(trace_decode != NULL && vmir_trace_ring_decode(iu, trace_decode))
+    fprintf(stderr, "Unable to decode %s\n", trace_decode);
+
   if(run) {
+    if(trace_save != NULL && vmir_trace_ring_enable(iu, 1024 * 1024))
+      fprintf(stderr, "Binary tracing not available\n");
+
+    if(memprof && vmir_memprof_enable(iu))
+      fprintf(stderr, "Memory access profiling not available\n");
+
+    if(sample_folded != NULL || sample_pprof != NULL) {
+      if(vmir_profile_start(iu, 997))
+        fprintf(stderr, "Unable to start sampling profiler\n");
+    }
+
     int64_t ts = get_ts();
     vmir_run(iu, NULL, argc, argv);
     ts = get_ts() - ts;
+
+    vmir_profile_stop(iu);
+    if(trace_save != NULL && vmir_trace_ring_save(iu, trace_save))
+      perror(trace_save);
+    if(sample_folded != NULL && vmir_profile_save_folded(iu, sample_folded))
+      perror(sample_folded);
+    if(sample_pprof != NULL && vmir_profile_save_pprof(iu, sample_pprof))
+      perror(sample_pprof);
+
+    if(memprof)
+      vmir_memprof_dump(iu, 0);
+    if(heapprof)
+      vmir_heap_profile_dump(iu, 50);
+    if(fprof_dump)
+      vmir_function_profile_dump(iu, VMIR_FPROF_SORT_EXCLUSIVE);
+    if(fprof_json != NULL && vmir_function_profile_save_json(iu, fprof_json))
+      perror(fprof_json);
     if(print_stats)
       printf("main() executed for %d ms\n", (int)(ts / 1000LL));
   }
 
   if(print_stats)
     dump_stats(iu);
+  if(stats_save != NULL && save_stats(iu, stats_save))
+    perror(stats_save);
 
-  vmir_instrumentation_dump(iu);
+  if(profile_save != NULL) {
+    if(vmir_instrumentation_save(iu, profile_save))
+      perror(profile_save);
+  } else {
+    vmir_instrumentation_dump(iu);
+  }
 
   vmir_destroy(iu);
 
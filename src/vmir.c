@@ -52,8 +52,17 @@
 #define VM_DONT_USE_COMPUTED_GOTO
 #endif
 
-#if defined(VM_TRACE)
+#if defined(VM_TRACE) || defined(VM_TRACE_RING)
 #undef VM_NO_STACK_FRAME
+#define VM_INSTR_BACKREFS
+#endif
+
+#ifdef VM_MEMPROF
+#undef VM_NO_STACK_FRAME
+#endif
+
+#if defined(VMIR_USE_SLAB) && !defined(VMIR_USE_TLSF)
+#error "VMIR_USE_SLAB requires VMIR_USE_TLSF (used for large allocations)"
 #endif
 
 
@@ -109,6 +118,7 @@ VECTOR_HEAD(ir_attrset_vector, struct ir_attrset);
 VECTOR_HEAD(ir_type_vector, struct ir_type);
 VECTOR_HEAD(ir_value_vector, struct ir_value *);
 VECTOR_HEAD(ir_instrumentation_vector, struct ir_instrumentation);
+VECTOR_HEAD(ir_bb_profile_vector, struct ir_bb_profile);
 
 TAILQ_HEAD(ir_bb_queue, ir_bb);
 TAILQ_HEAD(ir_function_queue, ir_function);
@@ -137,6 +147,14 @@ typedef int (vm_function_t)(void *ret,
                             struct ir_unit *iu,
                             void *hostmem);
 
+struct vm_frame;
+
+typedef int (vm_exec_t)(uint16_t *I, void *rf, void *ret,
+                        const struct vm_frame *P);
+
+typedef int (vm_trampoline_t)(uint16_t *I, void *rf, void *ret,
+                              const struct vm_frame *P, vm_exec_t *exec);
+
 struct ir_unit {
   vmir_function_resolver_t iu_external_function_resolver;
 
@@ -166,8 +184,16 @@ struct ir_unit {
   char *iu_traced_function;
 
   uint32_t iu_data_ptr;
+  uint32_t iu_rodata_size;
+  uint32_t iu_rodata_start;
+  uint32_t iu_rodata_end;
+  int iu_rodata_done;
+  int iu_rodata_share;
+  struct rodata_segment *iu_rodata_segment;
   uint32_t iu_heap_start;
   void *iu_heap;
+  struct slab_heap *iu_slab_heap;
+  LIST_HEAD(, vmir_mapping) iu_mappings;
   uint32_t iu_heap_usage;
   uint32_t iu_rsize;
   uint32_t iu_asize;
@@ -179,10 +205,12 @@ struct ir_unit {
   struct vFILE *iu_stdout;
   struct vFILE *iu_stderr;
   const vmir_fsops_t *iu_fsops;
+  struct vmir_archive *iu_archive;
   VECTOR_HEAD(, struct vmir_fd) iu_vfds;
   int iu_vfd_free;  // Point to first free FD (-1 == nothing free)
   LIST_HEAD(, vFILE) iu_vfiles;
   char *iu_strtok_tmp;
+  struct fmt_compiled_list *iu_fmt_cache;  // Compiled printf formats
 
 
 
@@ -191,6 +219,24 @@ struct ir_unit {
   uint32_t iu_debug_flags_func;
   char *iu_debugged_function;
   struct ir_instrumentation_vector iu_instrumentation;
+  struct ir_bb_profile_vector iu_bb_profile;
+  struct vmir_profile *iu_profile;
+  VECTOR_HEAD(, struct vm_fprof_frame) iu_fprof_stack;
+  vm_trampoline_t **iu_perf_trampolines;  // Indexed by gfid
+  void *iu_perf_trampoline_mem;
+  size_t iu_perf_trampoline_memsize;
+  struct vm_trace_ring *iu_trace_ring;
+  struct vm_memprof *iu_memprof;
+  struct vmir_heapprof *iu_heapprof;
+
+  // Debug info
+  VECTOR_HEAD(, struct ir_md) iu_md;
+  VECTOR_HEAD(, char *) iu_debug_files;
+  VECTOR_HEAD(, struct ir_line) iu_lines;  // Line table of function emitted
+  struct ir_bb *iu_debugloc_bb;
+  struct ir_instr *iu_debugloc_prev;
+  uint32_t iu_debugloc_line;
+  int iu_debugloc_file;
 
   char *iu_triple;
   int iu_version;
@@ -251,6 +297,32 @@ struct ir_unit {
   vmir_logger_t *iu_logger;
 };
 
+
+/**
+ * Guest FILE
+ *
+ * Lives in guest memory as does its buffer. The buffer positions are
+ * guest addresses so the FGETC / FPUTC / PUTCHAR vmops can consume
+ * and fill the buffer directly, everything else goes via vmir_libc.c
+ *
+ * A stream is either reading (rpos < rend) or writing (wend != 0)
+ * When not writing wpos == wend == 0 so the write fast path always fails
+ */
+typedef struct vFILE {
+  uint32_t rpos;     // Next byte to read
+  uint32_t rend;     // End of buffered read data
+  uint32_t wpos;     // Next byte to write
+  uint32_t wend;     // End of write buffer
+  uint32_t buf;
+  uint32_t bufsize;
+  int fd;
+  int flags;
+#define VFILE_EOF      0x1
+#define VFILE_ERROR    0x2
+#define VFILE_LINEBUF  0x4
+  LIST_ENTRY(vFILE) link;
+} vFILE_t;
+
 static uint32_t
 vmir_host_to_vmaddr(ir_unit_t *iu, void *ptr)
 {
@@ -312,9 +384,18 @@ struct ir_function {
 
   int if_jit_offset;
 
+  struct ir_line *if_lines;  // Sorted on il_offset
+  int if_num_lines;
+
 #ifndef VM_NO_STACK_FRAME
   int if_peak_stack_use;
 #endif
+
+  // Function instrumentation (VMIR_DBG_FUNC_INSTRUMENT)
+  uint64_t if_prof_calls;
+  uint64_t if_prof_inclusive;
+  uint64_t if_prof_exclusive;
+  int if_prof_active;   // Number of activations on the stack (recursion)
 };
 
 
@@ -327,9 +408,21 @@ typedef struct ir_globalvar {
   char *ig_name;
   uint32_t ig_addr;
   uint32_t ig_size;
+  int ig_readonly;  // In read-only data segment, see vmir_rodata.c
 } ir_globalvar_t;
 
 
+/**
+ * Set of temporaries during liveness analysis. Values are sorted and
+ * relative to the first function value
+ */
+typedef struct ir_liveset {
+  int ls_size;
+  int ls_capacity;
+  int *ls_values;
+} ir_liveset_t;
+
+
 /**
  *
  */
@@ -358,6 +451,10 @@ typedef struct ir_bb {
 
   LIST_ENTRY(ir_bb) ib_traversal_link; // Temporary for graph traversal
 
+  ir_liveset_t ib_live_out;  // Computed by liveness analysis
+  ir_liveset_t ib_live_in;
+  int ib_dfo;            // Temporary, depth first order during liveness
+
   char *ib_name;
 
 } ir_bb_t;
@@ -382,10 +479,46 @@ typedef struct ir_instrumentation {
   struct ir_function *ii_func;
   int ii_bb;
   int ii_instructions;
+  int ii_moves;
+  int ii_file;
+  uint32_t ii_line;
   int64_t ii_count;
 } ir_instrumentation_t;
 
 
+/**
+ * Basic block execution count loaded from a saved instrumentation dump
+ */
+typedef struct ir_bb_profile {
+  char *ibp_func;
+  int ibp_bb;
+  int64_t ibp_count;
+} ir_bb_profile_t;
+
+
+/**
+ * Metadata node, only the parts needed to map a debug location scope
+ * to a source file are kept
+ */
+typedef struct ir_md {
+  int im_code;
+  int im_file;         // Index in iu_debug_files, -1 if not resolved yet
+  uint32_t im_scope;   // Metadata id + 1 (0 == none)
+  uint32_t im_fileref; // Metadata id + 1 (0 == none)
+  char *im_str;
+} ir_md_t;
+
+
+/**
+ * Maps VM text offset to source line
+ */
+typedef struct ir_line {
+  uint32_t il_offset;
+  uint32_t il_line;
+  int il_file;
+} ir_line_t;
+
+
 
 
 /**
@@ -423,6 +556,7 @@ typedef enum {
   IR_IC_CMP_BRANCH,
   IR_IC_CMP_SELECT,
   IR_IC_MLA,
+  IR_IC_DIVC,
 } instr_class_t;
 
 /**
@@ -445,9 +579,10 @@ typedef struct ir_instr {
   instr_class_t ii_class;
   ir_valuetype_t ii_ret;
 
-  uint32_t *ii_liveness; /* Points to three consecutive bitfields used for
-                          * during liveness analysis.
+  uint32_t *ii_liveness; /* Points to three consecutive bitfields
                           * [out] [gen] [in]
+                          * Only materialized for the JIT, liveness is
+                          * otherwise kept per basic block (ib_live_*)
                           * The size of these bitfields are given by the number
                           * of temporaries in each function
                           */
@@ -455,6 +590,8 @@ typedef struct ir_instr {
   SLIST_ENTRY(ir_instr) ii_tmplink;
   int16_t ii_num_succ;
   uint8_t ii_jit;
+  int16_t ii_file;   // Index in iu_debug_files (-1 if unknown)
+  uint32_t ii_line;  // Source line, 0 if unknown
 } ir_instr_t;
 
 
@@ -561,18 +698,71 @@ addstrf(char **dst, const char *fmt, ...)
   return len;
 }
 
+
+/**
+ * Account time since 'ts' to a load phase, returns current time
+ */
+static int64_t
+phase_mark(ir_unit_t *iu, vmir_phase_t phase, int64_t ts)
+{
+  const int64_t now = get_ts_ns();
+  iu->iu_stats.phase_time[phase] += now - ts;
+  return now;
+}
+
+
+/**
+ *
+ */
+const char *
+vmir_phase_name(vmir_phase_t phase)
+{
+  static const char *names[VMIR_PHASE_NUM] = {
+    [VMIR_PHASE_PARSE]                = "parse",
+    [VMIR_PHASE_CONSTEXPRS]           = "constexprs",
+    [VMIR_PHASE_REPLACE_INSTRUCTIONS] = "replace instrs",
+    [VMIR_PHASE_CFG]                  = "cfg",
+    [VMIR_PHASE_CRITICAL_EDGES]       = "critical edges",
+    [VMIR_PHASE_COMBINE]              = "combine",
+    [VMIR_PHASE_EXIT_SSA]             = "exit ssa",
+    [VMIR_PHASE_LEGALIZE]             = "legalize",
+    [VMIR_PHASE_COPY_PROPAGATE]       = "copy propagate",
+    [VMIR_PHASE_DCE]                  = "dce",
+    [VMIR_PHASE_LIVENESS]             = "liveness",
+    [VMIR_PHASE_REGALLOC]             = "regalloc",
+    [VMIR_PHASE_BB_LAYOUT]            = "bb layout",
+    [VMIR_PHASE_EMIT]                 = "emit",
+    [VMIR_PHASE_INITIALIZE_GLOBALS]   = "init globals",
+    [VMIR_PHASE_GLOBAL_CTORS]         = "global ctors",
+  };
+  if(phase < 0 || phase >= VMIR_PHASE_NUM)
+    return "???";
+  return names[phase];
+}
+
 #include "vmir_mem.c"
 #include "vmir_type.c"
 #include "vmir_value.c"
+#include "vmir_debuginfo.c"
 #include "vmir_vm.h"
 #include "vmir_instr_parse.c"
 #include "vmir_function.c"
-#if defined(__arm__) && (defined(__linux__) || defined(__ANDROID__))
+// JITed code bypasses vm_memprof_access() so memprof builds are
+// interpreter only
+#if defined(__arm__) && (defined(__linux__) || defined(__ANDROID__)) && \
+  !defined(VM_MEMPROF)
 #include "vmir_jit_arm.c"
 #endif
 #include "vmir_transform.c"
+#include "vmir_memprof.c"
 #include "vmir_vm.c"
+#include "vmir_profile.c"
+#include "vmir_perf.c"
+#include "vmir_trace.c"
+#include "vmir_heapprof.c"
+#include "vmir_archive.c"
 #include "vmir_libc.c"
+#include "vmir_rodata.c"
 #include "vmir_bitcode_parser.c"
 
 
@@ -715,6 +905,7 @@ iu_cleanup(ir_unit_t *iu)
   VECTOR_CLEAR(&iu->iu_jit_bb_to_addr_fixups);
   VECTOR_CLEAR(&iu->iu_initializers);
   VECTOR_CLEAR(&iu->iu_values);
+  debuginfo_md_clear(iu, 0);
 
 
   ir_attr_t *ia;
@@ -749,7 +940,15 @@ iu_cleanup(ir_unit_t *iu)
 void
 vmir_destroy(ir_unit_t *iu)
 {
+  profile_destroy(iu);
+  perf_trampolines_destroy(iu);
+  trace_ring_destroy(iu);
+  memprof_destroy(iu);
+  heapprof_destroy(iu);
+  VECTOR_CLEAR(&iu->iu_fprof_stack);
+  mem_mappings_destroy(iu);
   libc_terminate(iu);
+  rodata_destroy(iu);
 
   for(int i = 0; i < VECTOR_LEN(&iu->iu_functions); i++) {
     function_destroy(VECTOR_ITEM(&iu->iu_functions, i));
@@ -769,6 +968,12 @@ vmir_destroy(ir_unit_t *iu)
   free(iu->iu_triple);
   free(iu->iu_debugged_function);
 
+  for(int i = 0; i < VECTOR_LEN(&iu->iu_bb_profile); i++)
+    free(VECTOR_ITEM(&iu->iu_bb_profile, i).ibp_func);
+  VECTOR_CLEAR(&iu->iu_bb_profile);
+
+  debuginfo_destroy(iu);
+
   VECTOR_CLEAR(&iu->iu_vfds);
   free(iu);
 }
@@ -884,18 +1089,30 @@ vmir_load(ir_unit_t *iu, const uint8_t *u8, int len)
   jit_init(iu);
 #endif
 
+  int64_t ts = get_ts_ns();
   ir_parse_blocks(iu, 2, NULL, NULL, &bs);
   free(iu->iu_text_alloc);
 
+  // Whatever is not accounted to the other phases is parsing
+  int64_t *pt = iu->iu_stats.phase_time;
+  ts = get_ts_ns() - ts;
+  for(int i = 0; i < VMIR_PHASE_INITIALIZE_GLOBALS; i++)
+    ts -= pt[i];
+  pt[VMIR_PHASE_PARSE] += ts;
+
 #ifdef VMIR_VM_JIT
   jit_seal_code(iu);
 #endif
+  rodata_layout(iu);
   iu->iu_heap_start = VMIR_ALIGN(iu->iu_data_ptr, 4096);
   iu->iu_stats.data_size = iu->iu_heap_start;
 
   vmir_heap_init(iu);
 
+  ts = get_ts_ns();
   initialize_globals(iu, iu->iu_mem);
+  rodata_share(iu);
+  phase_mark(iu, VMIR_PHASE_INITIALIZE_GLOBALS, ts);
 
   libc_initialize(iu);
 
@@ -914,7 +1131,11 @@ vmir_load(ir_unit_t *iu, const uint8_t *u8, int len)
     }
   }
 
+  perf_init(iu);
+
+  ts = get_ts_ns();
   run_global_ctors(iu);
+  phase_mark(iu, VMIR_PHASE_GLOBAL_CTORS, ts);
 
   iu_cleanup(iu);
   return 0;
@@ -938,17 +1159,93 @@ instrumentation_cmp(const ir_instrumentation_t *a,
 /**
  *
  */
-void
-vmir_instrumentation_dump(ir_unit_t *iu)
+static void
+instrumentation_write(ir_unit_t *iu, FILE *fp)
 {
   VECTOR_SORT(&iu->iu_instrumentation, instrumentation_cmp);
   for(int i = 0; i < VECTOR_LEN(&iu->iu_instrumentation); i++) {
     const ir_instrumentation_t *ii = &VECTOR_ITEM(&iu->iu_instrumentation, i);
-    printf("%10"PRId64" %10"PRId64" %s.%d\n",
-           ii->ii_count,
-           ii->ii_count * ii->ii_instructions,
-           ii->ii_func->if_name, ii->ii_bb);
+    fprintf(fp, "%10"PRId64" %10"PRId64" %10"PRId64" ",
+            ii->ii_count,
+            ii->ii_count * ii->ii_instructions,
+            ii->ii_count * ii->ii_moves);
+    // Parsing of saved profiles (vmir_set_bb_profile) only looks at the
+    // last field so the source location must come before it
+    if(ii->ii_line)
+      fprintf(fp, "%s:%d ", debuginfo_file_name(iu, ii->ii_file), ii->ii_line);
+    fprintf(fp, "%s.%d\n", ii->ii_func->if_name, ii->ii_bb);
+  }
+}
+
+
+/**
+ *
+ */
+void
+vmir_instrumentation_dump(ir_unit_t *iu)
+{
+  instrumentation_write(iu, stdout);
+}
+
+
+/**
+ *
+ */
+int
+vmir_instrumentation_save(ir_unit_t *iu, const char *path)
+{
+  FILE *fp = fopen(path, "w");
+  if(fp == NULL)
+    return -1;
+  instrumentation_write(iu, fp);
+  return fclose(fp) ? -1 : 0;
+}
+
+
+/**
+ * Each line is "<count> ... <function>.<bb>", ie. the format written by
+ * vmir_instrumentation_dump(). Columns in between are ignored
+ */
+int
+vmir_set_bb_profile(ir_unit_t *iu, const char *data, size_t len)
+{
+  const char *end = data + len;
+  int entries = 0;
+
+  while(data < end) {
+    const char *eol = memchr(data, '\n', end - data);
+    if(eol == NULL)
+      eol = end;
+
+    char line[512];
+    const size_t linelen = VMIR_MIN(eol - data, sizeof(line) - 1);
+    memcpy(line, data, linelen);
+    line[linelen] = 0;
+    data = eol + 1;
+
+    for(int i = linelen - 1; i >= 0 && (line[i] == ' ' || line[i] == '\r'); i--)
+      line[i] = 0;
+
+    int64_t count;
+    if(sscanf(line, "%"SCNd64, &count) != 1)
+      continue;
+
+    char *tok = strrchr(line, ' ');
+    if(tok == NULL)
+      continue;
+    tok++;
+    char *dot = strrchr(tok, '.');
+    if(dot == NULL || dot == tok)
+      continue;
+    *dot = 0;
+
+    ir_bb_profile_t ibp = {strdup(tok), atoi(dot + 1), count};
+    VECTOR_PUSH_BACK(&iu->iu_bb_profile, ibp);
+    entries++;
   }
+
+  VECTOR_SORT(&iu->iu_bb_profile, bb_profile_cmp);
+  return entries;
 }
 
 
@@ -1082,6 +1379,14 @@ vmir_set_traced_function(ir_unit_t *iu, const char *fname)
 const vmir_stats_t *
 vmir_get_stats(ir_unit_t *iu)
 {
-  return &iu->iu_stats;
+  vmir_stats_t *s = &iu->iu_stats;
+  s->vm_instructions_executed = 0;
+  s->vm_moves_executed = 0;
+  for(int i = 0; i < VECTOR_LEN(&iu->iu_instrumentation); i++) {
+    const ir_instrumentation_t *ii = &VECTOR_ITEM(&iu->iu_instrumentation, i);
+    s->vm_instructions_executed += ii->ii_count * ii->ii_instructions;
+    s->vm_moves_executed += ii->ii_count * ii->ii_moves;
+  }
+  return s;
 }
 
@@ -54,6 +54,12 @@ typedef enum {
 } vmir_openflags_t;
 
 
+typedef struct {
+  void *iov_base;
+  size_t iov_len;
+} vmir_iovec_t;
+
+
 typedef struct {
   vmir_errcode_t(*open)(void *opaque, const char *path,
                         vmir_openflags_t flags, intptr_t *fh);
@@ -65,6 +71,18 @@ typedef struct {
 
   int64_t (*seek)(void *opaque, intptr_t fh, int64_t offset, int whence);
 
+  // Scatter / gather I/O. Offset -1 means the current position (which
+  // is then advanced), otherwise the position is left untouched.
+  // Optional, emulated with read / write / seek if not set
+  ssize_t (*preadv)(void *opaque, intptr_t fh, const vmir_iovec_t *iov,
+                    int iovcnt, int64_t offset);
+  ssize_t (*pwritev)(void *opaque, intptr_t fh, const vmir_iovec_t *iov,
+                     int iovcnt, int64_t offset);
+
+  // Host file descriptor for 'fh', used when the guest mmap()s the file.
+  // Optional, return -1 (or leave NULL) to have the contents copied
+  int (*hostfd)(void *opaque, intptr_t fh);
+
 } vmir_fsops_t;
 
 
@@ -88,6 +106,18 @@ ir_unit_t *vmir_create(void *membase, uint32_t memsize,
 
 
 
+/**
+ * Place constant globals in a read-only region shared (using
+ * MAP_SHARED | MAP_FIXED) among all units in the process whose
+ * read-only data is identical, for instance instances of the same
+ * module. Must be called before vmir_load().
+ *
+ * membase must be page aligned and private anonymous memory. Writes to
+ * the region will fault in the host so only use this for well behaved
+ * modules. Currently only supported on Linux
+ */
+void vmir_set_shared_rodata(ir_unit_t *iu, int enable);
+
 /**
  * Return opaque value passed to vmir_create()
  */
@@ -145,6 +175,34 @@ void vmir_set_external_function_resolver(ir_unit_t * iu,
  */
 void vmir_set_fsops(ir_unit_t *iu, const vmir_fsops_t *ops);
 
+/**
+ * Read-only filesystem served from an uncompressed tar image
+ *
+ * vmir_archive_open() maps the file, vmir_archive_create() uses an
+ * image already in memory (which must stay valid until the archive is
+ * destroyed). Returns NULL if the image is not a tar archive.
+ *
+ * The archive is never modified so one archive can be shared by any
+ * number of units and threads. Path lookups are O(1) and file reads
+ * are plain copies from the image.
+ */
+typedef struct vmir_archive vmir_archive_t;
+
+vmir_archive_t *vmir_archive_open(const char *path);
+
+vmir_archive_t *vmir_archive_create(const void *data, size_t size);
+
+/**
+ * Must not be destroyed while any unit using it is still alive
+ */
+void vmir_archive_destroy(vmir_archive_t *va);
+
+/**
+ * Files found in the archive and opened for reading are served from
+ * it. Everything else goes via the unit's fsops
+ */
+void vmir_set_archive(ir_unit_t *iu, vmir_archive_t *va);
+
 
 /**
  * Parse bitcode and generate code, data, etc
@@ -185,6 +243,131 @@ int vmir_run(ir_unit_t *iu, int *ret, int argc, char **argv);
  */
 void vmir_instrumentation_dump(ir_unit_t *iu);
 
+/**
+ * Write basic block profiling to a file. The output can be fed back
+ * to vmir_set_bb_profile() for subsequent loads
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int vmir_instrumentation_save(ir_unit_t *iu, const char *path);
+
+/**
+ * Provide basic block execution counts as written by
+ * vmir_instrumentation_dump() or vmir_instrumentation_save().
+ *
+ * Must be called before vmir_load(). Functions found in the profile get
+ * their basic blocks laid out so hot paths fall through and never
+ * executed blocks are placed last.
+ *
+ * Returns number of entries parsed
+ */
+int vmir_set_bb_profile(ir_unit_t *iu, const char *data, size_t len);
+
+
+/**
+ * Sampling profiler
+ *
+ * Samples the guest call stack hz times per second of consumed CPU time
+ * using SIGPROF. Only the thread calling vmir_profile_start() is sampled
+ * and only one ir_unit can be profiled at a time.
+ *
+ * Returns 0 on success
+ */
+int vmir_profile_start(ir_unit_t *iu, int hz);
+
+void vmir_profile_stop(ir_unit_t *iu);
+
+/**
+ * Discard all collected samples
+ */
+void vmir_profile_reset(ir_unit_t *iu);
+
+/**
+ * Save samples as folded stacks (for flamegraphs)
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int vmir_profile_save_folded(ir_unit_t *iu, const char *path);
+
+/**
+ * Save samples as a pprof profile. Call sites are reported with their
+ * source line if the bitcode has debug info, otherwise the basic block
+ * id + 1 is used as line number
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int vmir_profile_save_pprof(ir_unit_t *iu, const char *path);
+
+
+/**
+ * Function profiling (requires VMIR_DBG_FUNC_INSTRUMENT at load time)
+ *
+ * Call counts and inclusive / exclusive time per function. Time is in
+ * CPU cycles on x86 and in nanoseconds elsewhere.
+ */
+typedef enum {
+  VMIR_FPROF_SORT_CALLS,
+  VMIR_FPROF_SORT_INCLUSIVE,
+  VMIR_FPROF_SORT_EXCLUSIVE,
+} vmir_fprof_sort_t;
+
+/**
+ * Print table of all called functions to stdout
+ */
+void vmir_function_profile_dump(ir_unit_t *iu, vmir_fprof_sort_t sort);
+
+/**
+ * Save all called functions as JSON
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int vmir_function_profile_save_json(ir_unit_t *iu, const char *path);
+
+
+/**
+ * Binary instruction trace (only available when built with VM_TRACE_RING)
+ *
+ * Records the last 'records' (rounded up to a power of 2) executed VM
+ * instructions in a ring buffer.
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int vmir_trace_ring_enable(ir_unit_t *iu, int records);
+
+/**
+ * Save the contents of the trace ring
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int vmir_trace_ring_save(ir_unit_t *iu, const char *path);
+
+/**
+ * Render a saved trace to stdout. The unit must have the same bitcode
+ * loaded as the one that recorded the trace
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int vmir_trace_ring_decode(ir_unit_t *iu, const char *path);
+
+
+/**
+ * Guest memory access profiler (only available when built with VM_MEMPROF)
+ *
+ * Must be called after vmir_load(). Loads, stores and memory vmops are
+ * accounted per function (bytes, stride pattern, misses in a simulated
+ * cache and sampled cache line addresses)
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int vmir_memprof_enable(ir_unit_t *iu);
+
+/**
+ * Print the memory access profile to stdout, functions ranked by
+ * estimated cache miss pressure. If max_functions > 0 only that many
+ * are listed
+ */
+void vmir_memprof_dump(ir_unit_t *iu, int max_functions);
+
 
 
 typedef struct ir_function ir_function_t;
@@ -288,6 +471,36 @@ uint32_t vmir_mem_copy(ir_unit_t *iu, const void *data, size_t size);
 
 void vmir_mem_free(ir_unit_t *iu, uint32_t addr);
 
+/**
+ * Map host memory into VM space without copying. A page aligned window
+ * is reserved in the heap and the host pages are mapped over it
+ * (MAP_FIXED) so the guest accesses them in place. Returns the guest
+ * address or 0 on failure.
+ *
+ * vmir_mem_map() maps 'size' bytes at 'hostaddr' which must be a page
+ * aligned MAP_SHARED mapping (such as mmap() of a memfd or
+ * MAP_SHARED | MAP_ANONYMOUS). Private memory can't be mapped twice.
+ *
+ * vmir_mem_map_fd() maps 'size' bytes of 'fd' starting at 'offset'
+ * (page aligned).
+ *
+ * If writable is 0 the mapping is read-only and guest writes to it will
+ * fault in the host. Writes to a writable mapping are visible to the
+ * host directly. Linux only.
+ */
+uint32_t vmir_mem_map(ir_unit_t *iu, void *hostaddr, size_t size,
+                      int writable);
+
+uint32_t vmir_mem_map_fd(ir_unit_t *iu, int fd, off_t offset, size_t size,
+                         int writable);
+
+/**
+ * Unmap memory mapped with vmir_mem_map() or vmir_mem_map_fd(). The
+ * window is returned to the heap. Remaining mappings are unmapped by
+ * vmir_destroy(). Returns 0 on success, -1 if addr is not such a mapping
+ */
+int vmir_mem_unmap(ir_unit_t *iu, uint32_t addr);
+
 /**
  * Filedescriptors
  */
@@ -333,6 +546,9 @@ vm_ext_function_t *vmir_function_tab_lookup(const char *function,
 #define VMIR_DBG_BB_INSTRUMENT    0x20
 #define VMIR_DBG_DISABLE_JIT      0x40
 #define VMIR_DBG_IGNORE_UNRESOLVED_FUNCTIONS 0x80
+#define VMIR_DBG_FUNC_INSTRUMENT  0x100
+#define VMIR_DBG_PERF_MAP         0x200 // Write /tmp/perf-<pid>.map for JIT
+#define VMIR_DBG_PERF_TRAMPOLINE  0x400 // Per function native trampolines
 
 void vmir_set_debug_flags(ir_unit_t *iu, int flags);
 
@@ -358,10 +574,75 @@ void vmir_walk_heap(ir_unit_t *iu,
                                int inuse),
                     void *opaque);
 
+/**
+ * Return free heap memory to the OS (using madvise(MADV_DONTNEED)).
+ * Meant to be called by long-lived instances when idle, such as after
+ * each handled request. Large blocks are released as they are freed
+ * so this mostly matters for memory freed in smaller chunks.
+ *
+ * Released pages read back as zero so membase given to vmir_create()
+ * must be private anonymous memory (malloc() or mmap(MAP_ANONYMOUS))
+ *
+ * Returns number of bytes released
+ */
+size_t vmir_trim_heap(ir_unit_t *iu);
+
+/**
+ * Guest heap allocation profiler
+ *
+ * Attributes malloc(), calloc() and realloc() calls to call sites and
+ * tracks live bytes and lifetimes per site as well as heap fragmentation
+ * over time. Can be enabled before vmir_load() to include allocations
+ * made by global constructors
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int vmir_heap_profile_enable(ir_unit_t *iu);
+
+/**
+ * Print allocation sites (most bytes allocated first) and fragmentation
+ * history to stdout. If max_sites > 0 only that many sites are listed
+ */
+void vmir_heap_profile_dump(ir_unit_t *iu, int max_sites);
+
 void vmir_walk_fds(ir_unit_t *iu,
                    void (*fn)(void *opaque, int fd, int type),
                    void *opaque);
 
+/**
+ * Phases of vmir_load(), see vmir_stats_t.phase_time
+ */
+typedef enum {
+  VMIR_PHASE_PARSE,                 // Bitstream parsing (excluding below)
+  VMIR_PHASE_CONSTEXPRS,
+  VMIR_PHASE_REPLACE_INSTRUCTIONS,
+  VMIR_PHASE_CFG,
+  VMIR_PHASE_CRITICAL_EDGES,
+  VMIR_PHASE_COMBINE,
+  VMIR_PHASE_EXIT_SSA,
+  VMIR_PHASE_LEGALIZE,
+  VMIR_PHASE_COPY_PROPAGATE,
+  VMIR_PHASE_DCE,
+  VMIR_PHASE_LIVENESS,
+  VMIR_PHASE_REGALLOC,
+  VMIR_PHASE_BB_LAYOUT,
+  VMIR_PHASE_EMIT,
+  VMIR_PHASE_INITIALIZE_GLOBALS,
+  VMIR_PHASE_GLOBAL_CTORS,
+  VMIR_PHASE_NUM,
+} vmir_phase_t;
+
+const char *vmir_phase_name(vmir_phase_t phase);
+
+#define VMIR_STATS_SLOWEST_FUNCTIONS 10
+
+typedef struct vmir_function_load_time {
+  const char *name;
+  int64_t time;        // Nanoseconds spent transforming and emitting
+  int temporaries;
+  int basic_blocks;
+} vmir_function_load_time_t;
+
 typedef struct vmir_stats {
 
   int vm_code_size;
@@ -369,16 +650,36 @@ typedef struct vmir_stats {
   int data_size;
   int peak_heap_size;
   int peak_stack_size;
+  int realloc_inplace;      // realloc() resized the block without moving it
+  int realloc_copied;
+  int64_t realloc_copied_bytes;
+  int64_t heap_released_bytes;  // Returned to the OS when freed or trimmed
+  int rodata_size;              // Constant globals, included in data_size
+  int rodata_shared;            // Mapped from another unit's copy
+  int printf_formats_compiled;  // Formats in read-only data, cached
+  int regframe_size_total;  // Sum of all functions' register frames
+  int regframe_size_max;
+
+  // Executed (lowered) instructions and moves, requires
+  // VMIR_DBG_BB_INSTRUMENT. Updated by vmir_get_stats()
+  int64_t vm_instructions_executed;
+  int64_t vm_moves_executed;
 
   int cmp_branch_combine;
   int cmp_select_combine;
   int mla_combine;
   int load_cast_combine;
+  int div_const_reduced;
   int moves_killed;
+  int bb_profile_layouts;
 
   int lea_load_combined;
   int lea_load_combined_failed;
 
+  int64_t phase_time[VMIR_PHASE_NUM];  // Nanoseconds
+  // Slowest first, unused entries have name == NULL
+  vmir_function_load_time_t slowest_functions[VMIR_STATS_SLOWEST_FUNCTIONS];
+
 } vmir_stats_t;
 
 const vmir_stats_t *vmir_get_stats(ir_unit_t *iu);
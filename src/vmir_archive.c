@@ -0,0 +1,469 @@
+/*
+ * Copyright (c) 2016 Lonelycoder AB
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+ * Read-only filesystem served from an uncompressed tar image
+ *
+ * The image is indexed once when the archive is created (open
+ * addressed hash table on the normalized path) and is never written
+ * to, so an archive can be shared by any number of units / threads.
+ * File data is copied straight out of the image, no syscalls.
+ *
+ * Understands ustar names (prefix + name), GNU long names ('L') and
+ * pax 'path' records. Only regular files are indexed.
+ */
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+typedef struct vmir_archive_entry {
+  char *vae_name;   // NULL if slot is free
+  uint32_t vae_hash;
+  uint64_t vae_offset;
+  uint64_t vae_size;
+} vmir_archive_entry_t;
+
+struct vmir_archive {
+  const uint8_t *va_data;
+  size_t va_size;
+  int va_mapped;    // va_data is mmap()ed by us
+  int va_owned;     // va_data is malloc()ed by us
+
+  vmir_archive_entry_t *va_entries;
+  uint32_t va_mask;  // Number of slots - 1
+  int va_num_files;
+};
+
+typedef struct vmir_archive_file {
+  const vmir_archive_entry_t *vaf_entry;
+  int64_t vaf_pos;
+} vmir_archive_file_t;
+
+
+/**
+ * Strip leading '/' and './' and trailing '/'
+ */
+static size_t
+archive_path_normalize(const char **pathp)
+{
+  const char *path = *pathp;
+  while(1) {
+    if(path[0] == '/')
+      path++;
+    else if(path[0] == '.' && path[1] == '/')
+      path += 2;
+    else
+      break;
+  }
+  size_t len = strlen(path);
+  while(len > 0 && path[len - 1] == '/')
+    len--;
+  *pathp = path;
+  return len;
+}
+
+
+static uint32_t
+archive_hash(const char *str, size_t len)
+{
+  uint32_t h = 0x811c9dc5;  // FNV-1a
+  for(size_t i = 0; i < len; i++)
+    h = (h ^ (uint8_t)str[i]) * 0x01000193;
+  return h;
+}
+
+
+static const vmir_archive_entry_t *
+archive_lookup(const vmir_archive_t *va, const char *path)
+{
+  const size_t len = archive_path_normalize(&path);
+  const uint32_t h = archive_hash(path, len);
+
+  for(uint32_t i = h & va->va_mask; ; i = (i + 1) & va->va_mask) {
+    const vmir_archive_entry_t *e = &va->va_entries[i];
+    if(e->vae_name == NULL)
+      return NULL;
+    if(e->vae_hash == h && !strncmp(e->vae_name, path, len) &&
+       e->vae_name[len] == 0)
+      return e;
+  }
+}
+
+
+static void
+archive_insert(vmir_archive_t *va, const char *path, uint64_t offset,
+               uint64_t size)
+{
+  const size_t len = archive_path_normalize(&path);
+  if(len == 0)
+    return;
+  const uint32_t h = archive_hash(path, len);
+
+  uint32_t i = h & va->va_mask;
+  for(; va->va_entries[i].vae_name != NULL; i = (i + 1) & va->va_mask) {
+    vmir_archive_entry_t *e = &va->va_entries[i];
+    if(e->vae_hash == h && !strncmp(e->vae_name, path, len) &&
+       e->vae_name[len] == 0) {
+      // Later members replace earlier ones, same as extracting
+      e->vae_offset = offset;
+      e->vae_size = size;
+      return;
+    }
+  }
+
+  vmir_archive_entry_t *e = &va->va_entries[i];
+  e->vae_name = malloc(len + 1);
+  memcpy(e->vae_name, path, len);
+  e->vae_name[len] = 0;
+  e->vae_hash = h;
+  e->vae_offset = offset;
+  e->vae_size = size;
+  va->va_num_files++;
+}
+
+
+static uint64_t
+tar_octal(const uint8_t *p, int len)
+{
+  uint64_t v = 0;
+  int i = 0;
+  while(i < len && p[i] == ' ')
+    i++;
+  for(; i < len && p[i] >= '0' && p[i] <= '7'; i++)
+    v = v * 8 + p[i] - '0';
+  return v;
+}
+
+
+/**
+ * Walk the tar members, calling 'fn' for each regular file
+ * Returns -1 if the image is not a tar archive
+ */
+static int
+tar_walk(vmir_archive_t *va,
+         void (*fn)(vmir_archive_t *va, const char *path,
+                    uint64_t offset, uint64_t size))
+{
+  const uint8_t *data = va->va_data;
+  const size_t size = va->va_size;
+  char longname[4096];
+  int have_longname = 0;
+  size_t pos = 0;
+
+  while(pos + 512 <= size) {
+    const uint8_t *hdr = data + pos;
+    if(hdr[0] == 0)
+      break;  // End of archive
+
+    unsigned int chksum = 0;
+    for(int i = 0; i < 512; i++)
+      chksum += i >= 148 && i < 156 ? ' ' : hdr[i];
+    if(chksum != tar_octal(hdr + 148, 8))
+      return -1;
+
+    const uint64_t msize = tar_octal(hdr + 124, 12);
+    const size_t body = pos + 512;
+    if(msize > size - body)
+      return -1;
+
+    const char type = hdr[156];
+    if(type == 'L' || type == 'x') {
+      // GNU long name or pax extended header for the next member
+      const char *s = (const char *)data + body;
+      const char *e = s + msize;
+      if(type == 'L') {
+        snprintf(longname, sizeof(longname), "%.*s", (int)msize, s);
+        have_longname = 1;
+      }
+      while(type == 'x' && s < e) {
+        // Records are "<len> <key>=<value>\n"
+        const char *sp = memchr(s, ' ', e - s);
+        long rlen = strtol(s, NULL, 10);
+        if(sp == NULL || rlen <= 0 || rlen > e - s)
+          break;
+        if(s + rlen - sp > 6 && !memcmp(sp + 1, "path=", 5)) {
+          snprintf(longname, sizeof(longname), "%.*s",
+                   (int)(s + rlen - 1 - (sp + 6)), sp + 6);
+          have_longname = 1;
+        }
+        s += rlen;
+      }
+    } else {
+      if(type == '0' || type == 0 || type == '7') {
+        char name[257];
+        if(have_longname) {
+          fn(va, longname, body, msize);
+        } else {
+          if(!memcmp(hdr + 257, "ustar", 5) && hdr[345])
+            snprintf(name, sizeof(name), "%.155s/%.100s",
+                     (const char *)hdr + 345, (const char *)hdr);
+          else
+            snprintf(name, sizeof(name), "%.100s", (const char *)hdr);
+          fn(va, name, body, msize);
+        }
+      }
+      have_longname = 0;
+    }
+    pos = body + ((msize + 511) & ~(uint64_t)511);
+  }
+  return 0;
+}
+
+
+static void
+archive_count(vmir_archive_t *va, const char *path, uint64_t offset,
+              uint64_t size)
+{
+  va->va_num_files++;
+}
+
+
+/**
+ *
+ */
+static vmir_archive_t *
+archive_index(vmir_archive_t *va)
+{
+  if(tar_walk(va, archive_count)) {
+    vmir_archive_destroy(va);
+    return NULL;
+  }
+
+  uint32_t slots = 16;
+  while(slots < va->va_num_files * 2)
+    slots *= 2;
+  va->va_mask = slots - 1;
+  va->va_entries = calloc(slots, sizeof(vmir_archive_entry_t));
+  va->va_num_files = 0;
+  tar_walk(va, archive_insert);
+  return va;
+}
+
+
+/**
+ *
+ */
+vmir_archive_t *
+vmir_archive_create(const void *data, size_t size)
+{
+  vmir_archive_t *va = calloc(1, sizeof(vmir_archive_t));
+  va->va_data = data;
+  va->va_size = size;
+  return archive_index(va);
+}
+
+
+/**
+ *
+ */
+vmir_archive_t *
+vmir_archive_open(const char *path)
+{
+  vmir_archive_t *va = calloc(1, sizeof(vmir_archive_t));
+#ifndef _WIN32
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if(fd == -1 || fstat(fd, &st)) {
+    if(fd != -1)
+      close(fd);
+    free(va);
+    return NULL;
+  }
+  va->va_size = st.st_size;
+  if(va->va_size > 0) {
+    void *p = mmap(NULL, va->va_size, PROT_READ, MAP_SHARED, fd, 0);
+    if(p == MAP_FAILED) {
+      close(fd);
+      free(va);
+      return NULL;
+    }
+    va->va_data = p;
+    va->va_mapped = 1;
+  }
+  close(fd);
+#else
+  FILE *fp = fopen(path, "rb");
+  if(fp == NULL) {
+    free(va);
+    return NULL;
+  }
+  fseek(fp, 0, SEEK_END);
+  va->va_size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  void *p = malloc(va->va_size + 1);
+  if(fread(p, 1, va->va_size, fp) != va->va_size) {
+    fclose(fp);
+    free(p);
+    free(va);
+    return NULL;
+  }
+  fclose(fp);
+  va->va_data = p;
+  va->va_owned = 1;
+#endif
+  return archive_index(va);
+}
+
+
+/**
+ *
+ */
+void
+vmir_archive_destroy(vmir_archive_t *va)
+{
+  if(va->va_entries != NULL) {
+    for(uint32_t i = 0; i <= va->va_mask; i++)
+      free(va->va_entries[i].vae_name);
+    free(va->va_entries);
+  }
+#ifndef _WIN32
+  if(va->va_mapped)
+    munmap((void *)va->va_data, va->va_size);
+#endif
+  if(va->va_owned)
+    free((void *)va->va_data);
+  free(va);
+}
+
+
+/**
+ *
+ */
+void
+vmir_set_archive(ir_unit_t *iu, vmir_archive_t *va)
+{
+  iu->iu_archive = va;
+}
+
+
+/*--------------------------------------------------------------------
+ * fsops, opaque is the vmir_archive_t
+ */
+
+static vmir_errcode_t
+archive_fs_open(void *opaque, const char *path, vmir_openflags_t flags,
+                intptr_t *fh)
+{
+  const vmir_archive_t *va = opaque;
+  if(flags & ~VMIR_FS_OPEN_READ)
+    return VMIR_ERR_FS_ERROR;  // Read-only
+  const vmir_archive_entry_t *e = archive_lookup(va, path);
+  if(e == NULL)
+    return VMIR_ERR_FS_ERROR;
+  vmir_archive_file_t *vaf = malloc(sizeof(vmir_archive_file_t));
+  vaf->vaf_entry = e;
+  vaf->vaf_pos = 0;
+  *fh = (intptr_t)vaf;
+  return 0;
+}
+
+
+static void
+archive_fs_close(void *opaque, intptr_t fh)
+{
+  free((void *)fh);
+}
+
+
+static ssize_t
+archive_fs_preadv(void *opaque, intptr_t fh, const vmir_iovec_t *iov,
+                  int iovcnt, int64_t offset)
+{
+  const vmir_archive_t *va = opaque;
+  vmir_archive_file_t *vaf = (vmir_archive_file_t *)fh;
+  const vmir_archive_entry_t *e = vaf->vaf_entry;
+  int64_t pos = offset < 0 ? vaf->vaf_pos : offset;
+  ssize_t total = 0;
+
+  for(int i = 0; i < iovcnt && pos < e->vae_size; i++) {
+    const size_t n = VMIR_MIN(iov[i].iov_len, e->vae_size - pos);
+    memcpy(iov[i].iov_base, va->va_data + e->vae_offset + pos, n);
+    pos += n;
+    total += n;
+  }
+  if(offset < 0)
+    vaf->vaf_pos = pos;
+  return total;
+}
+
+
+static ssize_t
+archive_fs_read(void *opaque, intptr_t fh, void *buf, size_t count)
+{
+  vmir_iovec_t iov = { buf, count };
+  return archive_fs_preadv(opaque, fh, &iov, 1, -1);
+}
+
+
+static ssize_t
+archive_fs_write(void *opaque, intptr_t fh, const void *buf, size_t count)
+{
+  return -1;
+}
+
+
+static ssize_t
+archive_fs_pwritev(void *opaque, intptr_t fh, const vmir_iovec_t *iov,
+                   int iovcnt, int64_t offset)
+{
+  return -1;
+}
+
+
+static int64_t
+archive_fs_seek(void *opaque, intptr_t fh, int64_t offset, int whence)
+{
+  vmir_archive_file_t *vaf = (vmir_archive_file_t *)fh;
+  switch(whence) {
+  case SEEK_SET:
+    break;
+  case SEEK_CUR:
+    offset += vaf->vaf_pos;
+    break;
+  case SEEK_END:
+    offset += vaf->vaf_entry->vae_size;
+    break;
+  default:
+    return -1;
+  }
+  if(offset < 0)
+    return -1;
+  vaf->vaf_pos = offset;
+  return offset;
+}
+
+
+static const vmir_fsops_t vmir_archive_fsops = {
+  .open    = archive_fs_open,
+  .close   = archive_fs_close,
+  .read    = archive_fs_read,
+  .write   = archive_fs_write,
+  .seek    = archive_fs_seek,
+  .preadv  = archive_fs_preadv,
+  .pwritev = archive_fs_pwritev,
+};
@@ -137,10 +137,19 @@ module_globalvar(ir_unit_t *iu, unsigned int argc, const ir_arg_t *argv)
   iv->iv_type = type;
   iv->iv_gvar = ig;
   assert(alignment > 0);
-  iu->iu_data_ptr = VMIR_ALIGN(iu->iu_data_ptr, alignment);
-  ig->ig_addr = iu->iu_data_ptr;
   ig->ig_size = type_sizeof(iu, pointee);
-  iu->iu_data_ptr += type_sizeof(iu, pointee);
+
+  if((argv[1].i64 & 1) && !iu->iu_rodata_done) {
+    // Constant, address is relocated by rodata_layout()
+    ig->ig_readonly = 1;
+    iu->iu_rodata_size = VMIR_ALIGN(iu->iu_rodata_size, alignment);
+    ig->ig_addr = iu->iu_rodata_size;
+    iu->iu_rodata_size += ig->ig_size;
+  } else {
+    iu->iu_data_ptr = VMIR_ALIGN(iu->iu_data_ptr, alignment);
+    ig->ig_addr = iu->iu_data_ptr;
+    iu->iu_data_ptr += ig->ig_size;
+  }
 
   const unsigned int initializer = argv[2].i64;
 
@@ -368,6 +377,51 @@ paramattr_rec_handler(ir_unit_t *iu, int op,
 }
 
 
+/**
+ * [count, offset, blob]
+ *
+ * The blob holds count vbr6 encoded string lengths followed by the
+ * string characters (starting at offset)
+ */
+static void
+metadata_strings(ir_unit_t *iu, unsigned int argc, const ir_arg_t *argv)
+{
+  if(argc < 2)
+    parser_error(iu, "Bad metadata strings");
+
+  const unsigned int count = argv[0].i64;
+  const unsigned int offset = argv[1].i64;
+  const unsigned int bloblen = argc - 2;
+  const ir_arg_t *blob = argv + 2;
+  unsigned int bitpos = 0;
+  unsigned int strpos = offset;
+
+  for(unsigned int i = 0; i < count; i++) {
+    uint32_t len = 0;
+    int shift = 0;
+    while(1) {
+      uint32_t chunk = 0;
+      for(int b = 0; b < 6; b++, bitpos++) {
+        if(bitpos / 8 >= offset)
+          parser_error(iu, "Bad metadata strings lengths");
+        chunk |= ((blob[bitpos / 8].i64 >> (bitpos & 7)) & 1) << b;
+      }
+      len |= (chunk & 0x1f) << shift;
+      shift += 5;
+      if(!(chunk & 0x20))
+        break;
+    }
+
+    if(strpos + len > bloblen)
+      parser_error(iu, "Bad metadata strings data");
+
+    ir_md_t *im = md_add(iu, METADATA_STRING_OLD);
+    im->im_str = read_str_from_argv(len, blob + strpos);
+    strpos += len;
+  }
+}
+
+
 /**
  *
  */
@@ -375,8 +429,58 @@ static void
 metadata_rec_handler(ir_unit_t *iu, int op,
                      unsigned int argc, const ir_arg_t *argv)
 {
-  //  printf("metadata: Handling rec %d\n", op);
-  //  prinargs(argv, argc);
+  ir_md_t *im;
+
+  switch(op) {
+  case METADATA_NAME:
+  case METADATA_KIND:
+  case METADATA_NAMED_NODE:
+  case METADATA_ATTACHMENT:
+  case METADATA_GLOBAL_DECL_ATTACHMENT:
+  case METADATA_INDEX_OFFSET:
+  case METADATA_INDEX:
+    // These records does not define a metadata node
+    return;
+
+  case METADATA_STRING_OLD:
+    im = md_add(iu, op);
+    im->im_str = read_str_from_argv(argc, argv);
+    return;
+
+  case METADATA_STRINGS:
+    metadata_strings(iu, argc, argv);
+    return;
+
+  case METADATA_FILE:
+    // [distinct, filename, directory]
+    im = md_add(iu, op);
+    if(argc >= 2)
+      im->im_fileref = argv[1].i64;
+    return;
+
+  case METADATA_SUBPROGRAM:
+    // [distinct, scope, name, linkage name, file, line, ...]
+    im = md_add(iu, op);
+    if(argc >= 5) {
+      im->im_scope = argv[1].i64;
+      im->im_fileref = argv[4].i64;
+    }
+    return;
+
+  case METADATA_LEXICAL_BLOCK:
+  case METADATA_LEXICAL_BLOCK_FILE:
+    // [distinct, scope, file, ...]
+    im = md_add(iu, op);
+    if(argc >= 3) {
+      im->im_scope = argv[1].i64;
+      im->im_fileref = argv[2].i64;
+    }
+    return;
+
+  default:
+    md_add(iu, op);
+    return;
+  }
 }
 
 
@@ -722,6 +826,7 @@ ir_enter_subblock(ir_unit_t *iu, bcbitstream_t *bs, int outer_id_width)
   ir_blockinfo_t *ibi = blockinfo_find(iu, blockid);
 
   int valuelistsize = 0;
+  int mdlistsize = 0;
   rec_handler_t *rh;
 
   switch(blockid) {
@@ -738,10 +843,13 @@ ir_enter_subblock(ir_unit_t *iu, bcbitstream_t *bs, int outer_id_width)
     rh = paramattr_group_rec_handler;
     break;
   case BITCODE_CONSTANTS:
+    rodata_layout(iu);
     rh = constants_rec_handler;
     break;
   case BITCODE_FUNCTION:
+    rodata_layout(iu);
     valuelistsize = iu->iu_next_value;
+    mdlistsize = VECTOR_LEN(&iu->iu_md);
     iu->iu_first_func_value = iu->iu_next_value;
 
     if(iu->iu_vstoffset) {
@@ -796,10 +904,15 @@ ir_enter_subblock(ir_unit_t *iu, bcbitstream_t *bs, int outer_id_width)
     function_process(iu, iu->iu_current_function);
 
     value_resize(iu, valuelistsize);
+    debuginfo_md_clear(iu, mdlistsize);
     break;
 
   case BITCODE_CONSTANTS:
-    eval_constexprs(iu);
+    {
+      int64_t ts = get_ts_ns();
+      eval_constexprs(iu);
+      phase_mark(iu, VMIR_PHASE_CONSTEXPRS, ts);
+    }
     break;
 
   case BITCODE_TYPES_NEW:
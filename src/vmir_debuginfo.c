@@ -0,0 +1,208 @@
+/*
+ * Copyright (c) 2016 Lonelycoder AB
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+ * Source line attribution
+ *
+ * Only the metadata records needed to get from a debug location's scope
+ * to a file name are decoded (strings, DIFile, DISubprogram and lexical
+ * blocks). All other metadata records just occupy their metadata id.
+ *
+ * Each instruction carries the line from its DEBUG_LOC record and when
+ * a function is emitted a table mapping VM text offsets to file:line is
+ * built (ir_function->if_lines)
+ */
+
+
+/**
+ *
+ */
+static ir_md_t *
+md_add(ir_unit_t *iu, int code)
+{
+  ir_md_t im = {code, -1};
+  VECTOR_PUSH_BACK(&iu->iu_md, im);
+  return &VECTOR_ITEM(&iu->iu_md, VECTOR_LEN(&iu->iu_md) - 1);
+}
+
+
+/**
+ *
+ */
+static const char *
+md_string(ir_unit_t *iu, uint32_t ref)
+{
+  if(ref == 0 || ref > VECTOR_LEN(&iu->iu_md))
+    return NULL;
+  return VECTOR_ITEM(&iu->iu_md, ref - 1).im_str;
+}
+
+
+/**
+ * Walk the scope chain until we hit a DIFile and return its index in
+ * iu_debug_files
+ */
+static int
+md_file(ir_unit_t *iu, uint32_t id)
+{
+  for(int depth = 0; depth < 64 && id < VECTOR_LEN(&iu->iu_md); depth++) {
+    ir_md_t *im = &VECTOR_ITEM(&iu->iu_md, id);
+
+    switch(im->im_code) {
+    case METADATA_FILE:
+      if(im->im_file == -1) {
+        const char *name = md_string(iu, im->im_fileref) ?: "???";
+        int i;
+        for(i = 0; i < VECTOR_LEN(&iu->iu_debug_files); i++)
+          if(!strcmp(VECTOR_ITEM(&iu->iu_debug_files, i), name))
+            break;
+        if(i == VECTOR_LEN(&iu->iu_debug_files))
+          VECTOR_PUSH_BACK(&iu->iu_debug_files, strdup(name));
+        im->im_file = i;
+      }
+      return im->im_file;
+
+    case METADATA_SUBPROGRAM:
+    case METADATA_LEXICAL_BLOCK:
+    case METADATA_LEXICAL_BLOCK_FILE:
+      if(im->im_fileref) {
+        id = im->im_fileref - 1;
+      } else if(im->im_scope) {
+        id = im->im_scope - 1;
+      } else {
+        return -1;
+      }
+      continue;
+
+    default:
+      return -1;
+    }
+  }
+  return -1;
+}
+
+
+/**
+ *
+ */
+static const char *
+debuginfo_file_name(ir_unit_t *iu, int file)
+{
+  if(file < 0 || file >= VECTOR_LEN(&iu->iu_debug_files))
+    return "???";
+  return VECTOR_ITEM(&iu->iu_debug_files, file);
+}
+
+
+/**
+ * Record the source line of the instruction about to be emitted
+ */
+static void
+debuginfo_line_add(ir_unit_t *iu, const ir_instr_t *ii)
+{
+  if(ii->ii_line == 0)
+    return;
+
+  const uint32_t offset = iu->iu_text_ptr - iu->iu_text_alloc;
+  const int n = VECTOR_LEN(&iu->iu_lines);
+  if(n) {
+    ir_line_t *last = &VECTOR_ITEM(&iu->iu_lines, n - 1);
+    if(last->il_line == ii->ii_line && last->il_file == ii->ii_file)
+      return;
+    if(last->il_offset == offset) {
+      last->il_line = ii->ii_line;
+      last->il_file = ii->ii_file;
+      return;
+    }
+  }
+  ir_line_t il = {offset, ii->ii_line, ii->ii_file};
+  VECTOR_PUSH_BACK(&iu->iu_lines, il);
+}
+
+
+/**
+ * Copy the line table built during emit to the function
+ */
+static void
+debuginfo_lines_finalize(ir_unit_t *iu, ir_function_t *f)
+{
+  free(f->if_lines);
+  f->if_lines = NULL;
+  f->if_num_lines = VECTOR_LEN(&iu->iu_lines);
+  if(f->if_num_lines) {
+    size_t size = f->if_num_lines * sizeof(ir_line_t);
+    f->if_lines = malloc(size);
+    memcpy(f->if_lines, iu->iu_lines.vh_p, size);
+  }
+  VECTOR_RESIZE(&iu->iu_lines, 0);
+}
+
+
+/**
+ * Find the source line for a VM text offset, NULL if unknown
+ */
+static const ir_line_t *
+debuginfo_line_lookup(const ir_function_t *f, int32_t pc)
+{
+  if(pc < 0 || f->if_num_lines == 0 || pc < f->if_lines[0].il_offset)
+    return NULL;
+
+  int lo = 0, hi = f->if_num_lines;
+  while(hi - lo > 1) {
+    const int mid = (lo + hi) / 2;
+    if(f->if_lines[mid].il_offset <= pc)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return &f->if_lines[lo];
+}
+
+
+/**
+ * Metadata is only needed while parsing
+ */
+static void
+debuginfo_md_clear(ir_unit_t *iu, int len)
+{
+  for(int i = len; i < VECTOR_LEN(&iu->iu_md); i++)
+    free(VECTOR_ITEM(&iu->iu_md, i).im_str);
+  VECTOR_RESIZE(&iu->iu_md, len);
+}
+
+
+/**
+ *
+ */
+static void
+debuginfo_destroy(ir_unit_t *iu)
+{
+  debuginfo_md_clear(iu, 0);
+  VECTOR_CLEAR(&iu->iu_md);
+
+  for(int i = 0; i < VECTOR_LEN(&iu->iu_debug_files); i++)
+    free(VECTOR_ITEM(&iu->iu_debug_files, i));
+  VECTOR_CLEAR(&iu->iu_debug_files);
+  VECTOR_CLEAR(&iu->iu_lines);
+}
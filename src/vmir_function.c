@@ -58,6 +58,8 @@ bb_destroy(ir_bb_t *ib, ir_function_t *f)
   while((ii = TAILQ_FIRST(&ib->ib_instrs)) != NULL) {
     instr_destroy(ii);
   }
+  free(ib->ib_live_out.ls_values);
+  free(ib->ib_live_in.ls_values);
   free(ib->ib_name);
   free(ib);
 }
@@ -77,6 +79,10 @@ function_prepare_parse(ir_unit_t *iu, ir_function_t *f)
   else
     iu->iu_debug_flags_func = iu->iu_debug_flags;
 
+  iu->iu_debugloc_bb = NULL;
+  iu->iu_debugloc_line = 0;
+  iu->iu_debugloc_file = -1;
+
   f->if_regframe_size = 8; // Make space for temporary register for VM use
   f->if_callarg_size = 0;
 
@@ -163,6 +169,7 @@ function_destroy(ir_function_t *f)
   free(f->if_name);
   free(f->if_vm_text);
   free(f->if_instr_backrefs);
+  free(f->if_lines);
   free(f);
 }
 
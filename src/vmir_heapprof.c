@@ -0,0 +1,457 @@
+/*
+ * Copyright (c) 2016 Lonelycoder AB
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+ * Guest heap allocation profiler
+ *
+ * Allocations made via malloc(), calloc(), realloc() (and operator new)
+ * are attributed to a call site: The guest function calling the
+ * allocator and where in its caller that function was called from.
+ * Without stack frames (VM_NO_STACK_FRAME) all allocations end up
+ * in a single unknown site.
+ *
+ * Every live allocation is kept in a hash table (keyed on guest address)
+ * so frees can be charged back to their site along with the lifetime of
+ * the allocation.
+ *
+ * Every HEAPPROF_SNAPSHOT_INTERVAL allocator calls the heap is walked
+ * with vmir_walk_heap() to track fragmentation over time.
+ */
+
+#define HEAPPROF_SITE_HASH_SIZE     1024
+#define HEAPPROF_SIZE_CLASSES       16   // <=16, <=32, ... <=256k, >256k
+#define HEAPPROF_SNAPSHOT_INTERVAL  16384
+
+
+typedef struct heapprof_site {
+  int hs_func;           // gfid of function calling the allocator
+  int hs_caller;         // gfid of its caller
+  int hs_caller_pc;      // Position in hs_caller
+  int hs_next;           // Next site in hash bucket
+
+  uint64_t hs_allocs;
+  uint64_t hs_frees;
+  uint64_t hs_bytes;
+  uint64_t hs_live_bytes;
+  uint64_t hs_peak_live_bytes;
+  uint64_t hs_lifetime;  // Sum of lifetimes of freed allocations (ns)
+  uint64_t hs_size_classes[HEAPPROF_SIZE_CLASSES];
+} heapprof_site_t;
+
+
+typedef struct heapprof_alloc {
+  uint32_t ha_addr;      // 0 means free slot
+  uint32_t ha_size;
+  int ha_site;
+  int64_t ha_ts;
+} heapprof_alloc_t;
+
+
+typedef struct heapprof_snapshot {
+  uint64_t hn_event;
+  uint32_t hn_used;
+  uint32_t hn_free;
+  uint32_t hn_free_blocks;
+  uint32_t hn_largest_free;
+} heapprof_snapshot_t;
+
+
+typedef struct vmir_heapprof {
+  VECTOR_HEAD(, heapprof_site_t) hp_sites;
+  int hp_site_hash[HEAPPROF_SITE_HASH_SIZE];
+
+  heapprof_alloc_t *hp_allocs;  // Open addressing, linear probing
+  uint32_t hp_allocs_mask;
+  uint32_t hp_num_allocs;
+
+  uint64_t hp_events;
+  VECTOR_HEAD(, heapprof_snapshot_t) hp_snapshots;
+} vmir_heapprof_t;
+
+
+/**
+ *
+ */
+static int
+heapprof_size_class(uint32_t size)
+{
+  int c = 0;
+  while(c < HEAPPROF_SIZE_CLASSES - 1 && size > (16u << c))
+    c++;
+  return c;
+}
+
+
+/**
+ * Find (or create) the site for the allocator call being made right now
+ */
+static int
+heapprof_site_get(ir_unit_t *iu, vmir_heapprof_t *hp)
+{
+  int func = -1, caller = -1, caller_pc = -1;
+
+#ifndef VM_NO_STACK_FRAME
+  // Calls to external functions don't get a frame of their own so the
+  // current frame is the one of the function calling the allocator
+  const vm_frame_t *f = iu->iu_current_frame;
+  if(f != NULL && f->func != NULL) {
+    func = f->func->if_gfid;
+    const vm_frame_t *p = f->prev;
+    if(p != NULL && p->func != NULL && f->retpc != NULL &&
+       p->func->if_vm_text != NULL) {
+      caller = p->func->if_gfid;
+      caller_pc = (const void *)f->retpc - p->func->if_vm_text;
+    }
+  }
+#endif
+
+  const uint32_t h = (func * 31 + caller * 17 + caller_pc) &
+    (HEAPPROF_SITE_HASH_SIZE - 1);
+
+  for(int i = hp->hp_site_hash[h]; i != -1;) {
+    const heapprof_site_t *hs = &VECTOR_ITEM(&hp->hp_sites, i);
+    if(hs->hs_func == func && hs->hs_caller == caller &&
+       hs->hs_caller_pc == caller_pc)
+      return i;
+    i = hs->hs_next;
+  }
+
+  heapprof_site_t hs = {func, caller, caller_pc, hp->hp_site_hash[h]};
+  const int idx = VECTOR_LEN(&hp->hp_sites);
+  VECTOR_PUSH_BACK(&hp->hp_sites, hs);
+  hp->hp_site_hash[h] = idx;
+  return idx;
+}
+
+
+/**
+ *
+ */
+static uint32_t
+heapprof_alloc_hash(const vmir_heapprof_t *hp, uint32_t addr)
+{
+  return (addr * 2654435761u) & hp->hp_allocs_mask;
+}
+
+
+/**
+ *
+ */
+static void
+heapprof_alloc_insert(vmir_heapprof_t *hp, const heapprof_alloc_t *ha)
+{
+  uint32_t i = heapprof_alloc_hash(hp, ha->ha_addr);
+  while(hp->hp_allocs[i].ha_addr)
+    i = (i + 1) & hp->hp_allocs_mask;
+  hp->hp_allocs[i] = *ha;
+  hp->hp_num_allocs++;
+}
+
+
+/**
+ *
+ */
+static void
+heapprof_alloc_grow(vmir_heapprof_t *hp)
+{
+  heapprof_alloc_t *old = hp->hp_allocs;
+  const uint32_t oldsize = old != NULL ? hp->hp_allocs_mask + 1 : 0;
+  const uint32_t newsize = oldsize ? oldsize * 2 : 4096;
+
+  hp->hp_allocs = calloc(newsize, sizeof(heapprof_alloc_t));
+  hp->hp_allocs_mask = newsize - 1;
+  hp->hp_num_allocs = 0;
+  for(uint32_t i = 0; i < oldsize; i++)
+    if(old[i].ha_addr)
+      heapprof_alloc_insert(hp, &old[i]);
+  free(old);
+}
+
+
+/**
+ * Remove the allocation at 'addr', returns 0 if it was not found
+ */
+static int
+heapprof_alloc_remove(vmir_heapprof_t *hp, uint32_t addr,
+                      heapprof_alloc_t *out)
+{
+  if(hp->hp_allocs == NULL)
+    return 0;
+
+  const uint32_t mask = hp->hp_allocs_mask;
+  uint32_t i = heapprof_alloc_hash(hp, addr);
+  while(hp->hp_allocs[i].ha_addr != addr) {
+    if(hp->hp_allocs[i].ha_addr == 0)
+      return 0;
+    i = (i + 1) & mask;
+  }
+  *out = hp->hp_allocs[i];
+
+  // Backward shift deletion so no tombstones are needed
+  uint32_t j = i;
+  while(1) {
+    j = (j + 1) & mask;
+    if(hp->hp_allocs[j].ha_addr == 0)
+      break;
+    const uint32_t k = heapprof_alloc_hash(hp, hp->hp_allocs[j].ha_addr);
+    if(((j - k) & mask) < ((j - i) & mask))
+      continue;
+    hp->hp_allocs[i] = hp->hp_allocs[j];
+    i = j;
+  }
+  hp->hp_allocs[i].ha_addr = 0;
+  hp->hp_num_allocs--;
+  return 1;
+}
+
+
+/**
+ *
+ */
+static void
+heapprof_walker(void *opaque, uint32_t addr, uint32_t size, int inuse)
+{
+  heapprof_snapshot_t *hn = opaque;
+  if(inuse) {
+    hn->hn_used += size;
+  } else {
+    hn->hn_free += size;
+    hn->hn_free_blocks++;
+    hn->hn_largest_free = VMIR_MAX(hn->hn_largest_free, size);
+  }
+}
+
+
+/**
+ *
+ */
+static void
+heapprof_snapshot(ir_unit_t *iu, vmir_heapprof_t *hp)
+{
+  heapprof_snapshot_t hn = {hp->hp_events};
+  vmir_walk_heap(iu, heapprof_walker, &hn);
+  VECTOR_PUSH_BACK(&hp->hp_snapshots, hn);
+}
+
+
+/**
+ *
+ */
+static void
+heapprof_event(ir_unit_t *iu, vmir_heapprof_t *hp)
+{
+  if(++hp->hp_events % HEAPPROF_SNAPSHOT_INTERVAL == 0)
+    heapprof_snapshot(iu, hp);
+}
+
+
+/**
+ * Called after a successful allocation of 'size' bytes at guest 'addr'
+ */
+static void
+heapprof_alloc(ir_unit_t *iu, uint32_t addr, uint32_t size)
+{
+  vmir_heapprof_t *hp = iu->iu_heapprof;
+  if(hp == NULL || addr == 0)
+    return;
+
+  const int site = heapprof_site_get(iu, hp);
+  heapprof_site_t *hs = &VECTOR_ITEM(&hp->hp_sites, site);
+  hs->hs_allocs++;
+  hs->hs_bytes += size;
+  hs->hs_live_bytes += size;
+  hs->hs_peak_live_bytes = VMIR_MAX(hs->hs_peak_live_bytes,
+                                    hs->hs_live_bytes);
+  hs->hs_size_classes[heapprof_size_class(size)]++;
+
+  if(hp->hp_allocs == NULL || hp->hp_num_allocs * 2 > hp->hp_allocs_mask)
+    heapprof_alloc_grow(hp);
+
+  heapprof_alloc_t ha = {addr, size, site, get_ts_ns()};
+  heapprof_alloc_insert(hp, &ha);
+  heapprof_event(iu, hp);
+}
+
+
+/**
+ * Called before the allocation at guest 'addr' is released
+ */
+static void
+heapprof_free(ir_unit_t *iu, uint32_t addr)
+{
+  vmir_heapprof_t *hp = iu->iu_heapprof;
+  heapprof_alloc_t ha;
+  if(hp == NULL || addr == 0 || !heapprof_alloc_remove(hp, addr, &ha))
+    return;
+
+  heapprof_site_t *hs = &VECTOR_ITEM(&hp->hp_sites, ha.ha_site);
+  hs->hs_frees++;
+  hs->hs_live_bytes -= ha.ha_size;
+  hs->hs_lifetime += get_ts_ns() - ha.ha_ts;
+  heapprof_event(iu, hp);
+}
+
+
+/**
+ *
+ */
+int
+vmir_heap_profile_enable(ir_unit_t *iu)
+{
+  if(iu->iu_heapprof != NULL)
+    return 0;
+  vmir_heapprof_t *hp = calloc(1, sizeof(vmir_heapprof_t));
+  if(hp == NULL)
+    return -1;
+  memset(hp->hp_site_hash, 0xff, sizeof(hp->hp_site_hash));
+  iu->iu_heapprof = hp;
+  return 0;
+}
+
+
+/**
+ *
+ */
+static int
+heapprof_site_cmp(const heapprof_site_t **a, const heapprof_site_t **b)
+{
+  const uint64_t ba = (*a)->hs_bytes;
+  const uint64_t bb = (*b)->hs_bytes;
+  return ba < bb ? 1 : ba > bb ? -1 : 0;
+}
+
+
+/**
+ *
+ */
+static void
+heapprof_print_site(ir_unit_t *iu, const heapprof_site_t *hs)
+{
+  if(hs->hs_func == -1) {
+    printf("???");
+    return;
+  }
+  printf("%s()", VECTOR_ITEM(&iu->iu_functions, hs->hs_func)->if_name);
+  if(hs->hs_caller == -1)
+    return;
+
+  const ir_function_t *f = VECTOR_ITEM(&iu->iu_functions, hs->hs_caller);
+  const ir_line_t *il = debuginfo_line_lookup(f, hs->hs_caller_pc);
+  if(il != NULL)
+    printf(" <- %s() at %s:%d", f->if_name,
+           debuginfo_file_name(iu, il->il_file), il->il_line);
+  else
+    printf(" <- %s()", f->if_name);
+}
+
+
+/**
+ *
+ */
+void
+vmir_heap_profile_dump(ir_unit_t *iu, int max_sites)
+{
+  vmir_heapprof_t *hp = iu->iu_heapprof;
+  if(hp == NULL)
+    return;
+
+  const int num_sites = VECTOR_LEN(&hp->hp_sites);
+  const heapprof_site_t **v = malloc(sizeof(heapprof_site_t *) *
+                                     (num_sites + 1));
+  for(int i = 0; i < num_sites; i++)
+    v[i] = &VECTOR_ITEM(&hp->hp_sites, i);
+  qsort(v, num_sites, sizeof(heapprof_site_t *), (void *)heapprof_site_cmp);
+
+  const int num = max_sites > 0 ? VMIR_MIN(num_sites, max_sites) : num_sites;
+
+  printf("%10s %10s %12s %10s %10s %8s %10s  Site\n",
+         "Allocs", "Frees", "Bytes", "Live", "Peak live", "Size",
+         "Life(us)");
+  for(int i = 0; i < num; i++) {
+    const heapprof_site_t *hs = v[i];
+
+    // Most common size class
+    int c = 0;
+    for(int j = 1; j < HEAPPROF_SIZE_CLASSES; j++)
+      if(hs->hs_size_classes[j] > hs->hs_size_classes[c])
+        c = j;
+
+    // The last class holds everything above the one before it
+    const int last = c == HEAPPROF_SIZE_CLASSES - 1;
+    const int limit = last ? 16 << (c - 1) : 16 << c;
+    char sizeclass[16];
+    snprintf(sizeclass, sizeof(sizeclass), "%s%d%s",
+             last ? ">" : "<=",
+             limit >= 1024 ? limit / 1024 : limit,
+             limit >= 1024 ? "k" : "");
+
+    printf("%10"PRIu64" %10"PRIu64" %12"PRIu64" %10"PRIu64" %10"PRIu64
+           " %8s %10"PRIu64"  ",
+           hs->hs_allocs, hs->hs_frees, hs->hs_bytes, hs->hs_live_bytes,
+           hs->hs_peak_live_bytes, sizeclass,
+           hs->hs_frees ? hs->hs_lifetime / hs->hs_frees / 1000 : 0);
+    heapprof_print_site(iu, hs);
+    printf("\n");
+  }
+  free(v);
+
+  // Current state is always the last row
+  heapprof_snapshot(iu, hp);
+
+  const int num_snapshots = VECTOR_LEN(&hp->hp_snapshots);
+  const int step = (num_snapshots + 15) / 16;
+
+  printf("\n%12s %10s %10s %10s %12s %6s\n",
+         "Event", "Used", "Free", "Free blks", "Largest free", "Frag");
+  for(int i = 0; i < num_snapshots; i++) {
+    if(i % step && i != num_snapshots - 1)
+      continue;
+    const heapprof_snapshot_t *hn = &VECTOR_ITEM(&hp->hp_snapshots, i);
+    // Share of free memory not usable for an allocation of the largest
+    // free block size
+    const int frag = hn->hn_free ?
+      100 - (int)((uint64_t)hn->hn_largest_free * 100 / hn->hn_free) : 0;
+    printf("%12"PRIu64" %10u %10u %10u %12u %5d%%\n",
+           hn->hn_event, hn->hn_used, hn->hn_free, hn->hn_free_blocks,
+           hn->hn_largest_free, frag);
+  }
+  VECTOR_POP(&hp->hp_snapshots);
+}
+
+
+/**
+ *
+ */
+static void
+heapprof_destroy(ir_unit_t *iu)
+{
+  vmir_heapprof_t *hp = iu->iu_heapprof;
+  if(hp == NULL)
+    return;
+  VECTOR_CLEAR(&hp->hp_sites);
+  VECTOR_CLEAR(&hp->hp_snapshots);
+  free(hp->hp_allocs);
+  free(hp);
+  iu->iu_heapprof = NULL;
+}
@@ -277,6 +277,22 @@ typedef struct ir_instr_ternary {
 } ir_instr_ternary_t;
 
 
+/**
+ * Division or remainder by a constant, strength reduced into a
+ * multiply-high + shift sequence (or shift + sign fixup when
+ * the divisor is a power of two)
+ */
+typedef struct ir_instr_divc {
+  ir_instr_t super;
+  int op;              // BINOP_UDIV, BINOP_SDIV, BINOP_UREM or BINOP_SREM
+  ir_valuetype_t value;
+  uint32_t divisor;
+  uint32_t magic;      // 0 if divisor is a power of two
+  int shift;
+  int add;             // Magic needs the 33rd bit (add-fixup sequence)
+} ir_instr_divc_t;
+
+
 /**
  *
  */
@@ -534,6 +550,8 @@ instr_add_before(size_t size, instr_class_t ic, ir_instr_t *before)
   ir_bb_t *ib = before->ii_bb;
   ir_instr_t *ii = instr_create(size, ic);
   ii->ii_bb = ib;
+  ii->ii_file = before->ii_file;
+  ii->ii_line = before->ii_line;
   TAILQ_INSERT_BEFORE(before, ii, ii_link);
   return ii;
 }
@@ -548,6 +566,8 @@ instr_add_after(size_t size, instr_class_t ic, ir_instr_t *after)
   ir_bb_t *ib = after->ii_bb;
   ir_instr_t *ii = instr_create(size, ic);
   ii->ii_bb = ib;
+  ii->ii_file = after->ii_file;
+  ii->ii_line = after->ii_line;
   TAILQ_INSERT_AFTER(&ib->ib_instrs,  after, ii, ii_link);
   return ii;
 }
@@ -1226,6 +1246,32 @@ parse_extractval(ir_unit_t *iu, unsigned int argc, const ir_arg_t *argv)
   value_alloc_instr_ret(iu, current_type_index, &ii->super);
 }
 
+/**
+ * Attach a source location to the instruction created by the previous
+ * record. DEBUG_LOC_AGAIN reuses the last location seen
+ */
+static void
+parse_debug_loc(ir_unit_t *iu, int op, unsigned int argc,
+                const ir_arg_t *argv)
+{
+  if(op == FUNC_CODE_DEBUG_LOC) {
+    if(argc < 3)
+      parser_error(iu, "Bad debug loc");
+    iu->iu_debugloc_line = argv[0].i64;
+    iu->iu_debugloc_file = argv[2].i64 ? md_file(iu, argv[2].i64 - 1) : -1;
+  }
+
+  ir_bb_t *ib = iu->iu_debugloc_bb;
+  if(ib == NULL)
+    return;
+  ir_instr_t *ii = TAILQ_LAST(&ib->ib_instrs, ir_instr_queue);
+  if(ii == NULL || ii == iu->iu_debugloc_prev)
+    return;
+  ii->ii_file = iu->iu_debugloc_file;
+  ii->ii_line = iu->iu_debugloc_line;
+}
+
+
 /**
  *
  */
@@ -1235,6 +1281,16 @@ function_rec_handler(ir_unit_t *iu, int op,
 {
   ir_function_t *f = iu->iu_current_function;
 
+  if(op == FUNC_CODE_DEBUG_LOC || op == FUNC_CODE_DEBUG_LOC_AGAIN) {
+    parse_debug_loc(iu, op, argc, argv);
+    return;
+  }
+
+  // Remember where the instruction (if any) for this record ends up
+  iu->iu_debugloc_bb = iu->iu_current_bb;
+  iu->iu_debugloc_prev = iu->iu_current_bb ?
+    TAILQ_LAST(&iu->iu_current_bb->ib_instrs, ir_instr_queue) : NULL;
+
   switch(op) {
   case FUNC_CODE_DECLAREBLOCKS:
 
@@ -1772,6 +1828,23 @@ instr_print(char **dstp, ir_unit_t *iu, const ir_instr_t *ii, int flags)
       len += value_print_vt(dstp, iu, mla->arg3);
     }
     break;
+  case IR_IC_DIVC:
+    {
+      ir_instr_divc_t *d = (ir_instr_divc_t *)ii;
+      const char *op = "???";
+      switch(d->op) {
+      case BINOP_UDIV:       op = "udivc"; break;
+      case BINOP_SDIV:       op = "sdivc"; break;
+      case BINOP_UREM:       op = "uremc"; break;
+      case BINOP_SREM:       op = "sremc"; break;
+      }
+      len += addstr(dstp, op);
+      len += addstr(dstp, " ");
+      len += value_print_vt(dstp, iu, d->value);
+      len += addstrf(dstp, ", #%u magic:0x%x shift:%d%s",
+                     d->divisor, d->magic, d->shift, d->add ? " add" : "");
+    }
+    break;
   }
 
   if(flags & 1) {
@@ -1921,6 +1994,7 @@ instr_have_side_effects(const ir_instr_t *ii)
   case IR_IC_EXTRACTVAL:
   case IR_IC_CMP_SELECT:
   case IR_IC_MLA:
+  case IR_IC_DIVC:
     return 0;
   }
   return 1;
@@ -38,10 +38,135 @@ static __inline void *mem_rdptr(ir_unit_t *iu, uint32_t offset)
 
 
 
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include <errno.h>
+
+/**
+ * Allocations of at least HEAP_LARGE_ALLOC bytes are page aligned (TLSF
+ * heaps only) and their pages are handed back to the OS when freed.
+ * vmir_trim_heap() does the same for all free memory.
+ */
+#define HEAP_LARGE_ALLOC (256 * 1024)
+#define HEAP_PAGE_SIZE   4096
+
+/**
+ * Let the OS drop the pages fully inside [start, end), they will read
+ * back as zero. Returns number of bytes released
+ */
+static size_t
+vmir_heap_release(ir_unit_t *iu, void *start, void *end)
+{
+#ifdef MADV_DONTNEED
+  intptr_t s = VMIR_ALIGN((intptr_t)start, HEAP_PAGE_SIZE);
+  intptr_t e = (intptr_t)end & ~(intptr_t)(HEAP_PAGE_SIZE - 1);
+  if(e <= s || madvise((void *)s, e - s, MADV_DONTNEED))
+    return 0;
+  iu->iu_stats.heap_released_bytes += e - s;
+  return e - s;
+#else
+  return 0;
+#endif
+}
+
+
 #ifdef VMIR_USE_TLSF
 
 #include "tlsf.h"
 
+/**
+ * A free TLSF block keeps its free list links at the start of the
+ * payload and the next block's header overlaps the last word
+ */
+#define TLSF_FREE_HEAD (2 * sizeof(void *))
+#define TLSF_FREE_TAIL sizeof(size_t)
+
+
+/**
+ *
+ */
+static void *
+tlsf_heap_malloc(ir_unit_t *iu, int size)
+{
+  void *p;
+  if(size >= HEAP_LARGE_ALLOC)
+    p = tlsf_memalign(iu->iu_heap, HEAP_PAGE_SIZE,
+                      VMIR_ALIGN(size, HEAP_PAGE_SIZE));
+  else
+    p = tlsf_malloc(iu->iu_heap, size);
+  iu->iu_heap_usage += tlsf_block_size(p);
+  return p;
+}
+
+
+/**
+ *
+ */
+static void
+tlsf_heap_free(ir_unit_t *iu, void *ptr)
+{
+  const size_t size = tlsf_block_size(ptr);
+  iu->iu_heap_usage -= size;
+  tlsf_free(iu->iu_heap, ptr);
+  if(size >= HEAP_LARGE_ALLOC)
+    vmir_heap_release(iu, ptr + TLSF_FREE_HEAD, ptr + size - TLSF_FREE_TAIL);
+}
+
+
+/**
+ * tlsf_realloc() that releases pages of large blocks that are shrunk
+ * or moved
+ */
+static void *
+tlsf_heap_realloc(ir_unit_t *iu, void *ptr, int size)
+{
+  const size_t cursize = tlsf_block_size(ptr);
+  void *p = tlsf_realloc(iu->iu_heap, ptr, size);
+  if(p == NULL)
+    return NULL;
+  const size_t newsize = tlsf_block_size(p);
+  iu->iu_heap_usage += newsize - cursize;
+
+  if(cursize >= HEAP_LARGE_ALLOC) {
+    if(p != ptr)
+      vmir_heap_release(iu, ptr + TLSF_FREE_HEAD,
+                        ptr + cursize - TLSF_FREE_TAIL);
+    else if(newsize < cursize)  // Tail was split off as a new free block
+      vmir_heap_release(iu, ptr + newsize + TLSF_FREE_TAIL + TLSF_FREE_HEAD,
+                        ptr + cursize - TLSF_FREE_TAIL);
+  }
+  return p;
+}
+
+
+typedef struct trimaux {
+  ir_unit_t *iu;
+  size_t released;
+} trimaux_t;
+
+
+static void
+trim_walker(void *ptr, size_t size, int used, void *user)
+{
+  trimaux_t *aux = user;
+  if(!used && size >= 2 * HEAP_PAGE_SIZE)
+    aux->released += vmir_heap_release(aux->iu, ptr + TLSF_FREE_HEAD,
+                                       ptr + size - TLSF_FREE_TAIL);
+}
+
+
+size_t
+vmir_trim_heap(ir_unit_t *iu)
+{
+  trimaux_t aux = {iu, 0};
+  tlsf_walk_heap(iu->iu_heap, trim_walker, &aux);
+  return aux.released;
+}
+
+#ifndef VMIR_USE_SLAB
+
 static void
 vmir_heap_init(ir_unit_t *iu)
 {
@@ -53,8 +178,7 @@ vmir_heap_init(ir_unit_t *iu)
 static void *
 vmir_heap_malloc(ir_unit_t *iu, int size)
 {
-  void *p = tlsf_malloc(iu->iu_heap, size);
-  iu->iu_heap_usage += tlsf_block_size(p);
+  void *p = tlsf_heap_malloc(iu, size);
   iu->iu_stats.peak_heap_size =
     VMIR_MAX(iu->iu_stats.peak_heap_size, iu->iu_heap_usage);
   if(p == NULL)
@@ -67,28 +191,306 @@ static void
 vmir_heap_free(ir_unit_t *iu, void *ptr)
 {
   if(ptr != NULL)
-    iu->iu_heap_usage -= tlsf_block_size(ptr);
-  tlsf_free(iu->iu_heap, ptr);
+    tlsf_heap_free(iu, ptr);
 }
 
 static void *
 vmir_heap_realloc(ir_unit_t *iu, void *ptr, int size)
 {
-  if(ptr != NULL)
-    iu->iu_heap_usage -= tlsf_block_size(ptr);
-  void *p = tlsf_realloc(iu->iu_heap, ptr, size);
-  if(p) {
-    iu->iu_heap_usage += tlsf_block_size(p);
-    iu->iu_stats.peak_heap_size =
-      VMIR_MAX(iu->iu_stats.peak_heap_size, iu->iu_heap_usage);
+  if(ptr == NULL)
+    return vmir_heap_malloc(iu, size);
+
+  if(size == 0) {
+    vmir_heap_free(iu, ptr);
+    return NULL;
+  }
+
+  const int cursize = tlsf_block_size(ptr);
+  // tlsf_realloc() grows into the next block if free and trims on shrink
+  void *p = tlsf_heap_realloc(iu, ptr, size);
+  if(p == NULL) {
+    vmir_log(iu, VMIR_LOG_ERROR, "realloc(%d) failed", size);
+    return NULL;
+  }
+  if(p == ptr) {
+    iu->iu_stats.realloc_inplace++;
+  } else {
+    iu->iu_stats.realloc_copied++;
+    iu->iu_stats.realloc_copied_bytes += VMIR_MIN(cursize, size);
+  }
+  iu->iu_stats.peak_heap_size =
+    VMIR_MAX(iu->iu_stats.peak_heap_size, iu->iu_heap_usage);
+  return p;
+}
+
+static void
+vmir_heap_destroy(ir_unit_t *iu)
+{
+}
+
+#else
+
+/**
+ * Size class segregated allocator (VMIR_USE_SLAB)
+ *
+ * Allocations up to SLAB_MAX_SIZE bytes are served from slabs of
+ * SLAB_SIZE bytes, each holding objects of a single size class. Slabs
+ * are carved out of the TLSF heap (which also serves larger
+ * allocations) and are aligned to SLAB_SIZE so the slab owning a
+ * pointer is found with a single lookup in iu_slab_heap->sh_slabs.
+ * TLSF aligns host pointers so the table is indexed by host address
+ * relative to iu_mem rounded down to SLAB_SIZE.
+ *
+ * Slab metadata (occupancy bitmap etc) lives in host memory so the
+ * guest can't corrupt it. Each size class keeps a list of slabs with
+ * at least one free object making both malloc and free O(1).
+ */
+
+#define SLAB_SHIFT    14
+#define SLAB_SIZE     (1 << SLAB_SHIFT)
+#define SLAB_MAX_SIZE 2048
+
+static const uint16_t slab_class_size[] = {
+  16, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256,
+  320, 384, 448, 512, 640, 768, 896, 1024, 1280, 1536, 1792, 2048
+};
+
+#define SLAB_CLASSES (sizeof(slab_class_size) / sizeof(slab_class_size[0]))
+#define SLAB_BITMAP_WORDS (SLAB_SIZE / 16 / 64)
+
+LIST_HEAD(slab_list, slab);
+
+typedef struct slab {
+  LIST_ENTRY(slab) s_link;  // In sh_partial when not full
+  uint32_t s_addr;          // Guest address of first object
+  uint16_t s_class;
+  uint16_t s_size;
+  uint16_t s_num;           // Number of objects
+  uint16_t s_inuse;
+  uint16_t s_hint;          // No free objects before this bitmap word
+  uint64_t s_free[SLAB_BITMAP_WORDS];  // Bit set = object is free
+} slab_t;
+
+typedef struct slab_heap {
+  slab_t **sh_slabs;        // Indexed by slab_index()
+  int sh_num_slabs;
+  struct slab_list sh_partial[SLAB_CLASSES];
+  uint8_t sh_class[SLAB_MAX_SIZE / 16 + 1];  // (size + 15) / 16 -> class
+} slab_heap_t;
+
+
+static void
+vmir_heap_init(ir_unit_t *iu)
+{
+  iu->iu_heap = tlsf_create(iu->iu_mem + iu->iu_heap_start,
+                            iu->iu_memsize - iu->iu_heap_start);
+
+  slab_heap_t *sh = calloc(1, sizeof(slab_heap_t));
+  sh->sh_num_slabs = (iu->iu_memsize >> SLAB_SHIFT) + 2;
+  sh->sh_slabs = calloc(sh->sh_num_slabs, sizeof(slab_t *));
+  int c = 0;
+  for(int i = 0; i <= SLAB_MAX_SIZE / 16; i++) {
+    while(slab_class_size[c] < i * 16)
+      c++;
+    sh->sh_class[i] = c;
+  }
+  iu->iu_slab_heap = sh;
+}
+
+
+static void
+vmir_heap_destroy(ir_unit_t *iu)
+{
+  slab_heap_t *sh = iu->iu_slab_heap;
+  if(sh == NULL)
+    return;
+  for(int i = 0; i < sh->sh_num_slabs; i++)
+    free(sh->sh_slabs[i]);
+  free(sh->sh_slabs);
+  free(sh);
+  iu->iu_slab_heap = NULL;
+}
+
+
+/**
+ *
+ */
+static int
+slab_index(ir_unit_t *iu, const void *ptr)
+{
+  return ((intptr_t)ptr >> SLAB_SHIFT) - ((intptr_t)iu->iu_mem >> SLAB_SHIFT);
+}
+
+
+/**
+ * Returns the slab 'ptr' belongs to or NULL if it's a TLSF block
+ */
+static slab_t *
+slab_get(ir_unit_t *iu, const void *ptr)
+{
+  return iu->iu_slab_heap->sh_slabs[slab_index(iu, ptr)];
+}
+
+
+static slab_t *
+slab_create(ir_unit_t *iu, int c)
+{
+  slab_heap_t *sh = iu->iu_slab_heap;
+  void *mem = tlsf_memalign(iu->iu_heap, SLAB_SIZE, SLAB_SIZE);
+  if(mem == NULL)
+    return NULL;
+
+  slab_t *s = calloc(1, sizeof(slab_t));
+  s->s_addr = mem - iu->iu_mem;
+  s->s_class = c;
+  s->s_size = slab_class_size[c];
+  s->s_num = SLAB_SIZE / s->s_size;
+  for(int i = 0; i < s->s_num; i++)
+    s->s_free[i / 64] |= 1ULL << (i & 63);
+
+  sh->sh_slabs[slab_index(iu, mem)] = s;
+  LIST_INSERT_HEAD(&sh->sh_partial[c], s, s_link);
+  return s;
+}
+
+
+static void
+slab_destroy(ir_unit_t *iu, slab_t *s)
+{
+  LIST_REMOVE(s, s_link);
+  iu->iu_slab_heap->sh_slabs[slab_index(iu, iu->iu_mem + s->s_addr)] = NULL;
+  tlsf_free(iu->iu_heap, iu->iu_mem + s->s_addr);
+  free(s);
+}
+
+
+static void *
+slab_malloc(ir_unit_t *iu, int size)
+{
+  slab_heap_t *sh = iu->iu_slab_heap;
+  const int c = sh->sh_class[(size + 15) >> 4];
+  slab_t *s = LIST_FIRST(&sh->sh_partial[c]);
+  if(s == NULL && (s = slab_create(iu, c)) == NULL)
+    return NULL;
+
+  int w = s->s_hint;
+  while(s->s_free[w] == 0)
+    w++;
+  s->s_hint = w;
+  const int bit = __builtin_ctzll(s->s_free[w]);
+  s->s_free[w] &= ~(1ULL << bit);
+
+  if(++s->s_inuse == s->s_num)
+    LIST_REMOVE(s, s_link);
+
+  iu->iu_heap_usage += s->s_size;
+  return iu->iu_mem + s->s_addr + (w * 64 + bit) * s->s_size;
+}
+
+
+static void
+slab_free(ir_unit_t *iu, slab_t *s, void *ptr)
+{
+  slab_heap_t *sh = iu->iu_slab_heap;
+  const int idx = (uint32_t)(ptr - iu->iu_mem - s->s_addr) / s->s_size;
+  const int w = idx / 64;
+  const uint64_t mask = 1ULL << (idx & 63);
+  assert(!(s->s_free[w] & mask));
+
+  s->s_free[w] |= mask;
+  s->s_hint = VMIR_MIN(s->s_hint, w);
+  iu->iu_heap_usage -= s->s_size;
+
+  if(s->s_inuse-- == s->s_num)
+    LIST_INSERT_HEAD(&sh->sh_partial[s->s_class], s, s_link);
+
+  // Keep one empty slab per class around to avoid thrashing
+  if(s->s_inuse == 0 &&
+     (LIST_FIRST(&sh->sh_partial[s->s_class]) != s ||
+      LIST_NEXT(s, s_link) != NULL))
+    slab_destroy(iu, s);
+}
+
+
+static void *
+vmir_heap_malloc(ir_unit_t *iu, int size)
+{
+  void *p;
+  if(size >= 0 && size <= SLAB_MAX_SIZE) {
+    p = slab_malloc(iu, size);
   } else {
+    p = tlsf_heap_malloc(iu, size);
+  }
+  iu->iu_stats.peak_heap_size =
+    VMIR_MAX(iu->iu_stats.peak_heap_size, iu->iu_heap_usage);
+  if(p == NULL)
+    vmir_log(iu, VMIR_LOG_ERROR, "malloc(%d) failed", size);
+  return p;
+}
+
+
+static void
+vmir_heap_free(ir_unit_t *iu, void *ptr)
+{
+  if(ptr == NULL)
+    return;
+  slab_t *s = slab_get(iu, ptr);
+  if(s != NULL) {
+    slab_free(iu, s, ptr);
+  } else {
+    tlsf_heap_free(iu, ptr);
+  }
+}
+
+
+static void *
+vmir_heap_realloc(ir_unit_t *iu, void *ptr, int size)
+{
+  if(ptr == NULL)
+    return vmir_heap_malloc(iu, size);
 
-    if(size)
+  if(size == 0) {
+    vmir_heap_free(iu, ptr);
+    return NULL;
+  }
+
+  slab_t *s = slab_get(iu, ptr);
+  const int cursize = s != NULL ? s->s_size : tlsf_block_size(ptr);
+  if(s == NULL && size > SLAB_MAX_SIZE) {
+    void *p = tlsf_heap_realloc(iu, ptr, size);
+    iu->iu_stats.peak_heap_size =
+      VMIR_MAX(iu->iu_stats.peak_heap_size, iu->iu_heap_usage);
+    if(p == NULL) {
       vmir_log(iu, VMIR_LOG_ERROR, "realloc(%d) failed", size);
+    } else if(p == ptr) {
+      iu->iu_stats.realloc_inplace++;
+    } else {
+      iu->iu_stats.realloc_copied++;
+      iu->iu_stats.realloc_copied_bytes += cursize;
+    }
+    return p;
+  }
+
+  // Stay in the slab as long as the object fits and we don't waste
+  // more than half of it, otherwise move to a smaller size class
+  if(s != NULL && size <= cursize &&
+     (size > cursize / 2 || s->s_class == 0)) {
+    iu->iu_stats.realloc_inplace++;
+    return ptr;
   }
+
+  void *p = vmir_heap_malloc(iu, size);
+  if(p == NULL)
+    return NULL;
+  memcpy(p, ptr, VMIR_MIN(size, cursize));
+  vmir_heap_free(iu, ptr);
+  iu->iu_stats.realloc_copied++;
+  iu->iu_stats.realloc_copied_bytes += VMIR_MIN(size, cursize);
   return p;
 }
 
+#endif // VMIR_USE_SLAB
+
 
 
 
@@ -120,7 +522,21 @@ static void
 walker_ext(void *ptr, size_t size, int used, void* user)
 {
   walkeraux_t *aux = user;
-  aux->fn(aux->opaque, (uint32_t)(ptr - aux->iu->iu_mem), size, used);
+  const uint32_t addr = ptr - aux->iu->iu_mem;
+#ifdef VMIR_USE_SLAB
+  const slab_t *s = used ? slab_get(aux->iu, ptr) : NULL;
+  if(s != NULL) {
+    // Report the objects of the slab instead of the TLSF block
+    for(int i = 0; i < s->s_num; i++)
+      aux->fn(aux->opaque, addr + i * s->s_size, s->s_size,
+              !(s->s_free[i / 64] & (1ULL << (i & 63))));
+    const uint32_t tail = size - s->s_num * s->s_size;
+    if(tail)
+      aux->fn(aux->opaque, addr + s->s_num * s->s_size, tail, 1);
+    return;
+  }
+#endif
+  aux->fn(aux->opaque, addr, size, used);
 }
 
 
@@ -227,13 +643,22 @@ vmir_heap_free(ir_unit_t *iu, void *ptr)
   hb--;
   assert(hb->hb_magic == HEAP_MAGIC_ALLOC);
   hb->hb_magic = HEAP_MAGIC_FREE;
+  const int size = hb->hb_size;
 
   vmir_heap_merge_next(h, hb);
   heap_block_t *prev = TAILQ_PREV(hb, heap_block_queue, hb_link);
-  if(prev != NULL) {
+  if(prev != NULL && prev->hb_magic == HEAP_MAGIC_FREE) {
     assert(prev < hb);
     vmir_heap_merge_next(h, prev);
   }
+
+  if(size >= HEAP_LARGE_ALLOC)
+    vmir_heap_release(iu, ptr, (void *)hb + size);
+}
+
+static void
+vmir_heap_destroy(ir_unit_t *iu)
+{
 }
 
 static int
@@ -245,24 +670,63 @@ vmir_heap_usable_size(void *ptr)
   return hb->hb_size - sizeof(heap_block_t);
 }
 
+/**
+ * Shrink 'hb' to 'size' bytes (including header) and return the tail
+ * to the heap if it's large enough to be a block of its own
+ */
+static void
+vmir_heap_trim(heap_t *h, heap_block_t *hb, int size)
+{
+  int remain = hb->hb_size - size;
+  if(remain < sizeof(heap_block_t) * 2)
+    return;
+  heap_block_t *split = (void *)hb + size;
+  split->hb_magic = HEAP_MAGIC_FREE;
+  split->hb_size = remain;
+  TAILQ_INSERT_AFTER(&h->h_blocks, hb, split, hb_link);
+  vmir_heap_merge_next(h, split);
+  hb->hb_size = size;
+}
+
+
 static void *
 vmir_heap_realloc(ir_unit_t *iu, void *ptr, int size)
 {
-  void *n = NULL;
-  if(size) {
-    int cursize = vmir_heap_usable_size(ptr);
-    if(size < cursize)
-      return ptr;
+  if(ptr == NULL)
+    return vmir_heap_malloc(iu, size);
 
-    n = vmir_heap_malloc(iu, size);
-    if(n == NULL)
-      return NULL;
+  if(size == 0) {
+    vmir_heap_free(iu, ptr);
+    return NULL;
+  }
 
-    if(ptr != NULL)
+  heap_t *h = iu->iu_heap;
+  heap_block_t *hb = ptr;
+  hb--;
+  const int cursize = vmir_heap_usable_size(ptr);
+  const int newsize = VMIR_ALIGN(size + sizeof(heap_block_t), 16);
+
+  if(newsize > hb->hb_size) {
+    // Try to grow into the next block
+    heap_block_t *next = TAILQ_NEXT(hb, hb_link);
+    if(next == NULL || next->hb_magic != HEAP_MAGIC_FREE ||
+       hb->hb_size + next->hb_size < newsize) {
+
+      void *n = vmir_heap_malloc(iu, size);
+      if(n == NULL)
+        return NULL;
       memcpy(n, ptr, cursize);
+      vmir_heap_free(iu, ptr);
+      iu->iu_stats.realloc_copied++;
+      iu->iu_stats.realloc_copied_bytes += cursize;
+      return n;
+    }
+    vmir_heap_merge_next(h, hb);
   }
-  vmir_heap_free(iu, ptr);
-  return n;
+
+  vmir_heap_trim(h, hb, newsize);
+  iu->iu_stats.realloc_inplace++;
+  return ptr;
 }
 
 static void
@@ -281,6 +745,36 @@ vmir_heap_print0(ir_unit_t *iu)
 }
 
 
+size_t
+vmir_trim_heap(ir_unit_t *iu)
+{
+  heap_block_t *hb;
+  heap_t *h = iu->iu_heap;
+  size_t released = 0;
+  TAILQ_FOREACH(hb, &h->h_blocks, hb_link) {
+    if(hb->hb_magic == HEAP_MAGIC_FREE && hb->hb_size >= 2 * HEAP_PAGE_SIZE)
+      released += vmir_heap_release(iu, hb + 1, (void *)hb + hb->hb_size);
+  }
+  return released;
+}
+
+
+void
+vmir_walk_heap(ir_unit_t *iu,
+               void (*fn)(void *opaque, uint32_t addr, uint32_t size,
+                          int inuse),
+               void *opaque)
+{
+  heap_block_t *hb;
+  heap_t *h = iu->iu_heap;
+  TAILQ_FOREACH(hb, &h->h_blocks, hb_link) {
+    fn(opaque, (uint32_t)((void *)(hb + 1) - iu->iu_mem),
+       hb->hb_size - sizeof(heap_block_t),
+       hb->hb_magic == HEAP_MAGIC_ALLOC);
+  }
+}
+
+
 #endif
 
 
@@ -293,6 +787,7 @@ vmir_malloc(void *ret, const void *rf, ir_unit_t *iu)
   MEMTRACE("malloc(%d) = ...\n", size);
   void *p = vmir_heap_malloc(iu, size);
   vmir_vm_retptr(ret, p, iu);
+  heapprof_alloc(iu, *(uint32_t *)ret, size);
   MEMTRACE("malloc(%d) = 0x%x\n", size, *(uint32_t *)ret);
   return 0;
 }
@@ -307,6 +802,7 @@ vmir_calloc(void *ret, const void *rf, ir_unit_t *iu)
   if(p != NULL)
     memset(p, 0, size * nmemb);
   vmir_vm_retptr(ret, p, iu);
+  heapprof_alloc(iu, *(uint32_t *)ret, size * nmemb);
   MEMTRACE("calloc(%d, %d) = 0x%x\n", nmemb, size, *(uint32_t *)ret);
   return 0;
 }
@@ -318,6 +814,7 @@ vmir_free(void *ret, const void *rf, ir_unit_t *iu)
   if(ptr == 0)
     return 0;
   MEMTRACE("free(0x%x)\n", ptr);
+  heapprof_free(iu, ptr);
   vmir_heap_free(iu, iu->iu_mem + ptr);
   return 0;
 }
@@ -331,6 +828,11 @@ vmir_realloc(void *ret, const void *rf, ir_unit_t *iu)
   MEMTRACE("realloc(0x%x, %d) = ...\n", ptr, size);
   void *p = vmir_heap_realloc(iu, ptr ? iu->iu_mem + ptr : NULL, size);
   vmir_vm_retptr(ret, p, iu);
+  // realloc(ptr, 0) frees and a failed realloc leaves the block untouched
+  if(p != NULL || size == 0) {
+    heapprof_free(iu, ptr);
+    heapprof_alloc(iu, *(uint32_t *)ret, size);
+  }
   MEMTRACE("realloc(0x%x, %d) = 0x%x\n", ptr, size, *(uint32_t *)ret);
   return 0;
 }
@@ -415,7 +917,10 @@ typedef struct vmir_fd {
     int freelist;
   };
   vmir_fd_release_t *release;
+  const vmir_fsops_t *ops;  // For VMIR_FD_TYPE_FILEHANDLE
+  void *opaque;
   uint8_t type;
+  uint8_t closable;         // Close with ops->close() when released
 } vmir_fd_t;
 
 
@@ -465,22 +970,19 @@ vmir_fd_create(ir_unit_t *iu, intptr_t handle, int type,
   vmir_fd_t *vfd = &VECTOR_ITEM(&iu->iu_vfds, fd);
   vfd->fh = handle;
   vfd->release = relfunc;
+  vfd->ops = iu->iu_fsops;
+  vfd->opaque = iu->iu_opaque;
+  vfd->closable = 0;
   return fd;
 }
 
 
-static void
-vmir_fd_release_fh(ir_unit_t *iu, intptr_t handle)
-{
-  iu->iu_fsops->close(iu->iu_opaque, handle);
-}
-
-
 int
 vmir_fd_create_fh(ir_unit_t *iu, intptr_t handle, int closable)
 {
-  return vmir_fd_create(iu, handle, VMIR_FD_TYPE_FILEHANDLE,
-                        closable ? vmir_fd_release_fh : NULL);
+  int fd = vmir_fd_create(iu, handle, VMIR_FD_TYPE_FILEHANDLE, NULL);
+  VECTOR_ITEM(&iu->iu_vfds, fd).closable = closable;
+  return fd;
 }
 
 
@@ -488,6 +990,16 @@ static int
 vfd_open(ir_unit_t *iu, const char *path, vmir_openflags_t flags)
 {
   intptr_t fh;
+
+  if(iu->iu_archive != NULL &&
+     !vmir_archive_fsops.open(iu->iu_archive, path, flags, &fh)) {
+    int fd = vmir_fd_create_fh(iu, fh, 1);
+    vmir_fd_t *vfd = &VECTOR_ITEM(&iu->iu_vfds, fd);
+    vfd->ops = &vmir_archive_fsops;
+    vfd->opaque = iu->iu_archive;
+    return fd;
+  }
+
   vmir_errcode_t err = iu->iu_fsops->open(iu->iu_opaque, path, flags, &fh);
   if(err)
     return -1;
@@ -500,7 +1012,9 @@ vmir_fd_close(ir_unit_t *iu, int fd)
   vmir_fd_t *vfd = vfd_get(iu, fd, -1);
   if(vfd == NULL)
     return;
-  if(vfd->release)
+  if(vfd->closable)
+    vfd->ops->close(vfd->opaque, vfd->fh);
+  else if(vfd->release)
     vfd->release(iu, vfd->fh);
   vfd->type = 0;
   vfd->freelist = iu->iu_vfd_free;
@@ -514,7 +1028,7 @@ vfd_read(ir_unit_t *iu, int fd, char *buf, size_t size)
   vmir_fd_t *vfd = vfd_get(iu, fd, VMIR_FD_TYPE_FILEHANDLE);
   if(vfd == NULL)
     return -1;
-  return iu->iu_fsops->read(iu->iu_opaque, vfd->fh, buf, size);
+  return vfd->ops->read(vfd->opaque, vfd->fh, buf, size);
 }
 
 
@@ -524,7 +1038,7 @@ vfd_write(ir_unit_t *iu, int fd, const char *buf, size_t size)
   vmir_fd_t *vfd = vfd_get(iu, fd, VMIR_FD_TYPE_FILEHANDLE);
   if(vfd == NULL)
     return -1;
-  return iu->iu_fsops->write(iu->iu_opaque, vfd->fh, buf, size);
+  return vfd->ops->write(vfd->opaque, vfd->fh, buf, size);
 }
 
 
@@ -534,7 +1048,71 @@ vfd_seek(ir_unit_t *iu, int fd, int64_t offset, int whence)
   vmir_fd_t *vfd = vfd_get(iu, fd, VMIR_FD_TYPE_FILEHANDLE);
   if(vfd == NULL)
     return -1;
-  return iu->iu_fsops->seek(iu->iu_opaque, vfd->fh, offset, whence);
+  return vfd->ops->seek(vfd->opaque, vfd->fh, offset, whence);
+}
+
+
+/**
+ * preadv / pwritev for fsops that lack them
+ */
+static ssize_t
+vfd_rwv_emulated(const vmir_fd_t *vfd, const vmir_iovec_t *iov,
+                 int iovcnt, int64_t offset, int write)
+{
+  const vmir_fsops_t *ops = vfd->ops;
+  const intptr_t fh = vfd->fh;
+  int64_t pos = 0;
+
+  if(offset >= 0) {
+    pos = ops->seek(vfd->opaque, fh, 0, SEEK_CUR);
+    if(pos < 0 || ops->seek(vfd->opaque, fh, offset, SEEK_SET) < 0)
+      return -1;
+  }
+
+  ssize_t total = 0;
+  for(int i = 0; i < iovcnt; i++) {
+    ssize_t r = write ?
+      ops->write(vfd->opaque, fh, iov[i].iov_base, iov[i].iov_len) :
+      ops->read(vfd->opaque, fh, iov[i].iov_base, iov[i].iov_len);
+    if(r < 0) {
+      if(total == 0)
+        total = -1;
+      break;
+    }
+    total += r;
+    if(r < iov[i].iov_len)
+      break;
+  }
+
+  if(offset >= 0)
+    ops->seek(vfd->opaque, fh, pos, SEEK_SET);
+  return total;
+}
+
+
+static ssize_t
+vfd_preadv(ir_unit_t *iu, int fd, const vmir_iovec_t *iov, int iovcnt,
+           int64_t offset)
+{
+  vmir_fd_t *vfd = vfd_get(iu, fd, VMIR_FD_TYPE_FILEHANDLE);
+  if(vfd == NULL)
+    return -1;
+  if(vfd->ops->preadv != NULL)
+    return vfd->ops->preadv(vfd->opaque, vfd->fh, iov, iovcnt, offset);
+  return vfd_rwv_emulated(vfd, iov, iovcnt, offset, 0);
+}
+
+
+static ssize_t
+vfd_pwritev(ir_unit_t *iu, int fd, const vmir_iovec_t *iov, int iovcnt,
+            int64_t offset)
+{
+  vmir_fd_t *vfd = vfd_get(iu, fd, VMIR_FD_TYPE_FILEHANDLE);
+  if(vfd == NULL)
+    return -1;
+  if(vfd->ops->pwritev != NULL)
+    return vfd->ops->pwritev(vfd->opaque, vfd->fh, iov, iovcnt, offset);
+  return vfd_rwv_emulated(vfd, iov, iovcnt, offset, 1);
 }
 
 /*--------------------------------------------------------------------
@@ -584,6 +1162,63 @@ vmir_write(void *ret, const void *rf, ir_unit_t *iu)
   return 0;
 }
 
+static int
+vmir_pread(void *ret, const void *rf, ir_unit_t *iu)
+{
+  uint32_t fd = vmir_vm_arg32(&rf);
+  void *buf = vmir_vm_ptr(&rf, iu);
+  uint32_t nbyte = vmir_vm_arg32(&rf);
+  int64_t offset = vmir_vm_arg64(&rf);
+  vmir_iovec_t iov = { buf, nbyte };
+  vmir_vm_ret32(ret, offset < 0 ? -1 : vfd_preadv(iu, fd, &iov, 1, offset));
+  return 0;
+}
+
+static int
+vmir_pwrite(void *ret, const void *rf, ir_unit_t *iu)
+{
+  uint32_t fd = vmir_vm_arg32(&rf);
+  void *buf = vmir_vm_ptr(&rf, iu);
+  uint32_t nbyte = vmir_vm_arg32(&rf);
+  int64_t offset = vmir_vm_arg64(&rf);
+  vmir_iovec_t iov = { buf, nbyte };
+  vmir_vm_ret32(ret, offset < 0 ? -1 : vfd_pwritev(iu, fd, &iov, 1, offset));
+  return 0;
+}
+
+// Guest mmap() prot and flags, same values as sysroot <sys/mman.h>
+#define VMIR_PROT_WRITE    0x2
+#define VMIR_MAP_TYPE_MASK 0x3
+#define VMIR_MAP_SHARED    0x1
+#define VMIR_MAP_FIXED     0x10
+#define VMIR_MAP_ANONYMOUS 0x20
+
+static uint32_t mem_map_guest(ir_unit_t *iu, uint32_t len, int prot,
+                              int flags, int fd, int64_t offset);
+static int mapping_unmap(ir_unit_t *iu, uint32_t addr, int guest);
+
+static int
+vmir_mmap(void *ret, const void *rf, ir_unit_t *iu)
+{
+  vmir_vm_arg32(&rf);  // Address hint, ignored
+  uint32_t len = vmir_vm_arg32(&rf);
+  uint32_t prot = vmir_vm_arg32(&rf);
+  uint32_t flags = vmir_vm_arg32(&rf);
+  uint32_t fd = vmir_vm_arg32(&rf);
+  int64_t offset = vmir_vm_arg64(&rf);
+  uint32_t addr = mem_map_guest(iu, len, prot, flags, fd, offset);
+  vmir_vm_ret32(ret, addr ?: -1); // MAP_FAILED
+  return 0;
+}
+
+static int
+vmir_munmap(void *ret, const void *rf, ir_unit_t *iu)
+{
+  uint32_t addr = vmir_vm_arg32(&rf);
+  vmir_vm_ret32(ret, mapping_unmap(iu, addr, 1));
+  return 0;
+}
+
 static int
 vmir_lseek(void *ret, const void *rf, ir_unit_t *iu)
 {
@@ -605,14 +1240,12 @@ vmir_close(void *ret, const void *rf, ir_unit_t *iu)
 
 /*--------------------------------------------------------------------
  * stdio
+ *
+ * vFILE_t (see vmir.c) and its buffer live in guest memory. Refill and
+ * flush go straight to the fd layer (and thus the fd's fsops)
  */
 
-typedef struct vFILE {
-  FILE *fp;
-  ir_unit_t *iu;
-  int fd;
-  LIST_ENTRY(vFILE) link;
-} vFILE_t;
+#define VFILE_BUFSIZE 4096
 
 // http://pubs.opengroup.org/onlinepubs/9699919799/functions/fopen.html
 static const struct {
@@ -637,111 +1270,276 @@ static const struct {
 };
 
 
+/**
+ *
+ */
+static int
+vFILE_alloc_buf(ir_unit_t *iu, vFILE_t *vf)
+{
+  if(vf->buf)
+    return 0;
+  void *p = vmir_heap_malloc(iu, VFILE_BUFSIZE);
+  if(p == NULL) {
+    vf->flags |= VFILE_ERROR;
+    return -1;
+  }
+  vf->buf = vmir_host_to_vmaddr(iu, p);
+  vf->bufsize = VFILE_BUFSIZE;
+  return 0;
+}
 
-#if  defined(__APPLE__) || defined(__ANDROID__)
-#define USE_FUNOPEN 1
-#endif
-
-#if USE_FUNOPEN
 
-static int
-fun_read(void *fh, char *buf, int size)
+/**
+ * Write all of 'iov' (which is modified), returns number of bytes written
+ */
+static size_t
+vFILE_writev(ir_unit_t *iu, vFILE_t *vf, vmir_iovec_t *iov, int iovcnt)
 {
-  vFILE_t *vf = fh;
-  return vfd_read(vf->iu, vf->fd, buf, size);
+  size_t total = 0;
+
+  while(1) {
+    while(iovcnt > 0 && iov->iov_len == 0) {
+      iov++;
+      iovcnt--;
+    }
+    if(iovcnt == 0)
+      break;
+
+    ssize_t r = vfd_pwritev(iu, vf->fd, iov, iovcnt, -1);
+    if(r <= 0) {
+      vf->flags |= VFILE_ERROR;
+      break;
+    }
+    total += r;
+
+    while(r > 0) {
+      size_t n = VMIR_MIN(r, iov->iov_len);
+      iov->iov_base += n;
+      iov->iov_len -= n;
+      r -= n;
+      if(iov->iov_len == 0) {
+        iov++;
+        iovcnt--;
+      }
+    }
+  }
+  return total;
 }
 
+
+/**
+ * Write out buffered data and leave write mode
+ */
 static int
-fun_write(void *fh, const char *buf, int size)
+vFILE_flush(ir_unit_t *iu, vFILE_t *vf)
 {
-  vFILE_t *vf = fh;
-  return vfd_write(vf->iu, vf->fd, buf, size);
+  if(vf->wend == 0)
+    return 0;
+
+  const uint32_t len = vf->wpos - vf->buf;
+  vmir_iovec_t iov = { iu->iu_mem + vf->buf, len };
+  vf->wpos = vf->wend = 0;
+  return vFILE_writev(iu, vf, &iov, 1) == len ? 0 : -1;
 }
 
-static fpos_t
-fun_seek(void *fh, fpos_t offset, int whence)
+
+/**
+ * Drop read ahead and seek back so the fd position matches the stream
+ */
+static void
+vFILE_unread(ir_unit_t *iu, vFILE_t *vf)
 {
-  vFILE_t *vf = fh;
-  return vfd_seek(vf->iu, vf->fd, offset, whence);
+  if(vf->rpos != vf->rend)
+    vfd_seek(iu, vf->fd, (int64_t)vf->rpos - vf->rend, SEEK_CUR);
+  vf->rpos = vf->rend = 0;
 }
 
-#else
 
-static ssize_t
-cookie_read(void *fh, char *buf, size_t size)
+/**
+ * Returns number of bytes read, short on EOF or error
+ */
+static size_t
+vFILE_read(ir_unit_t *iu, vFILE_t *vf, void *dst, size_t size)
 {
-  vFILE_t *vf = fh;
-  return vfd_read(vf->iu, vf->fd, buf, size);
+  size_t done = 0;
+
+  if(vFILE_flush(iu, vf))
+    return 0;
+
+  while(done < size) {
+    uint32_t avail = vf->rend - vf->rpos;
+    if(avail) {
+      avail = VMIR_MIN(avail, size - done);
+      memcpy(dst + done, iu->iu_mem + vf->rpos, avail);
+      vf->rpos += avail;
+      done += avail;
+      continue;
+    }
+
+    if(vf == iu->iu_stdin && iu->iu_stdout != NULL)
+      vFILE_flush(iu, iu->iu_stdout);
+
+    if(vFILE_alloc_buf(iu, vf))
+      break;
+
+    // Large requests are read straight into the destination, with
+    // whatever comes after refilling the buffer in the same call
+    const size_t want = size - done >= vf->bufsize ? size - done : 0;
+    vmir_iovec_t iov[2] = {
+      { dst + done, want },
+      { iu->iu_mem + vf->buf, vf->bufsize },
+    };
+    ssize_t r = want ?
+      vfd_preadv(iu, vf->fd, iov, 2, -1) :
+      vfd_read(iu, vf->fd, iov[1].iov_base, iov[1].iov_len);
+    if(r <= 0) {
+      vf->flags |= r == 0 ? VFILE_EOF : VFILE_ERROR;
+      break;
+    }
+    if(r <= want) {
+      done += r;
+      continue;
+    }
+    done += want;
+    vf->rpos = vf->buf;
+    vf->rend = vf->buf + r - want;
+  }
+  return done;
 }
 
-static ssize_t
-cookie_write(void *fh, const char *buf, size_t size)
+
+/**
+ * Returns number of bytes written, short on error
+ */
+static size_t
+vFILE_write(ir_unit_t *iu, vFILE_t *vf, const void *src, size_t size)
 {
-  vFILE_t *vf = fh;
-  return vfd_write(vf->iu, vf->fd, buf, size);
+  size_t done = 0;
+
+  vFILE_unread(iu, vf);
+  if(vFILE_alloc_buf(iu, vf))
+    return 0;
+
+  if(size >= vf->bufsize) {
+    // Buffered data and 'src' in one go, straight from guest memory
+    const size_t pending = vf->wend ? vf->wpos - vf->buf : 0;
+    vmir_iovec_t iov[2] = {
+      { iu->iu_mem + vf->buf, pending },
+      { (void *)src, size },
+    };
+    vf->wpos = vf->wend = 0;
+    const size_t r = vFILE_writev(iu, vf, iov, 2);
+    return r > pending ? r - pending : 0;
+  }
+
+  while(done < size) {
+    if(vf->wpos == vf->wend) {
+      if(vFILE_flush(iu, vf))
+        return done;
+      vf->wpos = vf->buf;
+      vf->wend = vf->buf + vf->bufsize;
+    }
+    uint32_t n = VMIR_MIN(vf->wend - vf->wpos, size - done);
+    memcpy(iu->iu_mem + vf->wpos, src + done, n);
+    vf->wpos += n;
+    done += n;
+  }
+
+  if(vf->flags & VFILE_LINEBUF && memchr(src, '\n', size) != NULL &&
+     vFILE_flush(iu, vf))
+    return 0;
+  return done;
 }
 
-static int
-cookie_seek(void *fh, int64_t *offsetp, int whence)
+
+/**
+ *
+ */
+static int64_t
+vFILE_seek(ir_unit_t *iu, vFILE_t *vf, int64_t offset, int whence)
 {
-  vFILE_t *vf = fh;
-  int64_t r = vfd_seek(vf->iu, vf->fd, *offsetp, whence);
-  if(r < 0)
+  if(vFILE_flush(iu, vf))
     return -1;
-  *offsetp = r;
-  return 0;
+  if(whence == SEEK_CUR)
+    offset -= vf->rend - vf->rpos;
+  vf->rpos = vf->rend = 0;
+  vf->flags &= ~VFILE_EOF;
+  return vfd_seek(iu, vf->fd, offset, whence);
 }
 
-#endif
 
-static int
-vFILE_close(void *fh)
+/**
+ *
+ */
+static int64_t
+vFILE_tell(ir_unit_t *iu, vFILE_t *vf)
 {
-  vFILE_t *vf = fh;
-  ir_unit_t *iu = vf->iu;
-  vmir_fd_close(vf->iu, vf->fd);
-  LIST_REMOVE(vf, link);
-  vmir_heap_free(iu, vf);
-  return 0;
+  int64_t pos = vfd_seek(iu, vf->fd, 0, SEEK_CUR);
+  if(pos < 0)
+    return -1;
+  return pos - (vf->rend - vf->rpos) + (vf->wend ? vf->wpos - vf->buf : 0);
 }
 
 
-#if !USE_FUNOPEN
+/**
+ *
+ */
+static int
+vFILE_close(ir_unit_t *iu, vFILE_t *vf)
+{
+  int r = vFILE_flush(iu, vf);
+  vmir_fd_close(iu, vf->fd);
+  LIST_REMOVE(vf, link);
 
-static const cookie_io_functions_t cookiefuncs = {
-  .read  = cookie_read,
-  .write = cookie_write,
-  .seek  = cookie_seek,
-  .close = vFILE_close,
-};
+  if(iu->iu_stdin == vf)
+    iu->iu_stdin = NULL;
+  if(iu->iu_stdout == vf)
+    iu->iu_stdout = NULL;
+  if(iu->iu_stderr == vf)
+    iu->iu_stderr = NULL;
 
-#endif
+  if(vf->buf)
+    vmir_heap_free(iu, iu->iu_mem + vf->buf);
+  vmir_heap_free(iu, vf);
+  return r;
+}
 
 
+/**
+ * Slow paths for the FGETC / FPUTC / PUTCHAR vmops, called when
+ * the buffer is empty / full (or the stream is not in the right mode)
+ */
+static int
+vFILE_getc_slow(ir_unit_t *iu, uint32_t vmaddr)
+{
+  uint8_t c;
+  if(vmaddr == 0 || vFILE_read(iu, iu->iu_mem + vmaddr, &c, 1) != 1)
+    return -1;
+  return c;
+}
 
-static void *
-vFILE_open_fd(ir_unit_t *iu, int fd, int line_buffered, const char *mode)
+static int
+vFILE_putc_slow(ir_unit_t *iu, uint32_t vmaddr, int c)
 {
-  vFILE_t *vfile = vmir_heap_malloc(iu, sizeof(vFILE_t));
-  if(vfile == NULL) {
-    vmir_fd_close(iu, fd);
-    return NULL;
-  }
-  vfile->iu = iu;
-  vfile->fd = fd;
+  uint8_t ch = c;
+  if(vmaddr == 0 || vFILE_write(iu, iu->iu_mem + vmaddr, &ch, 1) != 1)
+    return -1;
+  return ch;
+}
 
-#if USE_FUNOPEN
-  vfile->fp = funopen(vfile, fun_read, fun_write, fun_seek, vFILE_close);
-#else
-  vfile->fp = fopencookie(vfile, mode, cookiefuncs);
-#endif
-  if(vfile->fp == NULL) {
+
+static vFILE_t *
+vFILE_open_fd(ir_unit_t *iu, int fd, int line_buffered)
+{
+  vFILE_t *vfile = vmir_heap_malloc(iu, sizeof(vFILE_t));
+  if(vfile == NULL) {
     vmir_fd_close(iu, fd);
-    vmir_heap_free(iu, vfile);
     return NULL;
   }
+  memset(vfile, 0, sizeof(vFILE_t));
+  vfile->fd = fd;
   if(line_buffered)
-    setlinebuf(vfile->fp);
+    vfile->flags |= VFILE_LINEBUF;
   LIST_INSERT_HEAD(&iu->iu_vfiles, vfile, link);
   return vfile;
 }
@@ -764,7 +1562,7 @@ vFILE_open(ir_unit_t *iu, const char *path, const char *mode,
   int fd = vfd_open(iu, path, flags);
   if(fd == -1)
     return NULL;
-  return vFILE_open_fd(iu, fd, line_buffered, mode);
+  return vFILE_open_fd(iu, fd, line_buffered);
 }
 
 
@@ -782,8 +1580,7 @@ static int
 vmir_fdopen(void *ret, const void *rf, ir_unit_t *iu)
 {
   uint32_t fd = vmir_vm_arg32(&rf);
-  const char *mode = vmir_vm_ptr(&rf, iu);
-  vFILE_t *vfile = vFILE_open_fd(iu, fd, 0, mode);
+  vFILE_t *vfile = vFILE_open_fd(iu, fd, 0);
   vmir_vm_retptr(ret, vfile, iu);
   return 0;
 }
@@ -796,9 +1593,9 @@ vmir_fseek(void *ret, const void *rf, ir_unit_t *iu)
     vmir_vm_ret32(ret, -1);
     return 0;
   }
-  uint32_t offset = vmir_vm_arg32(&rf);
+  int32_t offset = vmir_vm_arg32(&rf);
   uint32_t whence = vmir_vm_arg32(&rf);
-  int r = fseek(vfile->fp, offset, whence);
+  int r = vFILE_seek(iu, vfile, offset, whence) < 0 ? -1 : 0;
   vmir_vm_ret32(ret, r);
   return 0;
 }
@@ -813,7 +1610,7 @@ vmir_fseeko(void *ret, const void *rf, ir_unit_t *iu)
   }
   uint64_t offset = vmir_vm_arg64(&rf);
   uint32_t whence = vmir_vm_arg32(&rf);
-  int64_t r = fseeko(vfile->fp, offset, whence);
+  int64_t r = vFILE_seek(iu, vfile, offset, whence) < 0 ? -1 : 0;
   vmir_vm_ret64(ret, r);
   return 0;
 }
@@ -829,7 +1626,7 @@ vmir_fread(void *ret, const void *rf, ir_unit_t *iu)
     vmir_vm_ret32(ret, -1);
     return 0;
   }
-  int r = fread(buf, size, nmemb, vfile->fp);
+  int r = size ? vFILE_read(iu, vfile, buf, (size_t)size * nmemb) / size : 0;
   vmir_vm_ret32(ret, r);
   return 0;
 }
@@ -845,7 +1642,7 @@ vmir_fwrite(void *ret, const void *rf, ir_unit_t *iu)
     vmir_vm_ret32(ret, -1);
     return 0;
   }
-  int r = fwrite(buf, size, nmemb, vfile->fp);
+  int r = size ? vFILE_write(iu, vfile, buf, (size_t)size * nmemb) / size : 0;
   vmir_vm_ret32(ret, r);
   return 0;
 }
@@ -858,8 +1655,7 @@ vmir_feof(void *ret, const void *rf, ir_unit_t *iu)
     vmir_vm_ret32(ret, 1);
     return 0;
   }
-  int r = feof(vfile->fp);
-  vmir_vm_ret32(ret, r);
+  vmir_vm_ret32(ret, !!(vfile->flags & VFILE_EOF));
   return 0;
 }
 
@@ -867,11 +1663,13 @@ static int
 vmir_fflush(void *ret, const void *rf, ir_unit_t *iu)
 {
   vFILE_t *vfile = vmir_vm_ptr(&rf, iu);
+  int r = 0;
   if(vfile == NULL) {
-    vmir_vm_ret32(ret, 1);
-    return 0;
+    LIST_FOREACH(vfile, &iu->iu_vfiles, link)
+      r |= vFILE_flush(iu, vfile);
+  } else {
+    r = vFILE_flush(iu, vfile);
   }
-  int r = fflush(vfile->fp);
   vmir_vm_ret32(ret, r);
   return 0;
 }
@@ -884,8 +1682,7 @@ vmir_ftell(void *ret, const void *rf, ir_unit_t *iu)
     vmir_vm_ret32(ret, -1);
     return 0;
   }
-  int r = ftell(vfile->fp);
-  vmir_vm_ret32(ret, r);
+  vmir_vm_ret32(ret, vFILE_tell(iu, vfile));
   return 0;
 }
 
@@ -893,12 +1690,11 @@ static int
 vmir_ftello(void *ret, const void *rf, ir_unit_t *iu)
 {
   vFILE_t *vfile = vmir_vm_ptr(&rf, iu);
-  uint64_t r = ftello(vfile->fp);
   if(vfile == NULL) {
     vmir_vm_ret64(ret, -1);
     return 0;
   }
-  vmir_vm_ret64(ret, r);
+  vmir_vm_ret64(ret, vFILE_tell(iu, vfile));
   return 0;
 }
 
@@ -906,9 +1702,10 @@ static int
 vmir_fclose(void *ret, const void *rf, ir_unit_t *iu)
 {
   vFILE_t *vfile = vmir_vm_ptr(&rf, iu);
+  int r = 0;
   if(vfile != NULL)
-    fclose(vfile->fp);
-  vmir_vm_ret32(ret, 0);
+    r = vFILE_close(iu, vfile);
+  vmir_vm_ret32(ret, r);
   return 0;
 }
 
@@ -928,48 +1725,18 @@ static int
 vmir_puts(void *ret, const void *rf, ir_unit_t *iu)
 {
   const char *str = vmir_vm_ptr(&rf, iu);
-  if(iu->iu_stdout != NULL)
-    fwrite(str, strlen(str), 1, iu->iu_stdout->fp);
-  vmir_vm_ret32(ret, 0);
-  return 0;
-}
-
-static int
-vmir_fputc(void *ret, const void *rf, ir_unit_t *iu)
-{
-  char c = vmir_vm_arg32(&rf);
-  vFILE_t *vfile = vmir_vm_ptr(&rf, iu);
-  if(vfile != NULL)
-    fwrite(&c, 1, 1, vfile->fp);
-  vmir_vm_ret32(ret, c);
-  return 0;
-}
-
-static int
-vmir_fgetc(void *ret, const void *rf, ir_unit_t *iu)
-{
-  uint8_t c;
-  vFILE_t *vfile = vmir_vm_ptr(&rf, iu);
-  if(vfile == NULL || fread(&c, 1, 1, vfile->fp) != 1) {
-    vmir_vm_ret32(ret, -1);
-    return 0;
-  }
-  vmir_vm_ret32(ret, c);
-  return 0;
-}
-
-
-static int
-vmir_putchar(void *ret, const void *rf, ir_unit_t *iu)
-{
-  char c = vmir_vm_arg32(&rf);
-  if(iu->iu_stdout != NULL)
-    fwrite(&c, 1, 1, iu->iu_stdout->fp);
-  vmir_vm_ret32(ret, c);
+  vFILE_t *vf = iu->iu_stdout;
+  const size_t len = strlen(str);
+  int r = -1;
+  if(vf != NULL && vFILE_write(iu, vf, str, len) == len &&
+     vFILE_write(iu, vf, "\n", 1) == 1)
+    r = 0;
+  vmir_vm_ret32(ret, r);
   return 0;
 }
 
 
+#define FMT_TYPE_LITERAL 0
 #define FMT_TYPE_INT    1
 #define FMT_TYPE_INT64  2
 #define FMT_TYPE_PTR    3
@@ -977,21 +1744,19 @@ vmir_putchar(void *ret, const void *rf, ir_unit_t *iu)
 #define FMT_TYPE_DOUBLE 5
 
 
+/**
+ * Format a single conversion, 'fmt' is the conversion specification
+ */
 static void
 dofmt2(void (*output)(void *opaque, const char *str, int len),
-       void *opaque,
-       const char *start, const char *end, int num_field_args,
+       void *opaque, const char *fmt, int num_field_args,
        int type, const void **va, ir_unit_t *iu)
 {
   const void *vacopy = *va;
-  size_t len = end - start;
-  char fmt[len + 1];
   char tmpbuf[100];
   void *alloc = NULL;
   char *dst;
   size_t dz = sizeof(tmpbuf);
-  memcpy(fmt, start, len);
-  fmt[len] = 0;
   dst = tmpbuf;
 
   while(1) {
@@ -1084,8 +1849,7 @@ dofmt2(void (*output)(void *opaque, const char *str, int len),
         break;
       case 1:
         l1 = vmir_vm_vaarg32(va, iu);
-        n = snprintf(dst, dz, fmt, vmir_vm_vaarg32(va, iu),
-                     vmir_vm_vaarg_dbl(va, iu));
+        n = snprintf(dst, dz, fmt, l1, vmir_vm_vaarg_dbl(va, iu));
         break;
       case 2:
         l1 = vmir_vm_vaarg32(va, iu);
@@ -1123,17 +1887,93 @@ dofmt2(void (*output)(void *opaque, const char *str, int len),
 #define FMT_FLAGS_LONG  0x1
 #define FMT_FLAGS_INT64 0x2
 
+/**
+ * Format strings are compiled into a list of literal runs and
+ * conversions. Formats in read-only data can't change so they are
+ * compiled once and cached on their guest address
+ */
+typedef struct fmt_op {
+  uint8_t fo_type;            // FMT_TYPE_*
+  uint8_t fo_num_field_args;  // '*' width / precision
+  uint32_t fo_len;            // Length of literal
+  uint32_t fo_str;            // Literal or conversion spec in fc_strings
+} fmt_op_t;
+
+typedef struct fmt_compiled {
+  LIST_ENTRY(fmt_compiled) fc_link;
+  uint32_t fc_addr;
+  int fc_num_ops;
+  int fc_strings_size;
+  char *fc_strings;
+  fmt_op_t fc_ops[];
+} fmt_compiled_t;
+
+LIST_HEAD(fmt_compiled_list, fmt_compiled);
+
+#define FMT_CACHE_HASH_SIZE 256
+
+
+/**
+ * Bytes needed to compile a format of length 'len', worst case
+ */
+static size_t
+fmt_compiled_size(size_t len)
+{
+  return sizeof(fmt_compiled_t) + (len + 1) * sizeof(fmt_op_t) + len * 2 + 2;
+}
+
 
 static void
-dofmt(void (*output)(void *opaque, const char *str, int len),
-      void *opaque, const char *fmt, const void *valist,
-      ir_unit_t *iu)
+fmt_literal(fmt_compiled_t *fc, fmt_op_t **lit, const char *str, int len)
+{
+  fmt_op_t *fo = *lit;
+  if(fo == NULL) {
+    fo = *lit = &fc->fc_ops[fc->fc_num_ops++];
+    fo->fo_type = FMT_TYPE_LITERAL;
+    fo->fo_len = 0;
+    fo->fo_str = fc->fc_strings_size;
+  }
+  memcpy(fc->fc_strings + fc->fc_strings_size, str, len);
+  fc->fc_strings_size += len;
+  fo->fo_len += len;
+}
+
+
+static void
+fmt_conversion(fmt_compiled_t *fc, fmt_op_t **lit, const char *start,
+               const char *end, int num_field_args, int type)
 {
+  fmt_op_t *fo = &fc->fc_ops[fc->fc_num_ops++];
+  fo->fo_type = type;
+  fo->fo_num_field_args = num_field_args;
+  fo->fo_len = end - start;
+  fo->fo_str = fc->fc_strings_size;
+  memcpy(fc->fc_strings + fc->fc_strings_size, start, end - start);
+  fc->fc_strings_size += end - start;
+  fc->fc_strings[fc->fc_strings_size++] = 0;
+  *lit = NULL;
+}
+
+
+/**
+ * 'fc' must be fmt_compiled_size(strlen(fmt)) bytes
+ */
+static void
+fmt_compile(fmt_compiled_t *fc, const char *fmt)
+{
+  fmt_op_t *lit = NULL;
+
+  fc->fc_num_ops = 0;
+  fc->fc_strings_size = 0;
+  fc->fc_strings = (char *)&fc->fc_ops[strlen(fmt) + 1];
+
   while(*fmt) {
     char c = *fmt;
     if(c != '%') {
-      output(opaque, fmt, 1); // xxx: lame, should do long runs of unfmted str
-      fmt++;
+      const char *run = fmt;
+      while(*fmt && *fmt != '%')
+        fmt++;
+      fmt_literal(fc, &lit, run, fmt - run);
       continue;
     }
     int num_field_args = 0;
@@ -1191,8 +2031,7 @@ dofmt(void (*output)(void *opaque, const char *str, int len),
       goto again;
 
     case 'c':
-      dofmt2(output, opaque, start, fmt, num_field_args, FMT_TYPE_INT,
-             &valist, iu);
+      fmt_conversion(fc, &lit, start, fmt, num_field_args, FMT_TYPE_INT);
       break;
 
     case 'O':
@@ -1204,13 +2043,8 @@ dofmt(void (*output)(void *opaque, const char *str, int len),
     case 'u':
     case 'X':
     case 'x':
-      if(flags & FMT_FLAGS_INT64) {
-        dofmt2(output, opaque, start, fmt, num_field_args, FMT_TYPE_INT64,
-               &valist, iu);
-      } else {
-        dofmt2(output, opaque, start, fmt, num_field_args, FMT_TYPE_INT,
-               &valist, iu);
-      }
+      fmt_conversion(fc, &lit, start, fmt, num_field_args,
+                     flags & FMT_FLAGS_INT64 ? FMT_TYPE_INT64 : FMT_TYPE_INT);
       break;
 
     case 'e':
@@ -1218,31 +2052,126 @@ dofmt(void (*output)(void *opaque, const char *str, int len),
     case 'f':
     case 'g':
     case 'G':
-      dofmt2(output, opaque, start, fmt, num_field_args, FMT_TYPE_DOUBLE,
-             &valist, iu);
+      fmt_conversion(fc, &lit, start, fmt, num_field_args, FMT_TYPE_DOUBLE);
       break;
 
     case 'p':
-      dofmt2(output, opaque, start, fmt, num_field_args, FMT_TYPE_PTR,
-             &valist, iu);
+      fmt_conversion(fc, &lit, start, fmt, num_field_args, FMT_TYPE_PTR);
       break;
 
     case 's':
-      dofmt2(output, opaque, start, fmt, num_field_args, FMT_TYPE_STR,
-             &valist, iu);
+      fmt_conversion(fc, &lit, start, fmt, num_field_args, FMT_TYPE_STR);
       break;
 
     case 0:
       return;
 
     default:
-      output(opaque, &c, 1);
+      fmt_literal(fc, &lit, &c, 1);
       break;
     }
   }
 }
 
 
+/**
+ *
+ */
+static const fmt_compiled_t *
+fmt_cache_get(ir_unit_t *iu, uint32_t addr, const char *fmt)
+{
+  if(iu->iu_fmt_cache == NULL)
+    iu->iu_fmt_cache = calloc(FMT_CACHE_HASH_SIZE,
+                              sizeof(struct fmt_compiled_list));
+
+  struct fmt_compiled_list *l =
+    &iu->iu_fmt_cache[(addr * 2654435761u) >> 24];
+  fmt_compiled_t *fc;
+  LIST_FOREACH(fc, l, fc_link) {
+    if(fc->fc_addr == addr)
+      return fc;
+  }
+
+  const size_t len = strlen(fmt);
+  fmt_compiled_t *tmp = malloc(fmt_compiled_size(len));
+  fmt_compile(tmp, fmt);
+
+  // Store compacted
+  const size_t opsize = tmp->fc_num_ops * sizeof(fmt_op_t);
+  fc = malloc(sizeof(fmt_compiled_t) + opsize + tmp->fc_strings_size);
+  fc->fc_addr = addr;
+  fc->fc_num_ops = tmp->fc_num_ops;
+  fc->fc_strings_size = tmp->fc_strings_size;
+  fc->fc_strings = (char *)&fc->fc_ops[fc->fc_num_ops];
+  memcpy(fc->fc_ops, tmp->fc_ops, opsize);
+  memcpy(fc->fc_strings, tmp->fc_strings, tmp->fc_strings_size);
+  free(tmp);
+
+  LIST_INSERT_HEAD(l, fc, fc_link);
+  iu->iu_stats.printf_formats_compiled++;
+  return fc;
+}
+
+
+static void
+fmt_cache_destroy(ir_unit_t *iu)
+{
+  if(iu->iu_fmt_cache == NULL)
+    return;
+  for(int i = 0; i < FMT_CACHE_HASH_SIZE; i++) {
+    fmt_compiled_t *fc;
+    while((fc = LIST_FIRST(&iu->iu_fmt_cache[i])) != NULL) {
+      LIST_REMOVE(fc, fc_link);
+      free(fc);
+    }
+  }
+  free(iu->iu_fmt_cache);
+  iu->iu_fmt_cache = NULL;
+}
+
+
+static void
+fmt_exec(void (*output)(void *opaque, const char *str, int len),
+         void *opaque, const fmt_compiled_t *fc, const void *valist,
+         ir_unit_t *iu)
+{
+  for(int i = 0; i < fc->fc_num_ops; i++) {
+    const fmt_op_t *fo = &fc->fc_ops[i];
+    const char *str = fc->fc_strings + fo->fo_str;
+    if(fo->fo_type == FMT_TYPE_LITERAL)
+      output(opaque, str, fo->fo_len);
+    else
+      dofmt2(output, opaque, str, fo->fo_num_field_args, fo->fo_type,
+             &valist, iu);
+  }
+}
+
+
+static void
+dofmt(void (*output)(void *opaque, const char *str, int len),
+      void *opaque, const char *fmt, const void *valist,
+      ir_unit_t *iu)
+{
+  const uint32_t addr = (void *)fmt - iu->iu_mem;
+  if(addr >= iu->iu_rodata_start && addr < iu->iu_rodata_end) {
+    fmt_exec(output, opaque, fmt_cache_get(iu, addr, fmt), valist, iu);
+    return;
+  }
+
+  const size_t size = fmt_compiled_size(strlen(fmt));
+  if(size <= 4096) {
+    uint64_t buf[size / sizeof(uint64_t) + 1];
+    fmt_compile((fmt_compiled_t *)buf, fmt);
+    fmt_exec(output, opaque, (fmt_compiled_t *)buf, valist, iu);
+  } else {
+    fmt_compiled_t *fc = malloc(size);
+    fmt_compile(fc, fmt);
+    fmt_exec(output, opaque, fc, valist, iu);
+    free(fc);
+  }
+}
+
+
 typedef struct fmt_sn_aux {
   char *dst;
   unsigned int remain;
@@ -1362,6 +2291,7 @@ vmir_sprintf(void *ret, const void *rf, ir_unit_t *iu)
 
 
 typedef struct fmt_vFILE_aux {
+  ir_unit_t *iu;
   vFILE_t *vfile;
   unsigned int total;
 } fmt_file_aux_t;
@@ -1373,7 +2303,7 @@ fmt_file(void *opaque, const char *str, int len)
   fmt_file_aux_t *aux = opaque;
   aux->total += len;
   if(aux->vfile != NULL)
-    fwrite(str, len, 1, aux->vfile->fp);
+    vFILE_write(aux->iu, aux->vfile, str, len);
 }
 
 static int
@@ -1384,6 +2314,7 @@ vmir_vprintf(void *ret, const void *rf, ir_unit_t *iu)
 
   fmt_file_aux_t aux;
   aux.vfile = iu->iu_stdout;
+  aux.iu = iu;
   aux.total = 0;
   dofmt(fmt_file, &aux, fmt, va_rf, iu);
 
@@ -1402,6 +2333,7 @@ vmir_printf(void *ret, const void *rf, ir_unit_t *iu)
 
   fmt_file_aux_t aux;
   aux.vfile = iu->iu_stdout;
+  aux.iu = iu;
   aux.total = 0;
   dofmt(fmt_file, &aux, fmt, rf, iu);
 
@@ -1419,6 +2351,7 @@ vmir_vfprintf(void *ret, const void *rf, ir_unit_t *iu)
 
   fmt_file_aux_t aux;
   aux.vfile = vfile;
+  aux.iu = iu;
   aux.total = 0;
   dofmt(fmt_file, &aux, fmt, va_rf, iu);
 
@@ -1438,6 +2371,7 @@ vmir_fprintf(void *ret, const void *rf, ir_unit_t *iu)
 
   fmt_file_aux_t aux;
   aux.vfile = vfile;
+  aux.iu = iu;
   aux.total = 0;
   dofmt(fmt_file, &aux, fmt, rf, iu);
 
@@ -1695,6 +2629,10 @@ static const vmir_function_tab_t libc_funcs[] = {
   FN_EXT("read",    vmir_read),
   FN_EXT("write",   vmir_write),
   FN_EXT("lseek",   vmir_lseek),
+  FN_EXT("pread",   vmir_pread),
+  FN_EXT("pwrite",  vmir_pwrite),
+  FN_EXT("mmap",    vmir_mmap),
+  FN_EXT("munmap",  vmir_munmap),
   FN_EXT("close",   vmir_close),
 
   FN_EXT("fopen",   vmir_fopen),
@@ -1709,9 +2647,6 @@ static const vmir_function_tab_t libc_funcs[] = {
   FN_EXT("ftello",  vmir_ftello),
   FN_EXT("fclose",  vmir_fclose),
   FN_EXT("puts",    vmir_puts),
-  FN_EXT("fputc",   vmir_fputc),
-  FN_EXT("fgetc",   vmir_fgetc),
-  FN_EXT("putchar", vmir_putchar),
   FN_EXT("fileno",  vmir_fileno),
 
   FN_EXT("vsnprintf",  vmir_vsnprintf),
@@ -1843,12 +2778,54 @@ vmir_sysio_seek(void *opaque, intptr_t fh, int64_t offset, int whence)
 }
 
 
+static int
+vmir_sysio_hostfd(void *opaque, intptr_t fh)
+{
+  return fh;
+}
+
+
+#if defined(__linux__)
+
+#include <sys/uio.h>
+
+static ssize_t
+vmir_sysio_preadv(void *opaque, intptr_t fh, const vmir_iovec_t *iov,
+                  int iovcnt, int64_t offset)
+{
+  struct iovec v[iovcnt];
+  for(int i = 0; i < iovcnt; i++) {
+    v[i].iov_base = iov[i].iov_base;
+    v[i].iov_len = iov[i].iov_len;
+  }
+  return offset < 0 ? readv(fh, v, iovcnt) : preadv(fh, v, iovcnt, offset);
+}
+
+static ssize_t
+vmir_sysio_pwritev(void *opaque, intptr_t fh, const vmir_iovec_t *iov,
+                   int iovcnt, int64_t offset)
+{
+  struct iovec v[iovcnt];
+  for(int i = 0; i < iovcnt; i++) {
+    v[i].iov_base = iov[i].iov_base;
+    v[i].iov_len = iov[i].iov_len;
+  }
+  return offset < 0 ? writev(fh, v, iovcnt) : pwritev(fh, v, iovcnt, offset);
+}
+
+#endif
+
 static const vmir_fsops_t vmir_sysio_fsops = {
   .open  = vmir_sysio_open,
   .close = vmir_sysio_close,
   .read  = vmir_sysio_read,
   .write = vmir_sysio_write,
   .seek  = vmir_sysio_seek,
+  .hostfd = vmir_sysio_hostfd,
+#if defined(__linux__)
+  .preadv  = vmir_sysio_preadv,
+  .pwritev = vmir_sysio_pwritev,
+#endif
 };
 
 
@@ -1903,7 +2880,11 @@ libc_terminate(ir_unit_t *iu)
   vFILE_t *vf;
 
   while((vf = LIST_FIRST(&iu->iu_vfiles)) != NULL)
-    fclose(vf->fp);
+    vFILE_close(iu, vf);
+
+  fmt_cache_destroy(iu);
+
+  vmir_heap_destroy(iu);
 }
 
 
@@ -1940,3 +2921,256 @@ vmir_mem_free(ir_unit_t *iu, uint32_t addr)
 {
   return vmir_heap_free(iu, iu->iu_mem + addr);
 }
+
+
+/**
+ * Host memory mapped into the guest address space
+ *
+ * A page aligned window is reserved from the heap and the host pages
+ * are mapped on top of it using MAP_FIXED. When unmapped the window is
+ * backed by fresh anonymous memory again before it's returned to the
+ * heap. The heap's own block headers are outside the window.
+ */
+typedef struct vmir_mapping {
+  LIST_ENTRY(vmir_mapping) mm_link;
+  uint32_t mm_addr;      // Guest address, page aligned
+  uint32_t mm_size;      // Multiple of page size
+  void *mm_block;        // Heap block holding the window
+  int mm_guest;          // Created by guest mmap(), else by the embedder
+} vmir_mapping_t;
+
+#if defined(__linux__)
+
+/**
+ *
+ */
+static vmir_mapping_t *
+mapping_reserve(ir_unit_t *iu, size_t size)
+{
+  const size_t pagesize = sysconf(_SC_PAGESIZE);
+  if(size == 0 || size > iu->iu_memsize)
+    return NULL;
+  size = VMIR_ALIGN(size, pagesize);
+
+  void *block = vmir_heap_malloc(iu, size + pagesize);
+  if(block == NULL)
+    return NULL;
+
+  vmir_mapping_t *mm = calloc(1, sizeof(vmir_mapping_t));
+  mm->mm_block = block;
+  mm->mm_size = size;
+  mm->mm_addr = (void *)VMIR_ALIGN((intptr_t)block, pagesize) - iu->iu_mem;
+  return mm;
+}
+
+
+/**
+ *
+ */
+static void
+mapping_release(ir_unit_t *iu, vmir_mapping_t *mm)
+{
+  mmap(iu->iu_mem + mm->mm_addr, mm->mm_size, PROT_READ | PROT_WRITE,
+       MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+  vmir_heap_free(iu, mm->mm_block);
+  free(mm);
+}
+
+
+/**
+ *
+ */
+static uint32_t
+mapping_finish(ir_unit_t *iu, vmir_mapping_t *mm, void *r, int writable)
+{
+  if(r == MAP_FAILED ||
+     (!writable && mprotect(r, mm->mm_size, PROT_READ))) {
+    vmir_log(iu, VMIR_LOG_ERROR, "Unable to map host memory -- %s",
+             strerror(errno));
+    mapping_release(iu, mm);
+    return 0;
+  }
+  LIST_INSERT_HEAD(&iu->iu_mappings, mm, mm_link);
+  return mm->mm_addr;
+}
+
+
+uint32_t
+vmir_mem_map(ir_unit_t *iu, void *hostaddr, size_t size, int writable)
+{
+  vmir_mapping_t *mm = mapping_reserve(iu, size);
+  if(mm == NULL)
+    return 0;
+  // With old_size == 0 mremap() creates a second mapping of the same
+  // (shared) pages instead of moving them
+  void *r = mremap(hostaddr, 0, mm->mm_size, MREMAP_MAYMOVE | MREMAP_FIXED,
+                   iu->iu_mem + mm->mm_addr);
+  return mapping_finish(iu, mm, r, writable);
+}
+
+
+uint32_t
+vmir_mem_map_fd(ir_unit_t *iu, int fd, off_t offset, size_t size,
+                int writable)
+{
+  vmir_mapping_t *mm = mapping_reserve(iu, size);
+  if(mm == NULL)
+    return 0;
+  void *r = mmap(iu->iu_mem + mm->mm_addr, mm->mm_size,
+                 PROT_READ | (writable ? PROT_WRITE : 0),
+                 MAP_SHARED | MAP_FIXED, fd, offset);
+  return mapping_finish(iu, mm, r, 1);
+}
+
+
+/**
+ * Guest and embedder mappings share iu_mappings but each side can
+ * only unmap its own
+ */
+static int
+mapping_unmap(ir_unit_t *iu, uint32_t addr, int guest)
+{
+  vmir_mapping_t *mm;
+  LIST_FOREACH(mm, &iu->iu_mappings, mm_link) {
+    if(mm->mm_addr == addr && mm->mm_guest == guest) {
+      LIST_REMOVE(mm, mm_link);
+      mapping_release(iu, mm);
+      return 0;
+    }
+  }
+  return -1;
+}
+
+
+int
+vmir_mem_unmap(ir_unit_t *iu, uint32_t addr)
+{
+  return mapping_unmap(iu, addr, 0);
+}
+
+
+/**
+ * Guest mmap(), see VMIR_MAP_* and VMIR_PROT_*
+ *
+ * The address is always chosen by us (no MAP_FIXED). Only MAP_SHARED
+ * writable mappings are mapped writable from the host fd, all else is
+ * mapped private + writable so a guest writing to a read-only mapping
+ * can't fault the host. Files without a host fd (or an unaligned
+ * offset) are copied into anonymous memory, which is fine for
+ * everything except shared writable mappings.
+ */
+static uint32_t
+mem_map_guest(ir_unit_t *iu, uint32_t len, int prot, int flags, int fd,
+              int64_t offset)
+{
+  const int64_t pagesize = sysconf(_SC_PAGESIZE);
+  const int anon = flags & VMIR_MAP_ANONYMOUS;
+  const int shared_rw =
+    (flags & VMIR_MAP_TYPE_MASK) == VMIR_MAP_SHARED && prot & VMIR_PROT_WRITE;
+
+  if(flags & VMIR_MAP_FIXED || offset < 0)
+    return 0;
+
+  vmir_fd_t *vfd = NULL;
+  int hostfd = -1;
+  if(!anon) {
+    vfd = vfd_get(iu, fd, VMIR_FD_TYPE_FILEHANDLE);
+    if(vfd == NULL)
+      return 0;
+    if(vfd->ops->hostfd != NULL && !(offset & (pagesize - 1)))
+      hostfd = vfd->ops->hostfd(vfd->opaque, vfd->fh);
+    if(hostfd == -1 && shared_rw)
+      return 0;
+  }
+
+  vmir_mapping_t *mm = mapping_reserve(iu, len);
+  if(mm == NULL)
+    return 0;
+
+  void *base = iu->iu_mem + mm->mm_addr;
+  if(mmap(base, mm->mm_size, PROT_READ | PROT_WRITE,
+          MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+    mapping_release(iu, mm);
+    return 0;
+  }
+
+  if(hostfd != -1) {
+    // Only map pages backed by the file, touching pages past EOF would
+    // SIGBUS. The rest stays anonymous zero pages
+    struct stat st;
+    if(fstat(hostfd, &st)) {
+      mapping_release(iu, mm);
+      return 0;
+    }
+    const int64_t avail = st.st_size - offset;
+    const size_t size = avail <= 0 ? 0 :
+      VMIR_MIN(VMIR_ALIGN(avail, pagesize), mm->mm_size);
+    if(size > 0 &&
+       mmap(base, size, PROT_READ | PROT_WRITE,
+            (shared_rw ? MAP_SHARED : MAP_PRIVATE) | MAP_FIXED,
+            hostfd, offset) == MAP_FAILED) {
+      vmir_log(iu, VMIR_LOG_ERROR, "mmap(fd %d) failed -- %s",
+               fd, strerror(errno));
+      mapping_release(iu, mm);
+      return 0;
+    }
+  } else if(!anon) {
+    vmir_iovec_t iov = { base, len };
+    if(vfd_preadv(iu, fd, &iov, 1, offset) < 0) {
+      mapping_release(iu, mm);
+      return 0;
+    }
+  }
+
+  mm->mm_guest = 1;
+  LIST_INSERT_HEAD(&iu->iu_mappings, mm, mm_link);
+  return mm->mm_addr;
+}
+
+#else
+
+uint32_t
+vmir_mem_map(ir_unit_t *iu, void *hostaddr, size_t size, int writable)
+{
+  return 0;
+}
+
+uint32_t
+vmir_mem_map_fd(ir_unit_t *iu, int fd, off_t offset, size_t size,
+                int writable)
+{
+  return 0;
+}
+
+static int
+mapping_unmap(ir_unit_t *iu, uint32_t addr, int guest)
+{
+  return -1;
+}
+
+int
+vmir_mem_unmap(ir_unit_t *iu, uint32_t addr)
+{
+  return -1;
+}
+
+static uint32_t
+mem_map_guest(ir_unit_t *iu, uint32_t len, int prot, int flags, int fd,
+              int64_t offset)
+{
+  return 0;
+}
+
+#endif
+
+
+/**
+ *
+ */
+static void
+mem_mappings_destroy(ir_unit_t *iu)
+{
+  vmir_mapping_t *mm;
+  while((mm = LIST_FIRST(&iu->iu_mappings)) != NULL)
+    mapping_unmap(iu, mm->mm_addr, mm->mm_guest);
+}
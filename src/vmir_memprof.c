@@ -0,0 +1,371 @@
+/*
+ * Copyright (c) 2016 Lonelycoder AB
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+ * Guest memory access profiler (VM_MEMPROF builds)
+ *
+ * Every guest load, store and memcpy/memset/memmove/memcmp vmop is
+ * accounted to the executing function:
+ *
+ *  - Number of accesses and bytes loaded / stored
+ *  - Stride relative to the previous access in the same function
+ *    (same cache line, adjacent line, same page, further away)
+ *  - Misses in a simulated two level cache (32kB 8-way L1, 1MB 16-way
+ *    L2, 64 byte lines, LRU). The cache is shared by all functions so
+ *    a function is charged for misses caused by evictions elsewhere,
+ *    just like on real hardware
+ *  - Every 64th access the cache line address is added to a small
+ *    per-function table which gives an estimate of the footprint and
+ *    the hottest lines (i.e. which guest data structures are involved)
+ *
+ * The report ranks functions by L1 misses + 10 * L2 misses
+ *
+ * The ARM JIT does not call vm_memprof_access() so it is left out of
+ * VM_MEMPROF builds and all guest code runs in the interpreter
+ */
+
+#ifdef VM_MEMPROF
+
+#define MEMPROF_LINE_SHIFT    6
+#define MEMPROF_PAGE_SHIFT    12
+#define MEMPROF_SAMPLE_PERIOD 64
+#define MEMPROF_SAMPLE_SLOTS  256   // Per function, must be power of 2
+
+#define MEMPROF_L1_SETS  64
+#define MEMPROF_L1_WAYS  8
+#define MEMPROF_L2_SETS  1024
+#define MEMPROF_L2_WAYS  16
+
+typedef enum {
+  MEMPROF_STRIDE_SAME_LINE,
+  MEMPROF_STRIDE_NEXT_LINE,
+  MEMPROF_STRIDE_SAME_PAGE,
+  MEMPROF_STRIDE_FAR,
+  MEMPROF_STRIDE_NUM,
+} memprof_stride_t;
+
+
+typedef struct memprof_sample {
+  uint32_t ms_line;        // Line number + 1, 0 means free slot
+  uint32_t ms_count;
+} memprof_sample_t;
+
+
+typedef struct memprof_func {
+  uint64_t mf_loads;
+  uint64_t mf_stores;
+  uint64_t mf_load_bytes;
+  uint64_t mf_store_bytes;
+  uint64_t mf_stride[MEMPROF_STRIDE_NUM];
+  uint64_t mf_l1_misses;
+  uint64_t mf_l2_misses;
+  uint32_t mf_last_line;
+  int mf_num_samples;
+  memprof_sample_t *mf_samples;
+} memprof_func_t;
+
+
+typedef struct memprof_cache {
+  uint32_t mc_tags[MEMPROF_L2_SETS * MEMPROF_L2_WAYS];  // Line number + 1
+  uint32_t mc_age[MEMPROF_L2_SETS * MEMPROF_L2_WAYS];
+} memprof_cache_t;
+
+
+typedef struct vm_memprof {
+  uint32_t vm_clock;
+  uint32_t vm_sample_countdown;
+  int vm_num_funcs;
+  memprof_cache_t vm_l1;
+  memprof_cache_t vm_l2;
+  memprof_func_t vm_funcs[0];
+} vm_memprof_t;
+
+
+/**
+ * Returns 1 on miss
+ */
+static int
+memprof_cache_access(memprof_cache_t *mc, uint32_t clock, uint32_t line,
+                     int sets, int ways)
+{
+  const uint32_t tag = line + 1;
+  const int base = (line & (sets - 1)) * ways;
+  uint32_t *tags = mc->mc_tags + base;
+  uint32_t *age = mc->mc_age + base;
+  int victim = 0;
+
+  for(int i = 0; i < ways; i++) {
+    if(tags[i] == tag) {
+      age[i] = clock;
+      return 0;
+    }
+    if(age[i] < age[victim])
+      victim = i;
+  }
+  tags[victim] = tag;
+  age[victim] = clock;
+  return 1;
+}
+
+
+/**
+ *
+ */
+static void
+memprof_sample(memprof_func_t *mf, uint32_t line)
+{
+  if(mf->mf_samples == NULL)
+    mf->mf_samples = calloc(MEMPROF_SAMPLE_SLOTS, sizeof(memprof_sample_t));
+
+  const uint32_t tag = line + 1;
+  uint32_t h = (line * 2654435761u) & (MEMPROF_SAMPLE_SLOTS - 1);
+  for(int i = 0; i < MEMPROF_SAMPLE_SLOTS; i++) {
+    memprof_sample_t *ms = &mf->mf_samples[h];
+    if(ms->ms_line == tag) {
+      ms->ms_count++;
+      return;
+    }
+    if(ms->ms_line == 0) {
+      // Keep a few slots free so lookups terminate quickly
+      if(mf->mf_num_samples >= MEMPROF_SAMPLE_SLOTS * 3 / 4)
+        return;
+      ms->ms_line = tag;
+      ms->ms_count = 1;
+      mf->mf_num_samples++;
+      return;
+    }
+    h = (h + 1) & (MEMPROF_SAMPLE_SLOTS - 1);
+  }
+}
+
+
+/**
+ *
+ */
+static void
+memprof_line(vm_memprof_t *vm, memprof_func_t *mf, uint32_t line)
+{
+  const uint32_t clock = ++vm->vm_clock;
+
+  if(memprof_cache_access(&vm->vm_l1, clock, line,
+                          MEMPROF_L1_SETS, MEMPROF_L1_WAYS)) {
+    mf->mf_l1_misses++;
+    if(memprof_cache_access(&vm->vm_l2, clock, line,
+                            MEMPROF_L2_SETS, MEMPROF_L2_WAYS))
+      mf->mf_l2_misses++;
+  }
+
+  if(--vm->vm_sample_countdown == 0) {
+    vm->vm_sample_countdown = MEMPROF_SAMPLE_PERIOD;
+    memprof_sample(mf, line);
+  }
+}
+
+
+/**
+ * Account an access of 'size' bytes at guest address 'ea'
+ */
+static void __attribute__((noinline))
+vm_memprof_access(vm_memprof_t *vm, const ir_function_t *f,
+                  uint32_t ea, uint32_t size, int store)
+{
+  if(size == 0 || f->if_gfid >= vm->vm_num_funcs)
+    return;
+
+  memprof_func_t *mf = &vm->vm_funcs[f->if_gfid];
+  const uint32_t first = ea >> MEMPROF_LINE_SHIFT;
+  const uint32_t last = (ea + size - 1) >> MEMPROF_LINE_SHIFT;
+
+  if(store) {
+    mf->mf_stores++;
+    mf->mf_store_bytes += size;
+  } else {
+    mf->mf_loads++;
+    mf->mf_load_bytes += size;
+  }
+
+  const uint32_t prev = mf->mf_last_line;
+  memprof_stride_t s;
+  if(first == prev)
+    s = MEMPROF_STRIDE_SAME_LINE;
+  else if(first == prev + 1 || first + 1 == prev)
+    s = MEMPROF_STRIDE_NEXT_LINE;
+  else if(ea >> MEMPROF_PAGE_SHIFT ==
+          prev >> (MEMPROF_PAGE_SHIFT - MEMPROF_LINE_SHIFT))
+    s = MEMPROF_STRIDE_SAME_PAGE;
+  else
+    s = MEMPROF_STRIDE_FAR;
+  mf->mf_stride[s]++;
+  mf->mf_last_line = last;
+
+  for(uint32_t line = first; line <= last; line++) {
+    memprof_line(vm, mf, line);
+    if(line == UINT32_MAX)
+      break;
+  }
+}
+
+
+/**
+ *
+ */
+static void
+memprof_destroy(ir_unit_t *iu)
+{
+  vm_memprof_t *vm = iu->iu_memprof;
+  if(vm == NULL)
+    return;
+  for(int i = 0; i < vm->vm_num_funcs; i++)
+    free(vm->vm_funcs[i].mf_samples);
+  free(vm);
+  iu->iu_memprof = NULL;
+}
+
+
+/**
+ *
+ */
+int
+vmir_memprof_enable(ir_unit_t *iu)
+{
+  const int num_funcs = VECTOR_LEN(&iu->iu_functions);
+  vm_memprof_t *vm = calloc(1, sizeof(vm_memprof_t) +
+                            num_funcs * sizeof(memprof_func_t));
+  if(vm == NULL)
+    return -1;
+  vm->vm_num_funcs = num_funcs;
+  vm->vm_sample_countdown = MEMPROF_SAMPLE_PERIOD;
+  memprof_destroy(iu);
+  iu->iu_memprof = vm;
+  return 0;
+}
+
+
+/**
+ *
+ */
+static uint64_t
+memprof_pressure(const memprof_func_t *mf)
+{
+  return mf->mf_l1_misses + 10 * mf->mf_l2_misses;
+}
+
+
+/**
+ *
+ */
+static int
+memprof_cmp(const memprof_func_t **a, const memprof_func_t **b)
+{
+  const uint64_t pa = memprof_pressure(*a);
+  const uint64_t pb = memprof_pressure(*b);
+  return pa < pb ? 1 : pa > pb ? -1 : 0;
+}
+
+
+/**
+ *
+ */
+static int
+memprof_sample_cmp(const memprof_sample_t *a, const memprof_sample_t *b)
+{
+  return a->ms_count < b->ms_count ? 1 : a->ms_count > b->ms_count ? -1 : 0;
+}
+
+
+/**
+ *
+ */
+void
+vmir_memprof_dump(ir_unit_t *iu, int max_functions)
+{
+  vm_memprof_t *vm = iu->iu_memprof;
+  if(vm == NULL)
+    return;
+
+  memprof_sample_t hot[MEMPROF_SAMPLE_SLOTS];
+  memprof_func_t **v = malloc(sizeof(memprof_func_t *) *
+                              (vm->vm_num_funcs + 1));
+  int num = 0;
+  for(int i = 0; i < vm->vm_num_funcs; i++) {
+    memprof_func_t *mf = &vm->vm_funcs[i];
+    if(mf->mf_loads || mf->mf_stores)
+      v[num++] = mf;
+  }
+  qsort(v, num, sizeof(memprof_func_t *), (void *)memprof_cmp);
+  if(max_functions > 0)
+    num = VMIR_MIN(num, max_functions);
+
+  printf("%12s %12s %12s %12s %10s %10s  %5s %5s %5s %5s %6s  Function\n",
+         "Loads", "Stores", "Bytes read", "Bytes wr", "L1 miss", "L2 miss",
+         "line", "next", "page", "far", "Foot");
+
+  for(int i = 0; i < num; i++) {
+    memprof_func_t *mf = v[i];
+    const ir_function_t *f = VECTOR_ITEM(&iu->iu_functions, mf - vm->vm_funcs);
+    const uint64_t accesses = mf->mf_loads + mf->mf_stores;
+    printf("%12"PRIu64" %12"PRIu64" %12"PRIu64" %12"PRIu64" %10"PRIu64
+           " %10"PRIu64" ",
+           mf->mf_loads, mf->mf_stores, mf->mf_load_bytes, mf->mf_store_bytes,
+           mf->mf_l1_misses, mf->mf_l2_misses);
+    for(int j = 0; j < MEMPROF_STRIDE_NUM; j++)
+      printf(" %4d%%", (int)(mf->mf_stride[j] * 100 / accesses));
+    // Footprint of the sampled lines, in kB
+    printf(" %5dk  %s\n",
+           (mf->mf_num_samples << MEMPROF_LINE_SHIFT) / 1024, f->if_name);
+
+    if(mf->mf_samples == NULL)
+      continue;
+
+    memcpy(hot, mf->mf_samples, sizeof(hot));
+    qsort(hot, MEMPROF_SAMPLE_SLOTS, sizeof(memprof_sample_t),
+          (void *)memprof_sample_cmp);
+    printf("%12s Hot lines:", "");
+    for(int j = 0; j < 4 && hot[j].ms_count; j++)
+      printf(" 0x%08x (%d)",
+             (hot[j].ms_line - 1) << MEMPROF_LINE_SHIFT, hot[j].ms_count);
+    printf("\n");
+  }
+  free(v);
+}
+
+#else
+
+int
+vmir_memprof_enable(ir_unit_t *iu)
+{
+  return -1;
+}
+
+void
+vmir_memprof_dump(ir_unit_t *iu, int max_functions)
+{
+}
+
+static void
+memprof_destroy(ir_unit_t *iu)
+{
+}
+
+#endif
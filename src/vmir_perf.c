@@ -0,0 +1,189 @@
+/*
+ * Copyright (c) 2016 Lonelycoder AB
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+ * Linux perf integration
+ *
+ * VMIR_DBG_PERF_MAP writes a /tmp/perf-<pid>.map entry for the JIT
+ * code of each function.
+ *
+ * VMIR_DBG_PERF_TRAMPOLINE makes every call into an interpreted function
+ * go through a small native trampoline private to that function (which
+ * in turn calls vm_exec()). The trampolines are listed in the perf map
+ * so with call graphs enabled (perf record -g) time spent in vm_exec()
+ * is attributed to the guest function names.
+ */
+
+#if defined(__linux__) && (defined(__x86_64__) || defined(__aarch64__))
+
+#include <sys/mman.h>
+
+#define VMIR_PERF_TRAMPOLINE_SIZE 32
+
+/*
+ * int trampoline(I, rf, ret, P, exec) { return exec(I, rf, ret, P); }
+ *
+ * Sets up a frame pointer so perf's frame pointer unwinder can walk
+ * through it. Position independent so it can be copied
+ */
+#if defined(__x86_64__)
+__asm__(".pushsection .text\n"
+        "vmir_perf_trampoline_start:\n"
+        "  push %rbp\n"
+        "  mov %rsp, %rbp\n"
+        "  call *%r8\n"
+        "  pop %rbp\n"
+        "  ret\n"
+        "vmir_perf_trampoline_end:\n"
+        ".popsection\n");
+#else
+__asm__(".pushsection .text\n"
+        "vmir_perf_trampoline_start:\n"
+        "  stp x29, x30, [sp, #-16]!\n"
+        "  mov x29, sp\n"
+        "  blr x4\n"
+        "  ldp x29, x30, [sp], #16\n"
+        "  ret\n"
+        "vmir_perf_trampoline_end:\n"
+        ".popsection\n");
+#endif
+
+extern const uint8_t vmir_perf_trampoline_start[]
+  __attribute__((visibility("hidden")));
+extern const uint8_t vmir_perf_trampoline_end[]
+  __attribute__((visibility("hidden")));
+
+
+/**
+ *
+ */
+static void
+perf_trampolines_create(ir_unit_t *iu, FILE *map)
+{
+  const size_t len = vmir_perf_trampoline_end - vmir_perf_trampoline_start;
+  const int num_funcs = VECTOR_LEN(&iu->iu_functions);
+  assert(len <= VMIR_PERF_TRAMPOLINE_SIZE);
+
+  size_t size = VMIR_ALIGN(num_funcs * VMIR_PERF_TRAMPOLINE_SIZE, 4096);
+  void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(mem == MAP_FAILED) {
+    vmir_log(iu, VMIR_LOG_ERROR, "Unable to allocate perf trampolines");
+    return;
+  }
+
+  iu->iu_perf_trampolines = calloc(num_funcs, sizeof(vm_trampoline_t *));
+
+  for(int i = 0; i < num_funcs; i++) {
+    const ir_function_t *f = VECTOR_ITEM(&iu->iu_functions, i);
+    if(f->if_vm_text == NULL)
+      continue;
+    void *t = mem + i * VMIR_PERF_TRAMPOLINE_SIZE;
+    memcpy(t, vmir_perf_trampoline_start, len);
+    iu->iu_perf_trampolines[i] = t;
+    if(map != NULL)
+      fprintf(map, "%lx %zx vmir:%s\n", (unsigned long)t, len, f->if_name);
+  }
+
+  __builtin___clear_cache(mem, mem + size);
+  mprotect(mem, size, PROT_READ | PROT_EXEC);
+  iu->iu_perf_trampoline_mem = mem;
+  iu->iu_perf_trampoline_memsize = size;
+}
+
+
+/**
+ *
+ */
+static void
+perf_trampolines_destroy(ir_unit_t *iu)
+{
+  if(iu->iu_perf_trampoline_mem != NULL)
+    munmap(iu->iu_perf_trampoline_mem, iu->iu_perf_trampoline_memsize);
+  free(iu->iu_perf_trampolines);
+}
+
+#else
+
+static void
+perf_trampolines_create(ir_unit_t *iu, FILE *map)
+{
+  vmir_log(iu, VMIR_LOG_ERROR,
+           "perf trampolines not supported on this platform");
+}
+
+static void
+perf_trampolines_destroy(ir_unit_t *iu)
+{
+}
+
+#endif
+
+
+/**
+ * Functions are emitted in order so each function's JIT code extends
+ * to the start of the next
+ */
+static void
+perf_map_jit(ir_unit_t *iu, FILE *map)
+{
+#ifdef VMIR_VM_JIT
+  const ir_function_t *f, *n;
+  TAILQ_FOREACH(f, &iu->iu_functions_with_bodies, if_body_link) {
+    n = TAILQ_NEXT(f, if_body_link);
+    const int end = n != NULL ? n->if_jit_offset : iu->iu_jit_ptr;
+    if(end > f->if_jit_offset)
+      fprintf(map, "%lx %x vmir-jit:%s\n",
+              (unsigned long)(iu->iu_jit_mem + f->if_jit_offset),
+              end - f->if_jit_offset, f->if_name);
+  }
+#endif
+}
+
+
+/**
+ * Called once all functions are emitted
+ */
+static void
+perf_init(ir_unit_t *iu)
+{
+  const int flags = iu->iu_debug_flags;
+  if(!(flags & (VMIR_DBG_PERF_MAP | VMIR_DBG_PERF_TRAMPOLINE)))
+    return;
+
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+  FILE *map = fopen(path, "a");
+  if(map == NULL)
+    vmir_log(iu, VMIR_LOG_ERROR, "Unable to open %s", path);
+
+  if(map != NULL)
+    perf_map_jit(iu, map);
+
+  if(flags & VMIR_DBG_PERF_TRAMPOLINE)
+    perf_trampolines_create(iu, map);
+
+  if(map != NULL)
+    fclose(map);
+}
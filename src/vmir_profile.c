@@ -0,0 +1,654 @@
+/*
+ * Copyright (c) 2016 Lonelycoder AB
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+ * Sampling profiler
+ *
+ * A SIGPROF timer samples the guest frame chain (iu_current_frame).
+ * Each sample is appended to a preallocated buffer as
+ *
+ *   [depth] [gfid pc] [gfid pc] ...
+ *
+ * innermost frame first. pc is the byte offset into the function's VM
+ * text where the next frame was called from. For the innermost frame it's
+ * unknown (-1) as the current instruction pointer is only held in a
+ * register inside vm_exec()
+ */
+
+#ifndef VM_NO_STACK_FRAME
+
+#include <signal.h>
+#include <pthread.h>
+
+#define VMIR_PROFILE_MAX_DEPTH 128
+#define VMIR_PROFILE_BUF_WORDS (1024 * 1024)
+
+typedef struct vmir_profile {
+  uint32_t *vp_buf;
+  size_t vp_used;
+  int vp_samples;
+  int vp_dropped;
+  int vp_hz;
+  pthread_t vp_thread;
+  struct sigaction vp_oldact;
+} vmir_profile_t;
+
+static ir_unit_t *volatile vmir_profile_iu;
+
+
+/**
+ *
+ */
+static void
+profile_sigprof(int sig, siginfo_t *si, void *uc)
+{
+  ir_unit_t *iu = vmir_profile_iu;
+  if(iu == NULL)
+    return;
+
+  vmir_profile_t *vp = iu->iu_profile;
+  if(!pthread_equal(pthread_self(), vp->vp_thread))
+    return;
+
+  const vm_frame_t *f = iu->iu_current_frame;
+  if(f == NULL)
+    return;
+
+  if(vp->vp_used + 1 + VMIR_PROFILE_MAX_DEPTH * 2 > VMIR_PROFILE_BUF_WORDS) {
+    vp->vp_dropped++;
+    return;
+  }
+
+  uint32_t *s = vp->vp_buf + vp->vp_used;
+  int depth = 0;
+  int32_t pc = -1;
+
+  for(; f != NULL && depth < VMIR_PROFILE_MAX_DEPTH; f = f->prev) {
+    s[1 + depth * 2] = f->func != NULL ? f->func->if_gfid : -1;
+    s[2 + depth * 2] = pc;
+    depth++;
+
+    if(f->prev != NULL && f->retpc != NULL && f->prev->func != NULL &&
+       f->prev->func->if_vm_text != NULL)
+      pc = (const void *)f->retpc - f->prev->func->if_vm_text;
+    else
+      pc = -1;
+  }
+  s[0] = depth;
+  vp->vp_used += 1 + depth * 2;
+  vp->vp_samples++;
+}
+
+
+/**
+ *
+ */
+int
+vmir_profile_start(ir_unit_t *iu, int hz)
+{
+  if(hz <= 0 || hz > 1000000)
+    return VMIR_ERR_INVALID_ARGS;
+
+  if(vmir_profile_iu != NULL)
+    return -1;
+
+  vmir_profile_t *vp = iu->iu_profile;
+  if(vp == NULL) {
+    vp = calloc(1, sizeof(vmir_profile_t));
+    vp->vp_buf = malloc(VMIR_PROFILE_BUF_WORDS * sizeof(uint32_t));
+    iu->iu_profile = vp;
+  }
+  vp->vp_hz = hz;
+  vp->vp_thread = pthread_self();
+  vmir_profile_iu = iu;
+
+  struct sigaction sa = {};
+  sa.sa_sigaction = profile_sigprof;
+  sa.sa_flags = SA_SIGINFO | SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGPROF, &sa, &vp->vp_oldact);
+
+  struct itimerval itv;
+  itv.it_interval.tv_sec = 0;
+  itv.it_interval.tv_usec = 1000000 / hz;
+  itv.it_value = itv.it_interval;
+  if(setitimer(ITIMER_PROF, &itv, NULL)) {
+    sigaction(SIGPROF, &vp->vp_oldact, NULL);
+    vmir_profile_iu = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+
+/**
+ *
+ */
+void
+vmir_profile_stop(ir_unit_t *iu)
+{
+  if(vmir_profile_iu != iu)
+    return;
+
+  struct itimerval itv = {};
+  setitimer(ITIMER_PROF, &itv, NULL);
+  sigaction(SIGPROF, &iu->iu_profile->vp_oldact, NULL);
+  vmir_profile_iu = NULL;
+}
+
+
+/**
+ *
+ */
+void
+vmir_profile_reset(ir_unit_t *iu)
+{
+  vmir_profile_t *vp = iu->iu_profile;
+  if(vp == NULL)
+    return;
+  vp->vp_used = 0;
+  vp->vp_samples = 0;
+  vp->vp_dropped = 0;
+}
+
+
+/**
+ *
+ */
+static void
+profile_destroy(ir_unit_t *iu)
+{
+  vmir_profile_stop(iu);
+  if(iu->iu_profile == NULL)
+    return;
+  free(iu->iu_profile->vp_buf);
+  free(iu->iu_profile);
+}
+
+
+/**
+ * Map a VM text offset back to the basic block it was emitted from
+ */
+static const ir_bb_t *
+profile_pc_to_bb(const ir_function_t *f, int32_t pc)
+{
+  const ir_bb_t *ib, *r = NULL;
+  if(pc < 0 || f->if_vm_text == NULL)
+    return NULL;
+
+  TAILQ_FOREACH(ib, &f->if_bbs, ib_link) {
+    if(ib->ib_text_offset > pc)
+      break;
+    r = ib;
+  }
+  return r;
+}
+
+
+/**
+ * Source line for a VM text offset. Without debug info we fall back to
+ * basic block id + 1. 0 if unknown
+ */
+static int
+profile_pc_to_line(const ir_function_t *f, int32_t pc)
+{
+  if(f == NULL)
+    return 0;
+
+  const ir_line_t *il = debuginfo_line_lookup(f, pc);
+  if(il != NULL)
+    return il->il_line;
+
+  if(f->if_num_lines)
+    return 0;
+
+  const ir_bb_t *ib = profile_pc_to_bb(f, pc);
+  return ib ? ib->ib_id + 1 : 0;
+}
+
+
+/**
+ *
+ */
+static const ir_function_t *
+profile_func(ir_unit_t *iu, uint32_t gfid)
+{
+  if(gfid >= VECTOR_LEN(&iu->iu_functions))
+    return NULL;
+  return VECTOR_ITEM(&iu->iu_functions, gfid);
+}
+
+
+/**
+ *
+ */
+static int
+profile_strcmp(const char **a, const char **b)
+{
+  return strcmp(*a, *b);
+}
+
+
+/**
+ * Folded stacks, one line per unique stack: "main;foo;bar 123"
+ * This is what flamegraph.pl and friends expect
+ */
+int
+vmir_profile_save_folded(ir_unit_t *iu, const char *path)
+{
+  const vmir_profile_t *vp = iu->iu_profile;
+  if(vp == NULL)
+    return -1;
+
+  FILE *fp = fopen(path, "w");
+  if(fp == NULL)
+    return -1;
+
+  const size_t used = vp->vp_used;
+  int num_stacks = 0;
+  for(size_t i = 0; i < used; i += 1 + vp->vp_buf[i] * 2)
+    num_stacks++;
+
+  char **stacks = malloc(sizeof(char *) * num_stacks);
+  num_stacks = 0;
+
+  for(size_t i = 0; i < used; i += 1 + vp->vp_buf[i] * 2) {
+    const uint32_t *s = vp->vp_buf + i;
+    const int depth = s[0];
+    size_t len = 0;
+    char *str = NULL;
+    FILE *mfp = open_memstream(&str, &len);
+    for(int j = depth - 1; j >= 0; j--) {
+      const ir_function_t *f = profile_func(iu, s[1 + j * 2]);
+      fprintf(mfp, "%s%s", j == depth - 1 ? "" : ";",
+              f != NULL ? f->if_name : "???");
+    }
+    fclose(mfp);
+    stacks[num_stacks++] = str;
+  }
+
+  qsort(stacks, num_stacks, sizeof(char *), (void *)profile_strcmp);
+
+  for(int i = 0; i < num_stacks;) {
+    int j = i + 1;
+    while(j < num_stacks && !strcmp(stacks[i], stacks[j]))
+      j++;
+    fprintf(fp, "%s %d\n", stacks[i], j - i);
+    i = j;
+  }
+
+  for(int i = 0; i < num_stacks; i++)
+    free(stacks[i]);
+  free(stacks);
+  return fclose(fp) ? -1 : 0;
+}
+
+
+/**
+ * Minimal protobuf encoder for the pprof profile.proto format
+ */
+VECTOR_HEAD(pb_buf, uint8_t);
+
+static void
+pb_varint(struct pb_buf *pb, uint64_t v)
+{
+  while(v >= 0x80) {
+    VECTOR_PUSH_BACK(pb, (v & 0x7f) | 0x80);
+    v >>= 7;
+  }
+  VECTOR_PUSH_BACK(pb, v);
+}
+
+static void
+pb_uint(struct pb_buf *pb, int field, uint64_t v)
+{
+  pb_varint(pb, field << 3);
+  pb_varint(pb, v);
+}
+
+static void
+pb_bytes(struct pb_buf *pb, int field, const void *data, size_t len)
+{
+  pb_varint(pb, (field << 3) | 2);
+  pb_varint(pb, len);
+  size_t pos = VECTOR_LEN(pb);
+  VECTOR_RESIZE(pb, pos + len);
+  memcpy(pb->vh_p + pos, data, len);
+}
+
+static void
+pb_msg(struct pb_buf *pb, int field, struct pb_buf *sub)
+{
+  pb_bytes(pb, field, sub->vh_p, VECTOR_LEN(sub));
+  VECTOR_RESIZE(sub, 0);
+}
+
+
+/**
+ *
+ */
+typedef struct profile_location {
+  uint32_t pl_gfid;
+  int pl_line;
+} profile_location_t;
+
+
+/**
+ *
+ */
+static int
+profile_location_cmp(const profile_location_t *a, const profile_location_t *b)
+{
+  if(a->pl_gfid != b->pl_gfid)
+    return a->pl_gfid < b->pl_gfid ? -1 : 1;
+  return a->pl_line - b->pl_line;
+}
+
+
+/**
+ * pprof profile (uncompressed protobuf, which pprof accepts as-is)
+ *
+ * Each (function, line) pair becomes a location. If the unit was
+ * compiled without debug info the basic block id + 1 is reported as
+ * line number instead. The innermost frame's position is unknown and
+ * reported as line 0
+ */
+int
+vmir_profile_save_pprof(ir_unit_t *iu, const char *path)
+{
+  const vmir_profile_t *vp = iu->iu_profile;
+  if(vp == NULL)
+    return -1;
+
+  FILE *fp = fopen(path, "w");
+  if(fp == NULL)
+    return -1;
+
+  struct pb_buf out = {}, msg = {}, sub = {}, ids = {};
+  VECTOR_HEAD(, profile_location_t) locs = {};
+  const int num_funcs = VECTOR_LEN(&iu->iu_functions);
+  const int64_t period = 1000000000LL / vp->vp_hz;
+  const size_t used = vp->vp_used;
+
+  // Resolve all frames into locations
+  for(size_t i = 0; i < used; i += 1 + vp->vp_buf[i] * 2) {
+    const uint32_t *s = vp->vp_buf + i;
+    for(int j = 0; j < s[0]; j++) {
+      const ir_function_t *f = profile_func(iu, s[1 + j * 2]);
+      profile_location_t pl = {s[1 + j * 2],
+                               profile_pc_to_line(f, s[2 + j * 2])};
+      VECTOR_PUSH_BACK(&locs, pl);
+    }
+  }
+  VECTOR_SORT(&locs, profile_location_cmp);
+  int num_locs = 0;
+  for(int i = 0; i < VECTOR_LEN(&locs); i++) {
+    if(num_locs && !profile_location_cmp(&VECTOR_ITEM(&locs, num_locs - 1),
+                                         &VECTOR_ITEM(&locs, i)))
+      continue;
+    VECTOR_ITEM(&locs, num_locs++) = VECTOR_ITEM(&locs, i);
+  }
+  VECTOR_RESIZE(&locs, num_locs);
+
+  /*
+   * String table: 0 = "", 1 = "samples", 2 = "count", 3 = "cpu",
+   * 4 = "nanoseconds", 5 + gfid = function name,
+   * 5 + num_funcs + file = source file name
+   */
+
+  // sample_type
+  pb_uint(&msg, 1, 1);
+  pb_uint(&msg, 2, 2);
+  pb_msg(&out, 1, &msg);
+  pb_uint(&msg, 1, 3);
+  pb_uint(&msg, 2, 4);
+  pb_msg(&out, 1, &msg);
+
+  // samples
+  for(size_t i = 0; i < used; i += 1 + vp->vp_buf[i] * 2) {
+    const uint32_t *s = vp->vp_buf + i;
+    for(int j = 0; j < s[0]; j++) {
+      const ir_function_t *f = profile_func(iu, s[1 + j * 2]);
+      profile_location_t pl = {s[1 + j * 2],
+                               profile_pc_to_line(f, s[2 + j * 2])};
+      profile_location_t *loc =
+        bsearch(&pl, locs.vh_p, num_locs, sizeof(profile_location_t),
+                (void *)profile_location_cmp);
+      pb_varint(&ids, loc - locs.vh_p + 1);
+    }
+    pb_msg(&msg, 1, &ids);
+    pb_varint(&ids, 1);
+    pb_varint(&ids, period);
+    pb_msg(&msg, 2, &ids);
+    pb_msg(&out, 2, &msg);
+  }
+
+  // locations
+  for(int i = 0; i < num_locs; i++) {
+    const profile_location_t *pl = &VECTOR_ITEM(&locs, i);
+    pb_uint(&msg, 1, i + 1);
+    pb_uint(&sub, 1, pl->pl_gfid + 1);
+    pb_uint(&sub, 2, pl->pl_line);
+    pb_msg(&msg, 4, &sub);
+    pb_msg(&out, 4, &msg);
+  }
+
+  // functions
+  for(int i = 0; i < num_funcs; i++) {
+    const ir_function_t *f = VECTOR_ITEM(&iu->iu_functions, i);
+    pb_uint(&msg, 1, i + 1);
+    pb_uint(&msg, 2, 5 + i);
+    pb_uint(&msg, 3, 5 + i);
+    if(f->if_num_lines && f->if_lines[0].il_file >= 0)
+      pb_uint(&msg, 4, 5 + num_funcs + f->if_lines[0].il_file);
+    pb_msg(&out, 5, &msg);
+  }
+
+  // string_table
+  static const char *fixed_strings[] = {
+    "", "samples", "count", "cpu", "nanoseconds"
+  };
+  for(int i = 0; i < 5; i++)
+    pb_bytes(&out, 6, fixed_strings[i], strlen(fixed_strings[i]));
+  for(int i = 0; i < num_funcs; i++) {
+    const char *name = VECTOR_ITEM(&iu->iu_functions, i)->if_name ?: "";
+    pb_bytes(&out, 6, name, strlen(name));
+  }
+  for(int i = 0; i < VECTOR_LEN(&iu->iu_debug_files); i++) {
+    const char *name = VECTOR_ITEM(&iu->iu_debug_files, i);
+    pb_bytes(&out, 6, name, strlen(name));
+  }
+
+  // period_type + period
+  pb_uint(&msg, 1, 3);
+  pb_uint(&msg, 2, 4);
+  pb_msg(&out, 11, &msg);
+  pb_uint(&out, 12, period);
+
+  fwrite(out.vh_p, 1, VECTOR_LEN(&out), fp);
+
+  VECTOR_CLEAR(&locs);
+  VECTOR_CLEAR(&ids);
+  VECTOR_CLEAR(&sub);
+  VECTOR_CLEAR(&msg);
+  VECTOR_CLEAR(&out);
+  return fclose(fp) ? -1 : 0;
+}
+
+
+#else
+
+int
+vmir_profile_start(ir_unit_t *iu, int hz)
+{
+  return -1;
+}
+
+void
+vmir_profile_stop(ir_unit_t *iu)
+{
+}
+
+void
+vmir_profile_reset(ir_unit_t *iu)
+{
+}
+
+int
+vmir_profile_save_folded(ir_unit_t *iu, const char *path)
+{
+  return -1;
+}
+
+int
+vmir_profile_save_pprof(ir_unit_t *iu, const char *path)
+{
+  return -1;
+}
+
+static void
+profile_destroy(ir_unit_t *iu)
+{
+}
+
+#endif
+
+
+/**
+ *
+ */
+static vmir_fprof_sort_t fprof_sort_key;
+
+static uint64_t
+fprof_key(const ir_function_t *f)
+{
+  switch(fprof_sort_key) {
+  case VMIR_FPROF_SORT_CALLS:
+    return f->if_prof_calls;
+  case VMIR_FPROF_SORT_INCLUSIVE:
+    return f->if_prof_inclusive;
+  default:
+    return f->if_prof_exclusive;
+  }
+}
+
+static int
+fprof_cmp(const ir_function_t **a, const ir_function_t **b)
+{
+  const uint64_t ka = fprof_key(*a);
+  const uint64_t kb = fprof_key(*b);
+  if(ka != kb)
+    return ka > kb ? -1 : 1;
+  return strcmp((*a)->if_name, (*b)->if_name);
+}
+
+
+/**
+ * Return all called functions sorted
+ */
+static ir_function_t **
+fprof_collect(ir_unit_t *iu, vmir_fprof_sort_t sort, int *nump)
+{
+  ir_function_t **v = malloc(sizeof(ir_function_t *) *
+                             (VECTOR_LEN(&iu->iu_functions) + 1));
+  int num = 0;
+  for(int i = 0; i < VECTOR_LEN(&iu->iu_functions); i++) {
+    ir_function_t *f = VECTOR_ITEM(&iu->iu_functions, i);
+    if(f->if_prof_calls)
+      v[num++] = f;
+  }
+  fprof_sort_key = sort;
+  qsort(v, num, sizeof(ir_function_t *), (void *)fprof_cmp);
+  *nump = num;
+  return v;
+}
+
+
+/**
+ *
+ */
+void
+vmir_function_profile_dump(ir_unit_t *iu, vmir_fprof_sort_t sort)
+{
+  int num;
+  ir_function_t **v = fprof_collect(iu, sort, &num);
+
+  printf("%10s %16s %16s %12s  Function (time in %s)\n",
+         "Calls", "Inclusive", "Exclusive", "Excl/call", vm_fprof_unit);
+  for(int i = 0; i < num; i++) {
+    const ir_function_t *f = v[i];
+    printf("%10"PRIu64" %16"PRIu64" %16"PRIu64" %12"PRIu64"  %s\n",
+           f->if_prof_calls, f->if_prof_inclusive, f->if_prof_exclusive,
+           f->if_prof_exclusive / f->if_prof_calls, f->if_name);
+  }
+  free(v);
+}
+
+
+/**
+ *
+ */
+static void
+json_write_string(FILE *fp, const char *str)
+{
+  fputc('"', fp);
+  for(; *str; str++) {
+    const unsigned char c = *str;
+    if(c == '"' || c == '\\')
+      fprintf(fp, "\\%c", c);
+    else if(c < 0x20)
+      fprintf(fp, "\\u%04x", c);
+    else
+      fputc(c, fp);
+  }
+  fputc('"', fp);
+}
+
+
+/**
+ *
+ */
+int
+vmir_function_profile_save_json(ir_unit_t *iu, const char *path)
+{
+  FILE *fp = fopen(path, "w");
+  if(fp == NULL)
+    return -1;
+
+  int num;
+  ir_function_t **v = fprof_collect(iu, VMIR_FPROF_SORT_EXCLUSIVE, &num);
+
+  fprintf(fp, "{\n  \"unit\": \"%s\",\n  \"functions\": [", vm_fprof_unit);
+  for(int i = 0; i < num; i++) {
+    const ir_function_t *f = v[i];
+    fprintf(fp, "%s\n    {\"name\": ", i ? "," : "");
+    json_write_string(fp, f->if_name);
+    fprintf(fp, ", \"calls\": %"PRIu64", \"inclusive\": %"PRIu64
+            ", \"exclusive\": %"PRIu64"}",
+            f->if_prof_calls, f->if_prof_inclusive, f->if_prof_exclusive);
+  }
+  fprintf(fp, "\n  ]\n}\n");
+  free(v);
+  return fclose(fp) ? -1 : 0;
+}
@@ -0,0 +1,235 @@
+/*
+ * Copyright (c) 2016 Lonelycoder AB
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+ * Read-only data segment
+ *
+ * Constant globals are placed in a page aligned region after the
+ * writable data, [iu_rodata_start, iu_rodata_end). While parsing their
+ * addresses are offsets into the region. They are relocated by
+ * rodata_layout() once all global variables are known, which is before
+ * any address is used (LLVM emits all GLOBALVAR records before
+ * constants and function bodies).
+ *
+ * With vmir_set_shared_rodata() the initialized region is copied to a
+ * memfd which is mapped read-only (MAP_SHARED | MAP_FIXED) on top of
+ * guest memory. Other units whose region has identical contents map
+ * the same memfd so the pages are resident only once per process.
+ */
+
+/**
+ *
+ */
+static void
+rodata_layout(ir_unit_t *iu)
+{
+  if(iu->iu_rodata_done)
+    return;
+  iu->iu_rodata_done = 1;
+
+  if(iu->iu_rodata_size == 0) {
+    iu->iu_rodata_start = iu->iu_rodata_end = iu->iu_data_ptr;
+    return;
+  }
+
+  const uint32_t start = VMIR_ALIGN(iu->iu_data_ptr, 4096);
+  for(int i = 0; i < iu->iu_next_value; i++) {
+    ir_value_t *iv = value_get(iu, i);
+    if(iv->iv_class == IR_VC_GLOBALVAR && iv->iv_gvar->ig_readonly)
+      iv->iv_gvar->ig_addr += start;
+  }
+
+  iu->iu_rodata_start = start;
+  iu->iu_data_ptr = start + iu->iu_rodata_size;
+  iu->iu_rodata_end = VMIR_ALIGN(iu->iu_data_ptr, 4096);
+  iu->iu_stats.rodata_size = iu->iu_rodata_size;
+}
+
+
+/**
+ *
+ */
+void
+vmir_set_shared_rodata(ir_unit_t *iu, int enable)
+{
+  iu->iu_rodata_share = enable;
+}
+
+
+#if defined(__linux__)
+
+#include <sys/mman.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+
+typedef struct rodata_segment {
+  LIST_ENTRY(rodata_segment) rs_link;
+  int rs_fd;
+  int rs_refcount;
+  uint32_t rs_size;
+  uint64_t rs_hash;
+} rodata_segment_t;
+
+static LIST_HEAD(, rodata_segment) rodata_segments;
+static pthread_mutex_t rodata_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/**
+ * Returns 1 if 'rs' has the same contents as 'data'
+ */
+static int
+rodata_segment_equal(const rodata_segment_t *rs, const void *data,
+                     uint32_t size)
+{
+  if(rs->rs_size != size)
+    return 0;
+  void *p = mmap(NULL, size, PROT_READ, MAP_SHARED, rs->rs_fd, 0);
+  if(p == MAP_FAILED)
+    return 0;
+  const int r = !memcmp(p, data, size);
+  munmap(p, size);
+  return r;
+}
+
+
+/**
+ *
+ */
+static rodata_segment_t *
+rodata_segment_create(const void *data, uint32_t size, uint64_t hash)
+{
+  int fd = memfd_create("vmir-rodata", MFD_CLOEXEC);
+  if(fd == -1)
+    return NULL;
+
+  uint32_t off = 0;
+  while(off < size) {
+    ssize_t r = write(fd, data + off, size - off);
+    if(r <= 0) {
+      close(fd);
+      return NULL;
+    }
+    off += r;
+  }
+
+  rodata_segment_t *rs = calloc(1, sizeof(rodata_segment_t));
+  rs->rs_fd = fd;
+  rs->rs_size = size;
+  rs->rs_hash = hash;
+  LIST_INSERT_HEAD(&rodata_segments, rs, rs_link);
+  return rs;
+}
+
+
+/**
+ * Map the (initialized) read-only region from a shared segment
+ */
+static void
+rodata_share(ir_unit_t *iu)
+{
+  const uint32_t size = iu->iu_rodata_end - iu->iu_rodata_start;
+  if(!iu->iu_rodata_share || size == 0)
+    return;
+
+  void *data = iu->iu_mem + iu->iu_rodata_start;
+  if((intptr_t)data & (sysconf(_SC_PAGESIZE) - 1)) {
+    vmir_log(iu, VMIR_LOG_INFO,
+             "Read-only data not page aligned in host memory, not shared");
+    return;
+  }
+
+  uint64_t hash = 0xcbf29ce484222325ULL;  // FNV-1a
+  for(uint32_t i = 0; i < size; i++)
+    hash = (hash ^ ((const uint8_t *)data)[i]) * 0x100000001b3ULL;
+
+  pthread_mutex_lock(&rodata_mutex);
+  rodata_segment_t *rs;
+  LIST_FOREACH(rs, &rodata_segments, rs_link) {
+    if(rs->rs_hash == hash && rodata_segment_equal(rs, data, size))
+      break;
+  }
+
+  if(rs == NULL)
+    rs = rodata_segment_create(data, size, hash);
+
+  if(rs == NULL ||
+     mmap(data, size, PROT_READ, MAP_SHARED | MAP_FIXED,
+          rs->rs_fd, 0) == MAP_FAILED) {
+    const int err = errno;
+    if(rs != NULL && rs->rs_refcount == 0) {
+      LIST_REMOVE(rs, rs_link);
+      close(rs->rs_fd);
+      free(rs);
+    }
+    pthread_mutex_unlock(&rodata_mutex);
+    vmir_log(iu, VMIR_LOG_ERROR, "Unable to share read-only data -- %s",
+             strerror(err));
+    return;
+  }
+  rs->rs_refcount++;
+  pthread_mutex_unlock(&rodata_mutex);
+
+  iu->iu_rodata_segment = rs;
+  iu->iu_stats.rodata_shared = rs->rs_refcount > 1;
+}
+
+
+/**
+ * Give the user back private writable memory
+ */
+static void
+rodata_destroy(ir_unit_t *iu)
+{
+  rodata_segment_t *rs = iu->iu_rodata_segment;
+  if(rs == NULL)
+    return;
+
+  mmap(iu->iu_mem + iu->iu_rodata_start,
+       iu->iu_rodata_end - iu->iu_rodata_start,
+       PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+
+  pthread_mutex_lock(&rodata_mutex);
+  if(--rs->rs_refcount == 0) {
+    LIST_REMOVE(rs, rs_link);
+    close(rs->rs_fd);
+    free(rs);
+  }
+  pthread_mutex_unlock(&rodata_mutex);
+  iu->iu_rodata_segment = NULL;
+}
+
+#else
+
+static void
+rodata_share(ir_unit_t *iu)
+{
+}
+
+static void
+rodata_destroy(ir_unit_t *iu)
+{
+}
+
+#endif
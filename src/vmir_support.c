@@ -43,6 +43,24 @@ get_ts(void)
 }
 
 
+/**
+ *
+ */
+static int64_t __attribute__((unused))
+get_ts_ns(void)
+{
+#if _POSIX_TIMERS > 0 && defined(_POSIX_MONOTONIC_CLOCK)
+  struct timespec tv;
+  clock_gettime(CLOCK_MONOTONIC, &tv);
+  return (int64_t)tv.tv_sec * 1000000000LL + tv.tv_nsec;
+#else
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (int64_t)tv.tv_sec * 1000000000LL + tv.tv_usec * 1000LL;
+#endif
+}
+
+
 #define COMBINE2(a,b) (((a) << 8) | (b))
 #define COMBINE3(a,b,c) (((a) << 16) | ((b) << 8) | (c))
 #define COMBINE4(a,b,c, d) (((a) << 24) | ((b) << 16) | ((c) << 8) | (d))
@@ -173,7 +191,7 @@ bitchk(const uint32_t *bs, int v)
 /**
  *
  */
-static void
+static void __attribute__((unused))
 bitset_or(uint32_t *bs, const uint32_t *src, int words)
 {
   for(int i = 0; i < words; i++)
@@ -0,0 +1,189 @@
+/*
+ * Copyright (c) 2016 Lonelycoder AB
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/**
+ * Binary instruction trace (VM_TRACE_RING builds)
+ *
+ * vm_exec() appends a fixed size vm_trace_rec_t for every instruction
+ * to a ring buffer. Nothing is formatted while running, instead the ring
+ * is saved as is and rendered afterwards by a process that has loaded
+ * the same bitcode (the instruction strings come from the backrefs
+ * generated when emitting code)
+ *
+ * File format: vm_trace_file_hdr_t followed by the records, oldest first
+ */
+
+#ifdef VM_TRACE_RING
+
+typedef struct vm_trace_file_hdr {
+  char vtfh_magic[8];
+  uint32_t vtfh_recsize;
+  uint32_t vtfh_records;
+} vm_trace_file_hdr_t;
+
+static const char vm_trace_magic[8] = "VMIRTRC1";
+
+
+/**
+ *
+ */
+int
+vmir_trace_ring_enable(ir_unit_t *iu, int records)
+{
+  if(records <= 0 || records > (1 << 28))
+    return VMIR_ERR_INVALID_ARGS;
+
+  uint32_t size = 1;
+  while(size < records)
+    size <<= 1;
+
+  vm_trace_ring_t *ring = calloc(1, sizeof(vm_trace_ring_t) +
+                                 size * sizeof(vm_trace_rec_t));
+  if(ring == NULL)
+    return -1;
+  ring->vtr_mask = size - 1;
+  free(iu->iu_trace_ring);
+  iu->iu_trace_ring = ring;
+  return 0;
+}
+
+
+/**
+ *
+ */
+int
+vmir_trace_ring_save(ir_unit_t *iu, const char *path)
+{
+  const vm_trace_ring_t *ring = iu->iu_trace_ring;
+  if(ring == NULL)
+    return -1;
+
+  FILE *fp = fopen(path, "w");
+  if(fp == NULL)
+    return -1;
+
+  const uint64_t head = __atomic_load_n(&ring->vtr_head, __ATOMIC_ACQUIRE);
+  const uint32_t size = ring->vtr_mask + 1;
+  const uint32_t num = head < size ? head : size;
+  const uint32_t first = (head - num) & ring->vtr_mask;
+
+  vm_trace_file_hdr_t hdr;
+  memcpy(hdr.vtfh_magic, vm_trace_magic, sizeof(hdr.vtfh_magic));
+  hdr.vtfh_recsize = sizeof(vm_trace_rec_t);
+  hdr.vtfh_records = num;
+  fwrite(&hdr, sizeof(hdr), 1, fp);
+
+  // Oldest part is at the end of the buffer if we've wrapped
+  const uint32_t tail = VMIR_MIN(num, size - first);
+  fwrite(ring->vtr_recs + first, sizeof(vm_trace_rec_t), tail, fp);
+  fwrite(ring->vtr_recs, sizeof(vm_trace_rec_t), num - tail, fp);
+  return fclose(fp) ? -1 : 0;
+}
+
+
+/**
+ *
+ */
+int
+vmir_trace_ring_decode(ir_unit_t *iu, const char *path)
+{
+  FILE *fp = fopen(path, "r");
+  if(fp == NULL)
+    return -1;
+
+  vm_trace_file_hdr_t hdr;
+  if(fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+     memcmp(hdr.vtfh_magic, vm_trace_magic, sizeof(hdr.vtfh_magic)) ||
+     hdr.vtfh_recsize != sizeof(vm_trace_rec_t)) {
+    vmir_log(iu, VMIR_LOG_ERROR, "%s: Not a VMIR trace", path);
+    fclose(fp);
+    return -1;
+  }
+
+  const int num_funcs = VECTOR_LEN(&iu->iu_functions);
+  vm_trace_rec_t r;
+  for(uint32_t i = 0; i < hdr.vtfh_records; i++) {
+    if(fread(&r, sizeof(r), 1, fp) != 1)
+      break;
+
+    const ir_function_t *f =
+      r.vtr_gfid < num_funcs ? VECTOR_ITEM(&iu->iu_functions, r.vtr_gfid) : NULL;
+
+    ir_instr_backref_t q, *iib = NULL;
+    q.offset = r.vtr_pc;
+    if(f != NULL)
+      iib = bsearch(&q, f->if_instr_backrefs, f->if_instr_backref_size,
+                    sizeof(ir_instr_backref_t), vm_find_backref);
+
+    printf("%s()", f ? f->if_name : "???");
+    if(iib != NULL)
+      printf(".%d: %-50s", iib->bb, iib->str);
+    else
+      printf(": @%-49d", r.vtr_pc);
+
+    printf(" [op:%04x", r.vtr_opcode);
+    for(int j = 0; j < 3; j++)
+      printf(" %04x=%08x", r.vtr_args[j], r.vtr_regs[j]);
+    printf("]\n");
+  }
+  fclose(fp);
+  return 0;
+}
+
+
+/**
+ *
+ */
+static void
+trace_ring_destroy(ir_unit_t *iu)
+{
+  free(iu->iu_trace_ring);
+}
+
+#else
+
+int
+vmir_trace_ring_enable(ir_unit_t *iu, int records)
+{
+  return -1;
+}
+
+int
+vmir_trace_ring_save(ir_unit_t *iu, const char *path)
+{
+  return -1;
+}
+
+int
+vmir_trace_ring_decode(ir_unit_t *iu, const char *path)
+{
+  return -1;
+}
+
+static void
+trace_ring_destroy(ir_unit_t *iu)
+{
+}
+
+#endif
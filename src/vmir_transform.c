@@ -816,6 +816,7 @@ typedef struct phi_lift_node {
   LIST_ENTRY(phi_lift_node) pln_link;
   struct phi_lift_edge_list pln_src;
   struct phi_lift_edge *pln_dst;
+  struct phi_lift_node *pln_copy; // Node already holding our original value
   ir_valuetype_t pln_vt;
 } phi_lift_node_t;
 
@@ -854,6 +855,7 @@ phi_lift_node_init(struct phi_lift_node_list *nodes, phi_lift_node_t *pln,
   LIST_INSERT_HEAD(nodes, pln, pln_link);
   LIST_INIT(&pln->pln_src);
   pln->pln_dst = NULL;
+  pln->pln_copy = NULL;
 }
 
 
@@ -941,6 +943,8 @@ exit_ssa_edge(ir_unit_t *iu, ir_function_t *f, ir_bb_t *bb,
         continue;
 
       insert_move(iu, ple->ple_dst->pln_vt, ple->ple_src->pln_vt, last);
+      if(ple->ple_src->pln_copy == NULL)
+        ple->ple_src->pln_copy = ple->ple_dst;
 
       progress = 1;
       LIST_REMOVE(ple, ple_link);
@@ -957,30 +961,49 @@ exit_ssa_edge(ir_unit_t *iu, ir_function_t *f, ir_bb_t *bb,
       break;
   }
 
-
+  /*
+   * Only cycles remain. Each cycle is broken by saving one of its
+   * values. If a value in the cycle was already copied out above that
+   * copy is still intact and can be used instead of a temporary.
+   * Otherwise a temporary is allocated (and reused by later cycles
+   * of the same type as it's dead once the cycle is resolved)
+   */
+  ir_valuetype_t tmpreg = {.value = -1};
 
   while(1) {
-    phi_lift_node_t *start = LIST_FIRST(&nodes);
+    phi_lift_node_t *start, *pln;
+    LIST_FOREACH(start, &nodes, pln_link)
+      if(start->pln_copy != NULL)
+        break;
+
+    if(start == NULL)
+      start = LIST_FIRST(&nodes);
     if(start == NULL)
       break;
-    // Add a move to temporary register to resolve cycle
 
-    ir_valuetype_t tmpreg = value_alloc_temporary(iu, start->pln_vt.type);
-    insert_move(iu, tmpreg, start->pln_vt, last);
+    ir_valuetype_t saved;
+    if(start->pln_copy != NULL) {
+      saved = start->pln_copy->pln_vt;
+    } else {
+      if(tmpreg.value == -1 || tmpreg.type != start->pln_vt.type)
+        tmpreg = value_alloc_temporary(iu, start->pln_vt.type);
+      insert_move(iu, tmpreg, start->pln_vt, last);
+      saved = tmpreg;
+    }
 
-    phi_lift_node_t *cur = start;
+    pln = start;
     while(1) {
-      phi_lift_node_t *src = cur->pln_dst->ple_src;
+      phi_lift_node_t *src = pln->pln_dst->ple_src;
       if(src == start)
         break;
 
-      insert_move(iu, cur->pln_vt, src->pln_vt, last);
-      LIST_REMOVE(cur, pln_link);
-      cur = src;
+      insert_move(iu, pln->pln_vt, src->pln_vt, last);
+      LIST_REMOVE(pln, pln_link);
+      pln = src;
     }
 
-    insert_move(iu, cur->pln_vt, tmpreg, last);
-    LIST_REMOVE(cur, pln_link);
+    insert_move(iu, pln->pln_vt, saved, last);
+    LIST_REMOVE(pln, pln_link);
   }
 }
 
@@ -1239,6 +1262,7 @@ liveness_set_succ(ir_function_t *f, ir_instr_t *ii)
   case IR_IC_STACKCOPY:
   case IR_IC_STACKSHRINK:
   case IR_IC_MLA:
+  case IR_IC_DIVC:
   case IR_IC_LANDINGPAD:
   case IR_IC_EXTRACTVAL:
     /* -1 just means that we have one successor and it's the next instruction
@@ -1304,8 +1328,32 @@ liveness_set_succ(ir_function_t *f, ir_instr_t *ii)
   }
 }
 
+/**
+ * Target for the values read by an instruction. If 'list' is set values
+ * that were not already in 'bs' are also appended to it so a sparse set
+ * can be built without scanning the bitset
+ */
+typedef struct liveness_gen {
+  uint32_t *bs;
+  int *list;
+  int num;
+  int capacity;
+} liveness_gen_t;
+
+
+static void
+liveness_list_append(liveness_gen_t *g, int value)
+{
+  if(g->num == g->capacity) {
+    g->capacity = VMIR_MAX(g->capacity * 2, 16);
+    g->list = realloc(g->list, g->capacity * sizeof(int));
+  }
+  g->list[g->num++] = value;
+}
+
+
 static void
-liveness_set_value(uint32_t *bs, ir_unit_t *iu, ir_valuetype_t vt)
+liveness_set_value(liveness_gen_t *g, ir_unit_t *iu, ir_valuetype_t vt)
 {
   int value = vt.value;
   ir_value_t *iv = VECTOR_ITEM(&iu->iu_values, value);
@@ -1315,11 +1363,13 @@ liveness_set_value(uint32_t *bs, ir_unit_t *iu, ir_valuetype_t vt)
   value -= iu->iu_first_func_value;
   assert(value >= 0);
 
-  bitset(bs, value);
+  if(g->list != NULL && !bitchk(g->bs, value))
+    liveness_list_append(g, value);
+  bitset(g->bs, value);
 }
 
 static void
-liveness_set_gen(ir_instr_t *ii, ir_unit_t *iu, uint32_t *bs)
+liveness_gen(ir_instr_t *ii, ir_unit_t *iu, liveness_gen_t *g)
 {
   switch(ii->ii_class) {
   case IR_IC_UNREACHABLE:
@@ -1329,56 +1379,56 @@ liveness_set_gen(ir_instr_t *ii, ir_unit_t *iu, uint32_t *bs)
 
   case IR_IC_RET:
     if(((ir_instr_unary_t *)ii)->value.value != -1)
-      liveness_set_value(bs, iu, ((ir_instr_unary_t *)ii)->value);
+      liveness_set_value(g, iu, ((ir_instr_unary_t *)ii)->value);
     break;
 
   case IR_IC_CAST:
   case IR_IC_VAARG:
-    liveness_set_value(bs, iu, ((ir_instr_unary_t *)ii)->value);
+    liveness_set_value(g, iu, ((ir_instr_unary_t *)ii)->value);
     break;
   case IR_IC_LOAD:
-    liveness_set_value(bs, iu, ((ir_instr_load_t *)ii)->ptr);
+    liveness_set_value(g, iu, ((ir_instr_load_t *)ii)->ptr);
     if(((ir_instr_load_t *)ii)->value_offset.value >= 0)
-      liveness_set_value(bs, iu, ((ir_instr_load_t *)ii)->value_offset);
+      liveness_set_value(g, iu, ((ir_instr_load_t *)ii)->value_offset);
     break;
 
   case IR_IC_BINOP:
   case IR_IC_CMP2:
-    liveness_set_value(bs, iu, ((ir_instr_binary_t *)ii)->lhs_value);
-    liveness_set_value(bs, iu, ((ir_instr_binary_t *)ii)->rhs_value);
+    liveness_set_value(g, iu, ((ir_instr_binary_t *)ii)->lhs_value);
+    liveness_set_value(g, iu, ((ir_instr_binary_t *)ii)->rhs_value);
     break;
   case IR_IC_CMP_BRANCH:
-    liveness_set_value(bs, iu, ((ir_instr_cmp_branch_t *)ii)->lhs_value);
-    liveness_set_value(bs, iu, ((ir_instr_cmp_branch_t *)ii)->rhs_value);
+    liveness_set_value(g, iu, ((ir_instr_cmp_branch_t *)ii)->lhs_value);
+    liveness_set_value(g, iu, ((ir_instr_cmp_branch_t *)ii)->rhs_value);
     break;
   case IR_IC_STORE:
-    liveness_set_value(bs, iu, ((ir_instr_store_t *)ii)->value);
-    liveness_set_value(bs, iu, ((ir_instr_store_t *)ii)->ptr);
+    liveness_set_value(g, iu, ((ir_instr_store_t *)ii)->value);
+    liveness_set_value(g, iu, ((ir_instr_store_t *)ii)->ptr);
     break;
   case IR_IC_BR:
     if(((ir_instr_br_t *)ii)->condition.value != -1)
-      liveness_set_value(bs, iu, ((ir_instr_br_t *)ii)->condition);
+      liveness_set_value(g, iu, ((ir_instr_br_t *)ii)->condition);
     break;
   case IR_IC_ALLOCA:
-    liveness_set_value(bs, iu, ((ir_instr_alloca_t *)ii)->num_items_value);
+    liveness_set_value(g, iu, ((ir_instr_alloca_t *)ii)->num_items_value);
     break;
   case IR_IC_SELECT:
-    liveness_set_value(bs, iu, ((ir_instr_select_t *)ii)->pred);
-    liveness_set_value(bs, iu, ((ir_instr_select_t *)ii)->true_value);
-    liveness_set_value(bs, iu, ((ir_instr_select_t *)ii)->false_value);
+    liveness_set_value(g, iu, ((ir_instr_select_t *)ii)->pred);
+    liveness_set_value(g, iu, ((ir_instr_select_t *)ii)->true_value);
+    liveness_set_value(g, iu, ((ir_instr_select_t *)ii)->false_value);
     break;
   case IR_IC_CMP_SELECT:
-    liveness_set_value(bs, iu, ((ir_instr_cmp_select_t *)ii)->lhs_value);
-    liveness_set_value(bs, iu, ((ir_instr_cmp_select_t *)ii)->rhs_value);
-    liveness_set_value(bs, iu, ((ir_instr_cmp_select_t *)ii)->true_value);
-    liveness_set_value(bs, iu, ((ir_instr_cmp_select_t *)ii)->false_value);
+    liveness_set_value(g, iu, ((ir_instr_cmp_select_t *)ii)->lhs_value);
+    liveness_set_value(g, iu, ((ir_instr_cmp_select_t *)ii)->rhs_value);
+    liveness_set_value(g, iu, ((ir_instr_cmp_select_t *)ii)->true_value);
+    liveness_set_value(g, iu, ((ir_instr_cmp_select_t *)ii)->false_value);
     break;
   case IR_IC_LEA:
     {
       ir_instr_lea_t *lea = (ir_instr_lea_t *)ii;
-      liveness_set_value(bs, iu, lea->baseptr);
+      liveness_set_value(g, iu, lea->baseptr);
       if(lea->value_offset.value != -1)
-        liveness_set_value(bs, iu, lea->value_offset);
+        liveness_set_value(g, iu, lea->value_offset);
     }
     break;
   case IR_IC_CALL:
@@ -1386,52 +1436,63 @@ liveness_set_gen(ir_instr_t *ii, ir_unit_t *iu, uint32_t *bs)
   case IR_IC_INVOKE:
     {
       ir_instr_call_t *p = (ir_instr_call_t *)ii;
-      liveness_set_value(bs, iu, p->callee);
+      liveness_set_value(g, iu, p->callee);
       for(int i = 0; i < p->argc; i++)
-        liveness_set_value(bs, iu, p->argv[i].value);
+        liveness_set_value(g, iu, p->argv[i].value);
     }
     break;
   case IR_IC_SWITCH:
     {
       ir_instr_switch_t *s = (ir_instr_switch_t *)ii;
-      liveness_set_value(bs, iu, s->value);
+      liveness_set_value(g, iu, s->value);
     }
     break;
   case IR_IC_MOVE:
     {
       ir_instr_move_t *p = (ir_instr_move_t *)ii;
-      liveness_set_value(bs, iu, p->value);
+      liveness_set_value(g, iu, p->value);
     }
     break;
   case IR_IC_STACKCOPY:
     {
       ir_instr_stackcopy_t *sc = (ir_instr_stackcopy_t *)ii;
-      liveness_set_value(bs, iu, sc->value);
+      liveness_set_value(g, iu, sc->value);
     }
     break;
   case IR_IC_MLA:
     {
-      liveness_set_value(bs, iu, ((ir_instr_ternary_t *)ii)->arg1);
-      liveness_set_value(bs, iu, ((ir_instr_ternary_t *)ii)->arg2);
-      liveness_set_value(bs, iu, ((ir_instr_ternary_t *)ii)->arg3);
+      liveness_set_value(g, iu, ((ir_instr_ternary_t *)ii)->arg1);
+      liveness_set_value(g, iu, ((ir_instr_ternary_t *)ii)->arg2);
+      liveness_set_value(g, iu, ((ir_instr_ternary_t *)ii)->arg3);
     }
     break;
+  case IR_IC_DIVC:
+    liveness_set_value(g, iu, ((ir_instr_divc_t *)ii)->value);
+    break;
   case IR_IC_RESUME:
     {
       ir_instr_resume_t *icr = (ir_instr_resume_t *)ii;
       for(int i=0; i<icr->num_values; ++i)
-        liveness_set_value(bs, iu, ((ir_instr_resume_t *)ii)->values[i]);
+        liveness_set_value(g, iu, ((ir_instr_resume_t *)ii)->values[i]);
     }
     break;
 
   default:
-    printf("liveness_set_gen: can't handle instruction class %d\n",
+    printf("liveness_gen: can't handle instruction class %d\n",
            ii->ii_class);
     abort();
   }
 }
 
 
+static void
+liveness_set_gen(ir_instr_t *ii, ir_unit_t *iu, uint32_t *bs)
+{
+  liveness_gen_t g = { .bs = bs };
+  liveness_gen(ii, iu, &g);
+}
+
+
 /**
  *
  */
@@ -1534,6 +1595,9 @@ instr_replace_values(ir_instr_t *ii, ir_unit_t *iu, int from, int to)
     instr_replace_value(iu, &((ir_instr_ternary_t *)ii)->arg2, from, to);
     instr_replace_value(iu, &((ir_instr_ternary_t *)ii)->arg3, from, to);
     break;
+  case IR_IC_DIVC:
+    instr_replace_value(iu, &((ir_instr_divc_t *)ii)->value, from, to);
+    break;
   case IR_IC_CMP_SELECT:
     instr_replace_value(iu, &((ir_instr_cmp_select_t *)ii)->true_value, from, to);
     instr_replace_value(iu, &((ir_instr_cmp_select_t *)ii)->false_value, from, to);
@@ -1556,6 +1620,74 @@ instr_replace_values(ir_instr_t *ii, ir_unit_t *iu, int from, int to)
 }
 
 
+/**
+ *
+ */
+static int
+value_num_defs(const ir_value_t *iv)
+{
+  const ir_value_instr_t *ivi;
+  int cnt = 0;
+  LIST_FOREACH(ivi, &iv->iv_instructions, ivi_value_link)
+    if(ivi->ivi_relation == IVI_OUTPUT)
+      cnt++;
+  return cnt;
+}
+
+
+/**
+ * Propagate copies made by moves left after exiting SSA form
+ *
+ * A move dst <- src is removed (and all uses of dst rewritten to src)
+ * if the move is the only definition of dst and src is defined at most
+ * once. The move then dominates every use of dst and src can't have
+ * changed in between
+ */
+static void
+copy_propagate(ir_unit_t *iu, ir_function_t *f)
+{
+  ir_bb_t *ib;
+  ir_instr_t *ii, *iin;
+  ir_value_instr_t *ivi, *ivin;
+
+  TAILQ_FOREACH(ib, &f->if_bbs, ib_link) {
+    for(ii = TAILQ_FIRST(&ib->ib_instrs); ii != NULL; ii = iin) {
+      iin = TAILQ_NEXT(ii, ii_link);
+      if(ii->ii_class != IR_IC_MOVE || ii->ii_ret.value < 0)
+        continue;
+
+      ir_instr_move_t *m = (ir_instr_move_t *)ii;
+      ir_value_t *dst = value_get(iu, ii->ii_ret.value);
+      ir_value_t *src = value_get(iu, m->value.value);
+
+      if(dst == src ||
+         dst->iv_class != IR_VC_TEMPORARY ||
+         src->iv_class != IR_VC_TEMPORARY ||
+         dst->iv_precolored != -1 ||
+         src->iv_precolored != -1 ||
+         dst->iv_type != src->iv_type)
+        continue;
+
+      if(value_num_defs(dst) != 1 || value_num_defs(src) > 1)
+        continue;
+
+      for(ivi = LIST_FIRST(&dst->iv_instructions); ivi != NULL; ivi = ivin) {
+        ivin = LIST_NEXT(ivi, ivi_value_link);
+        if(ivi->ivi_relation != IVI_INPUT)
+          continue;
+        instr_replace_values(ivi->ivi_instr, iu, dst->iv_id, src->iv_id);
+        LIST_REMOVE(ivi, ivi_value_link);
+        ivi->ivi_value = src;
+        LIST_INSERT_HEAD(&src->iv_instructions, ivi, ivi_value_link);
+      }
+
+      instr_destroy(ii);
+      dst->iv_class = IR_VC_DEAD;
+      iu->iu_stats.moves_killed++;
+    }
+  }
+}
+
 
 /**
  *
@@ -1634,20 +1766,24 @@ value_info_cmp(const void *A, const void *B)
 #define RA_CLASS_REGFRAME_32    1
 #define RA_CLASS_REGFRAME_64    2
 
+/**
+ * Functions with more temporaries than this use linear scan allocation
+ * instead of building an interference matrix
+ */
+#define RA_LINEAR_SCAN_THRESHOLD 8192
+
 
 
 /**
  *
  */
-static void
-reg_alloc(ir_unit_t *iu, const uint32_t *mtx, int temp_values, int ffv,
-          ir_function_t *f)
+static int
+reg_alloc_vertices(ir_unit_t *iu, int temp_values, int ffv,
+                   value_info_t *vi, int *graph_degreep)
 {
   int num_vertices = 0;
   int graph_degree = 0;
 
-  value_info_t *vi = malloc(temp_values * sizeof(value_info_t));
-
   for(int i = 0; i < temp_values; i++) {
     const ir_value_t *iv = value_get(iu, i + ffv);
     if(iv->iv_class != IR_VC_TEMPORARY || iv->iv_precolored != -1)
@@ -1670,22 +1806,110 @@ reg_alloc(ir_unit_t *iu, const uint32_t *mtx, int temp_values, int ffv,
     graph_degree = VMIR_MAX(graph_degree, iv->iv_edges);
     num_vertices++;
   }
+  if(graph_degreep != NULL)
+    *graph_degreep = graph_degree;
+  return num_vertices;
+}
+
+
+/**
+ * Turn colors into machine registers or register frame slots
+ */
+static void
+reg_alloc_assign(ir_unit_t *iu, const value_info_t *vi, int num_vertices,
+                 const int *colors, int ffv, ir_function_t *f)
+{
+  int class_reg_size[RA_CLASSES];
+
+  class_reg_size[RA_CLASS_MACHINEREG_32] = 0;
+  class_reg_size[RA_CLASS_REGFRAME_32] = 4;
+  class_reg_size[RA_CLASS_REGFRAME_64] = 8;
+
+#ifdef JIT_MACHINE_REGS
+  for(int c = 0; c < RA_CLASS_REGFRAME_32; c++) {
+
+    int regframe_slots = 0;
+    int machine_regs_used = 0;
+    const int rsize = 4;
+
+    for(int i = 0; i < num_vertices; i++) {
+      const int val_index = vi[i].value;
+      if(vi[i].class != c)
+        continue;
+      const int color = colors[val_index];
+      ir_value_t *iv = VECTOR_ITEM(&iu->iu_values, val_index + ffv);
+
+      if(color < JIT_MACHINE_REGS) {
+        iv->iv_class = IR_VC_MACHINEREG;
+        iv->iv_reg = color;
+        machine_regs_used = VMIR_MAX(color + 1, machine_regs_used);
+      } else {
+        // Not enough machine regs, put value in regframe instead
+        iv->iv_class = IR_VC_REGFRAME;
+        const int rfcol = color - JIT_MACHINE_REGS;
+        regframe_slots = VMIR_MAX(regframe_slots, rfcol + 1);
+        iv->iv_reg = f->if_regframe_size + rfcol * rsize;
+      }
+    }
+    f->if_regframe_size += regframe_slots * rsize;
+
+    if(iu->iu_debug_flags_func & VMIR_DBG_DUMP_REGALLOC)
+      printf(", %d machine regs (%d spilled)",
+             machine_regs_used, regframe_slots);
+  }
+#endif
+
+  for(int c = RA_CLASS_REGFRAME_32; c < RA_CLASSES; c++) {
+    const int rsize = class_reg_size[c];
+    int regframe_slots = 0;
+
+    f->if_regframe_size = VMIR_ALIGN(f->if_regframe_size, rsize);
+
+    for(int i = 0; i < num_vertices; i++) {
+      const int val_index = vi[i].value;
+      if(vi[i].class != c)
+        continue;
+      const int color = colors[val_index];
+      ir_value_t *iv = VECTOR_ITEM(&iu->iu_values, val_index + ffv);
+      iv->iv_class = IR_VC_REGFRAME;
+      iv->iv_reg = f->if_regframe_size + color * rsize;
+      regframe_slots = VMIR_MAX(regframe_slots, color + 1);
+    }
+    f->if_regframe_size += regframe_slots * rsize;
+
+    if(iu->iu_debug_flags_func & VMIR_DBG_DUMP_REGALLOC)
+      printf(", %d rf%d", regframe_slots, rsize);
+  }
+
+  if(iu->iu_debug_flags_func & VMIR_DBG_DUMP_REGALLOC)
+    printf("\n");
+}
+
+
+/**
+ *
+ */
+static void
+reg_alloc(ir_unit_t *iu, const uint32_t *mtx, int temp_values, int ffv,
+          ir_function_t *f)
+{
+  int graph_degree;
+
+  value_info_t *vi = malloc(temp_values * sizeof(value_info_t));
+
+  const int num_vertices = reg_alloc_vertices(iu, temp_values, ffv, vi,
+                                              &graph_degree);
 
   qsort(vi, num_vertices, sizeof(value_info_t), value_info_cmp);
 
   // Color graph and use color to allocate register
 
   uint32_t *colortab[RA_CLASSES];
-  int class_reg_size[RA_CLASSES];
   const int degree_words = (graph_degree + 32) / 32;
   for(int i = 0; i < RA_CLASSES; i++) {
     colortab[i] = malloc(degree_words * sizeof(uint32_t));
   }
 
-  class_reg_size[RA_CLASS_MACHINEREG_32] = 0;
-  class_reg_size[RA_CLASS_REGFRAME_32] = 4;
-  class_reg_size[RA_CLASS_REGFRAME_64] = 8;
-
   int *colors = malloc(sizeof(int) * temp_values);
   memset(colors, 0xff, sizeof(int) * temp_values);
   for(int i = 0; i < num_vertices; i++) {
@@ -1729,166 +1953,644 @@ reg_alloc(ir_unit_t *iu, const uint32_t *mtx, int temp_values, int ffv,
     printf("%s: Reg allocation, %d temporaries",
            f->if_name, temp_values);
 
+  reg_alloc_assign(iu, vi, num_vertices, colors, ffv, f);
 
-#ifdef JIT_MACHINE_REGS
-  for(int c = 0; c < RA_CLASS_REGFRAME_32; c++) {
+  for(int i = 0; i < RA_CLASSES; i++) {
+    free(colortab[i]);
+  }
+  free(colors);
+  free(vi);
+}
 
-    int regframe_slots = 0;
-    int machine_regs_used = 0;
-    const int rsize = 4;
 
-    for(int i = 0; i < num_vertices; i++) {
-      const int val_index = vi[i].value;
-      if(vi[i].class != c)
-        continue;
-      const int color = colors[val_index];
-      ir_value_t *iv = VECTOR_ITEM(&iu->iu_values, val_index + ffv);
+/**
+ * Live interval of a temporary value.
+ *
+ * Positions are two per instruction in function order: 2n is where
+ * instruction n reads its inputs and 2n+1 is where it writes its outputs.
+ * The interval is a single range without holes, so it's conservative
+ */
+typedef struct live_interval {
+  int li_start;
+  int li_end;
+} live_interval_t;
 
-      if(color < JIT_MACHINE_REGS) {
-        iv->iv_class = IR_VC_MACHINEREG;
-        iv->iv_reg = color;
-        machine_regs_used = VMIR_MAX(color + 1, machine_regs_used);
-      } else {
-        // Not enough machine regs, put value in regframe instead
-        iv->iv_class = IR_VC_REGFRAME;
-        const int rfcol = color - JIT_MACHINE_REGS;
-        regframe_slots = VMIR_MAX(regframe_slots, rfcol + 1);
-        iv->iv_reg = f->if_regframe_size + rfcol * rsize;
+
+/**
+ *
+ */
+static void __inline
+live_interval_extend(live_interval_t *li, int pos)
+{
+  li->li_start = VMIR_MIN(li->li_start, pos);
+  li->li_end = VMIR_MAX(li->li_end, pos);
+}
+
+
+/**
+ *
+ */
+static int __inline
+live_interval_overlap(const live_interval_t *a, const live_interval_t *b)
+{
+  return VMIR_MAX(a->li_start, b->li_start) <= VMIR_MIN(a->li_end, b->li_end);
+}
+
+
+/**
+ * Since intervals have no holes they can be built from the basic block
+ * live-in / live-out sets plus the uses and definitions of each
+ * instruction without deriving the full per instruction liveness
+ */
+static live_interval_t *
+live_intervals_build(ir_unit_t *iu, int setwords, int temp_values,
+                     int ffv, ir_function_t *f)
+{
+  live_interval_t *lis = malloc(temp_values * sizeof(live_interval_t));
+  ir_bb_t *ib;
+  ir_instr_t *ii;
+  ir_value_instr_t *ivi;
+  int pos = 0;
+
+  for(int i = 0; i < temp_values; i++) {
+    lis[i].li_start = INT32_MAX;
+    lis[i].li_end = -1;
+  }
+
+  TAILQ_FOREACH(ib, &f->if_bbs, ib_link) {
+    const int start = pos;
+
+    TAILQ_FOREACH(ii, &ib->ib_instrs, ii_link) {
+      LIST_FOREACH(ivi, &ii->ii_values, ivi_instr_link) {
+        if(ivi->ivi_relation == IVI_INPUT)
+          live_interval_extend(&lis[ivi->ivi_value->iv_id - ffv], pos);
+      }
+
+      if(ii->ii_ret.value < -1) {
+        for(int j = 0; j < -ii->ii_ret.value; j++)
+          live_interval_extend(&lis[ii->ii_rets[j].value - ffv], pos + 1);
+      } else if(ii->ii_ret.value >= 0) {
+        live_interval_extend(&lis[ii->ii_ret.value - ffv], pos + 1);
       }
+      pos += 2;
     }
-    f->if_regframe_size += regframe_slots * rsize;
 
-    if(iu->iu_debug_flags_func & VMIR_DBG_DUMP_REGALLOC)
-      printf(", %d machine regs (%d spilled)",
-             machine_regs_used, regframe_slots);
+    for(int j = 0; j < ib->ib_live_in.ls_size; j++)
+      live_interval_extend(&lis[ib->ib_live_in.ls_values[j]], start);
+    for(int j = 0; j < ib->ib_live_out.ls_size; j++)
+      live_interval_extend(&lis[ib->ib_live_out.ls_values[j]], pos - 1);
   }
-#endif
+  return lis;
+}
+
+
+/**
+ * Linear scan register allocation over live intervals
+ *
+ * Used instead of graph coloring for functions with a lot of temporaries
+ * where the O(n^2) interference matrix is too expensive
+ */
+static void
+reg_alloc_linear_scan(ir_unit_t *iu, const live_interval_t *lis,
+                      int temp_values, int ffv, ir_function_t *f)
+{
+  value_info_t *vi = malloc(temp_values * sizeof(value_info_t));
+
+  const int num_vertices = reg_alloc_vertices(iu, temp_values, ffv, vi, NULL);
+
+  for(int i = 0; i < num_vertices; i++)
+    vi[i].score = lis[vi[i].value].li_start;
+
+  qsort(vi, num_vertices, sizeof(value_info_t), value_info_cmp);
+
+  // For each class and color, the position where the color becomes free
+  int *color_end[RA_CLASSES];
+  int num_colors[RA_CLASSES];
+  for(int i = 0; i < RA_CLASSES; i++) {
+    color_end[i] = malloc(sizeof(int) * (num_vertices + 1));
+    num_colors[i] = 0;
+  }
+
+  int *colors = malloc(sizeof(int) * temp_values);
+  memset(colors, 0xff, sizeof(int) * temp_values);
+
+  for(int i = 0; i < num_vertices; i++) {
+    const int val_index = vi[i].value;
+    const live_interval_t *li = &lis[val_index];
+    const int class = vi[i].class;
+    int *ce = color_end[class];
+    int c;
+
+    if(li->li_start > li->li_end) {
+      // Never referenced, any register will do
+      colors[val_index] = 0;
+      if(num_colors[class] == 0)
+        ce[num_colors[class]++] = -1;
+      continue;
+    }
+
+    for(c = 0; c < num_colors[class]; c++)
+      if(ce[c] < li->li_start)
+        break;
+
+    if(c == num_colors[class])
+      num_colors[class]++;
+    ce[c] = li->li_end;
+    colors[val_index] = c;
+  }
+
+  if(iu->iu_debug_flags_func & VMIR_DBG_DUMP_REGALLOC)
+    printf("%s: Linear scan reg allocation, %d temporaries",
+           f->if_name, temp_values);
+
+  reg_alloc_assign(iu, vi, num_vertices, colors, ffv, f);
+
+  for(int i = 0; i < RA_CLASSES; i++)
+    free(color_end[i]);
+  free(colors);
+  free(vi);
+}
+
+
+/**
+ * Remove the values written by an instruction from a live set
+ */
+static void __inline
+liveness_kill(const ir_instr_t *ii, uint32_t *bs, int ffv)
+{
+  if(ii->ii_ret.value < -1) {
+    // Multiple return values
+    for(int j = 0; j < -ii->ii_ret.value; j++)
+      bitclr(bs, ii->ii_rets[j].value - ffv);
+  } else if(ii->ii_ret.value >= 0) {
+    bitclr(bs, ii->ii_ret.value - ffv);
+  }
+}
+
+
+/**
+ * Step liveness backwards over an instruction.
+ *
+ * On entry 'live' is the set of values live after the instruction and on
+ * return it's the set of values live before it. This is how per
+ * instruction liveness is derived from the per basic block sets
+ */
+static void
+liveness_step(ir_unit_t *iu, const ir_instr_t *ii, uint32_t *live, int ffv)
+{
+  liveness_kill(ii, live, ffv);
+  liveness_set_gen((ir_instr_t *)ii, iu, live);
+}
+
+
+/**
+ *
+ */
+static int
+liveset_value_cmp(const void *A, const void *B)
+{
+  return *(const int *)A - *(const int *)B;
+}
+
+
+/**
+ * Store a sorted array of values in a live set
+ */
+static void
+liveset_store(ir_liveset_t *ls, const int *values, int size)
+{
+  if(size > ls->ls_capacity) {
+    ls->ls_capacity = VMIR_MAX(size, ls->ls_capacity * 2);
+    ls->ls_values = realloc(ls->ls_values, ls->ls_capacity * sizeof(int));
+  }
+  if(size > 0)
+    memcpy(ls->ls_values, values, size * sizeof(int));
+  ls->ls_size = size;
+}
+
+
+/**
+ * Add / remove the values in a live set to / from a bitset
+ */
+static void
+liveset_load(uint32_t *bs, const ir_liveset_t *ls)
+{
+  for(int i = 0; i < ls->ls_size; i++)
+    bitset(bs, ls->ls_values[i]);
+}
+
+static void
+liveset_unload(uint32_t *bs, const ir_liveset_t *ls)
+{
+  for(int i = 0; i < ls->ls_size; i++)
+    bitclr(bs, ls->ls_values[i]);
+}
+
+
+/**
+ * dst = a | b, all sorted. Returns size of dst
+ */
+static int
+liveset_union(int *dst, const int *a, int na, const int *b, int nb)
+{
+  int i = 0, j = 0, n = 0;
+  while(i < na && j < nb) {
+    if(a[i] < b[j]) {
+      dst[n++] = a[i++];
+    } else if(a[i] > b[j]) {
+      dst[n++] = b[j++];
+    } else {
+      dst[n++] = a[i++];
+      j++;
+    }
+  }
+  while(i < na)
+    dst[n++] = a[i++];
+  while(j < nb)
+    dst[n++] = b[j++];
+  return n;
+}
+
+
+/**
+ * Block transfer function, dst = use | (out & ~def). Returns size of dst
+ */
+static int
+liveset_transfer(int *dst, const ir_liveset_t *use, const ir_liveset_t *out,
+                 const ir_liveset_t *def)
+{
+  const int *u = use->ls_values;
+  const int *o = out->ls_values;
+  const int *d = def->ls_values;
+  int i = 0, k = 0, n = 0;
+
+  for(int j = 0; j < out->ls_size; j++) {
+    const int v = o[j];
+    while(k < def->ls_size && d[k] < v)
+      k++;
+    if(k < def->ls_size && d[k] == v)
+      continue;
+    while(i < use->ls_size && u[i] < v)
+      dst[n++] = u[i++];
+    if(i < use->ls_size && u[i] == v)
+      i++;
+    dst[n++] = v;
+  }
+  while(i < use->ls_size)
+    dst[n++] = u[i++];
+  return n;
+}
+
+
+/**
+ * Compute upward exposed uses and definitions for a basic block
+ *
+ * 'scratch' is two all zero bitsets which are returned cleared. Only the
+ * values the block touches are visited so the cost is proportional to
+ * the size of the block and not to the number of temporaries.
+ *
+ * The sorted use and def sets are appended to 'pool' in that order and
+ * their sizes are returned in 'use' and 'def'
+ */
+static void
+liveness_bb_use_def(ir_unit_t *iu, ir_bb_t *ib, int setwords, int ffv,
+                    uint32_t *scratch, liveness_gen_t *g, liveness_gen_t *d,
+                    liveness_gen_t *pool, ir_liveset_t *use, ir_liveset_t *def)
+{
+  uint32_t *usebs = scratch;
+  uint32_t *defbs = scratch + setwords;
+  ir_instr_t *ii;
+
+  g->bs = usebs;
+  g->num = 0;
+  d->num = 0;
+
+  for(ii = TAILQ_LAST(&ib->ib_instrs, ir_instr_queue); ii != NULL;
+      ii = TAILQ_PREV(ii, ir_instr_queue, ii_link)) {
+    const int num_rets = ii->ii_ret.value < -1 ? -ii->ii_ret.value :
+      ii->ii_ret.value >= 0 ? 1 : 0;
+    const ir_valuetype_t *rets = ii->ii_ret.value < -1 ?
+      ii->ii_rets : &ii->ii_ret;
+
+    for(int j = 0; j < num_rets; j++) {
+      const int v = rets[j].value - ffv;
+      bitclr(usebs, v);
+      if(!bitchk(defbs, v)) {
+        bitset(defbs, v);
+        liveness_list_append(d, v);
+      }
+    }
+    liveness_gen(ii, iu, g);
+  }
+
+  // A value can be appended more than once if it's defined in between
+  int num_uses = 0;
+  for(int i = 0; i < g->num; i++) {
+    const int v = g->list[i];
+    if(bitchk(usebs, v)) {
+      bitclr(usebs, v);
+      g->list[num_uses++] = v;
+    }
+  }
+  for(int i = 0; i < d->num; i++)
+    bitclr(defbs, d->list[i]);
+
+  qsort(g->list, num_uses, sizeof(int), liveset_value_cmp);
+  qsort(d->list, d->num, sizeof(int), liveset_value_cmp);
+  for(int i = 0; i < num_uses; i++)
+    liveness_list_append(pool, g->list[i]);
+  for(int i = 0; i < d->num; i++)
+    liveness_list_append(pool, d->list[i]);
+  use->ls_size = num_uses;
+  def->ls_size = d->num;
+}
+
+
+/**
+ * Number basic blocks in depth first post order starting at the entry
+ * block. Blocks not reachable from entry are numbered last.
+ * Returns array of blocks indexed by order
+ */
+static ir_bb_t **
+liveness_order(ir_function_t *f, int *num_bbsp)
+{
+  ir_bb_t *ib;
+  int num_bbs = 0;
+
+  TAILQ_FOREACH(ib, &f->if_bbs, ib_link) {
+    ib->ib_mark = 0;
+    num_bbs++;
+  }
+
+  ir_bb_t **order = malloc(num_bbs * sizeof(ir_bb_t *));
+  ir_bb_t **stack = malloc(num_bbs * sizeof(ir_bb_t *));
+  int *stack_succ = malloc(num_bbs * sizeof(int));
+  int n = 0;
+
+  TAILQ_FOREACH(ib, &f->if_bbs, ib_link) {
+    if(ib->ib_mark)
+      continue;
+
+    int sp = 0;
+    ib->ib_mark = 1;
+    stack[sp] = ib;
+    stack_succ[sp] = 0;
+    sp++;
+
+    while(sp > 0) {
+      ir_bb_t *cur = stack[sp - 1];
+      const ir_instr_t *last = TAILQ_LAST(&cur->ib_instrs, ir_instr_queue);
+      const int i = stack_succ[sp - 1]++;
+
+      if(i < last->ii_num_succ) {
+        ir_bb_t *succ = last->ii_succ[i];
+        if(!succ->ib_mark) {
+          succ->ib_mark = 1;
+          stack[sp] = succ;
+          stack_succ[sp] = 0;
+          sp++;
+        }
+        continue;
+      }
+      cur->ib_dfo = n;
+      order[n++] = cur;
+      sp--;
+    }
+  }
+
+  free(stack);
+  free(stack_succ);
+  *num_bbsp = num_bbs;
+  return order;
+}
+
+
+/**
+ * Solve liveness per basic block using a worklist.
+ *
+ * Liveness is a backwards problem so blocks are initially visited in
+ * post order (ie, reverse of reverse-post-order) which makes most
+ * functions converge in one or two passes. When the live-in set of a
+ * block changes its predecessors are put back on the worklist.
+ *
+ * The sets are sparse (sorted arrays) so memory and time follow the
+ * number of values actually live at block boundaries rather than
+ * blocks * temporaries
+ */
+static void
+liveness_solve(ir_unit_t *iu, ir_function_t *f, int setwords, int ffv)
+{
+  const int max_values = setwords * 32;
+  int *buf = malloc(max_values * sizeof(int) * 3);
+  int *new_in = buf + max_values * 2;
+  int num_bbs;
+  ir_bb_t **order = liveness_order(f, &num_bbs);
+
+  // Predecessor lists in compressed form, indexed by depth first order
+  int *pred_start = calloc(num_bbs + 1, sizeof(int));
+  int num_edges = 0;
+
+  for(int i = 0; i < num_bbs; i++) {
+    const ir_bb_t *ib = order[i];
+    const ir_instr_t *last = TAILQ_LAST(&ib->ib_instrs, ir_instr_queue);
+    for(int j = 0; j < last->ii_num_succ; j++)
+      pred_start[last->ii_succ[j]->ib_dfo + 1]++;
+    num_edges += VMIR_MAX(last->ii_num_succ, 0);
+  }
+  for(int i = 0; i < num_bbs; i++)
+    pred_start[i + 1] += pred_start[i];
+
+  ir_bb_t **preds = malloc(VMIR_MAX(num_edges, 1) * sizeof(ir_bb_t *));
+  int *pred_fill = malloc(num_bbs * sizeof(int));
+  memcpy(pred_fill, pred_start, num_bbs * sizeof(int));
+
+  for(int i = 0; i < num_bbs; i++) {
+    ir_bb_t *ib = order[i];
+    const ir_instr_t *last = TAILQ_LAST(&ib->ib_instrs, ir_instr_queue);
+    for(int j = 0; j < last->ii_num_succ; j++)
+      preds[pred_fill[last->ii_succ[j]->ib_dfo]++] = ib;
+  }
+  free(pred_fill);
+
+  // Worklist is a ring buffer, ib_mark is set while on the list
+  ir_bb_t **wl = malloc(num_bbs * sizeof(ir_bb_t *));
+  int wl_head = 0;
+  int wl_len = num_bbs;
+
+  // Upward exposed uses and definitions, indexed by depth first order
+  ir_liveset_t *use = calloc(num_bbs * 2, sizeof(ir_liveset_t));
+  ir_liveset_t *def = use + num_bbs;
+  uint32_t *scratch = calloc(setwords * 2, sizeof(uint32_t));
+  liveness_gen_t g = { .capacity = 16 };
+  liveness_gen_t d = { .capacity = 16 };
+  liveness_gen_t pool = { .capacity = 256 };
+  g.list = malloc(g.capacity * sizeof(int));
+  d.list = malloc(d.capacity * sizeof(int));
+  pool.list = malloc(pool.capacity * sizeof(int));
+
+  for(int i = 0; i < num_bbs; i++) {
+    ir_bb_t *ib = order[i];
+    ib->ib_live_out.ls_size = 0;
+    ib->ib_live_in.ls_size = 0;
+    liveness_bb_use_def(iu, ib, setwords, ffv, scratch, &g, &d, &pool,
+                        &use[i], &def[i]);
+    ib->ib_mark = 1;
+    wl[i] = ib;
+  }
+  int *p = pool.list;
+  for(int i = 0; i < num_bbs; i++) {
+    use[i].ls_values = p;
+    p += use[i].ls_size;
+    def[i].ls_values = p;
+    p += def[i].ls_size;
+  }
+  free(scratch);
+  free(g.list);
+  free(d.list);
+
+  while(wl_len > 0) {
+    ir_bb_t *ib = wl[wl_head];
+    wl_head = (wl_head + 1) % num_bbs;
+    wl_len--;
+    ib->ib_mark = 0;
+
+    // out = union of successors live-in
+    const ir_instr_t *last = TAILQ_LAST(&ib->ib_instrs, ir_instr_queue);
+    ir_bb_t **succ = last->ii_succ;
+    if(last->ii_num_succ <= 0) {
+      ib->ib_live_out.ls_size = 0;
+    } else if(last->ii_num_succ == 1) {
+      liveset_store(&ib->ib_live_out, succ[0]->ib_live_in.ls_values,
+                    succ[0]->ib_live_in.ls_size);
+    } else {
+      int *out = buf;
+      int *tmp = buf + max_values;
+      int num_out = liveset_union(out,
+                                  succ[0]->ib_live_in.ls_values,
+                                  succ[0]->ib_live_in.ls_size,
+                                  succ[1]->ib_live_in.ls_values,
+                                  succ[1]->ib_live_in.ls_size);
+      for(int j = 2; j < last->ii_num_succ; j++) {
+        num_out = liveset_union(tmp, out, num_out,
+                                succ[j]->ib_live_in.ls_values,
+                                succ[j]->ib_live_in.ls_size);
+        int *t = out;
+        out = tmp;
+        tmp = t;
+      }
+      liveset_store(&ib->ib_live_out, out, num_out);
+    }
 
-  for(int c = RA_CLASS_REGFRAME_32; c < RA_CLASSES; c++) {
-    const int rsize = class_reg_size[c];
-    int regframe_slots = 0;
+    const int num_in = liveset_transfer(new_in, &use[ib->ib_dfo],
+                                        &ib->ib_live_out, &def[ib->ib_dfo]);
 
-    f->if_regframe_size = VMIR_ALIGN(f->if_regframe_size, rsize);
+    ir_liveset_t *in = &ib->ib_live_in;
+    if(in->ls_size == num_in &&
+       (num_in == 0 ||
+        !memcmp(in->ls_values, new_in, num_in * sizeof(int))))
+      continue;
 
-    for(int i = 0; i < num_vertices; i++) {
-      const int val_index = vi[i].value;
-      if(vi[i].class != c)
+    liveset_store(in, new_in, num_in);
+
+    for(int j = pred_start[ib->ib_dfo]; j < pred_start[ib->ib_dfo + 1]; j++) {
+      ir_bb_t *pred = preds[j];
+      if(pred->ib_mark)
         continue;
-      const int color = colors[val_index];
-      ir_value_t *iv = VECTOR_ITEM(&iu->iu_values, val_index + ffv);
-      iv->iv_class = IR_VC_REGFRAME;
-      iv->iv_reg = f->if_regframe_size + color * rsize;
-      regframe_slots = VMIR_MAX(regframe_slots, color + 1);
+      pred->ib_mark = 1;
+      wl[(wl_head + wl_len) % num_bbs] = pred;
+      wl_len++;
     }
-    f->if_regframe_size += regframe_slots * rsize;
-
-    if(iu->iu_debug_flags_func & VMIR_DBG_DUMP_REGALLOC)
-      printf(", %d rf%d", regframe_slots, rsize);
   }
 
-  if(iu->iu_debug_flags_func & VMIR_DBG_DUMP_REGALLOC)
-    printf("\n");
-
-  for(int i = 0; i < RA_CLASSES; i++) {
-    free(colortab[i]);
-  }
-  free(colors);
-  free(vi);
+  free(pool.list);
+  free(use);
+  free(buf);
+  free(wl);
+  free(preds);
+  free(pred_start);
+  free(order);
 }
 
+
 /**
- *
+ * Compute liveness and remove instructions whose results are never used.
+ * Repeat until no more dead instructions are found
  */
 static void
-liveness_update(ir_function_t *f, int setwords, int ffv)
+liveness_update(ir_unit_t *iu, ir_function_t *f, int setwords, int ffv)
 {
-  uint32_t *new_in  = alloca(setwords * sizeof(uint32_t));
-  uint32_t *new_out = alloca(setwords * sizeof(uint32_t));
+  uint32_t *live = calloc(setwords, sizeof(uint32_t));
   ir_bb_t *ib;
   ir_instr_t *ii, *k, *kn;
-  int rounds = 0;
 
   SLIST_HEAD(, ir_instr) dead_instr;
 
   while(1) {
-
-    int stable = 1;
     SLIST_INIT(&dead_instr);
 
-    // Liveness analysis reach stable state a lot faster if iterating
-    // backwards
+    liveness_solve(iu, f, setwords, ffv);
 
-    for(ib = TAILQ_LAST(&f->if_bbs, ir_bb_queue); ib != NULL;
-        ib = TAILQ_PREV(ib, ir_bb_queue, ib_link)) {
+    TAILQ_FOREACH(ib, &f->if_bbs, ib_link) {
+      liveset_load(live, &ib->ib_live_out);
 
       for(ii = TAILQ_LAST(&ib->ib_instrs, ir_instr_queue); ii != NULL;
           ii = TAILQ_PREV(ii, ir_instr_queue, ii_link)) {
 
-        const uint32_t *o;
-
-        if(ii->ii_num_succ == -1) {
-          ir_instr_t *succ = TAILQ_NEXT(ii, ii_link);
-          o = succ->ii_liveness + setwords * 2;
-        } else {
-          memset(new_out, 0, setwords * sizeof(uint32_t));
-
-          for(int j = 0; j < ii->ii_num_succ; j++) {
-            ir_bb_t *ib = ii->ii_succ[j];
-            ir_instr_t *succ = TAILQ_FIRST(&ib->ib_instrs);
-            assert(succ != NULL);
-            const uint32_t *in = succ->ii_liveness + setwords * 2;
-            bitset_or(new_out, in, setwords);
-          }
-          o = new_out;
+        if(ii->ii_ret.value >= 0 &&
+           !bitchk(live, ii->ii_ret.value - ffv) &&
+           !instr_have_side_effects(ii)) {
+          SLIST_INSERT_HEAD(&dead_instr, ii, ii_tmplink);
         }
+        liveness_step(iu, ii, live, ffv);
+      }
+      // Stepping over the whole block leaves exactly the live-in set
+      liveset_unload(live, &ib->ib_live_in);
+    }
 
-        memcpy(new_in, o, setwords * sizeof(uint32_t));
-        if(ii->ii_ret.value < -1) {
-          // Multiple return values
-          for(int j = 0; j < -ii->ii_ret.value; j++) {
-            bitclr(new_in, ii->ii_rets[j].value - ffv);
-          }
-        } else if(ii->ii_ret.value >= 0) {
-
-          if(stable && !bitchk(o, ii->ii_ret.value - ffv) &&
-             !instr_have_side_effects(ii)) {
-            SLIST_INSERT_HEAD(&dead_instr, ii, ii_tmplink);
-          }
-          bitclr(new_in, ii->ii_ret.value - ffv);
-        }
+    k = SLIST_FIRST(&dead_instr);
+    if(k == NULL) {
+      free(live);
+      return;
+    }
 
-        uint32_t       *out = ii->ii_liveness;
-        const uint32_t *gen = ii->ii_liveness + setwords;
-        uint32_t       *in  = ii->ii_liveness + setwords * 2;
+    for(; k != NULL; k = kn) {
+      kn = SLIST_NEXT(k, ii_tmplink);
+      instr_destroy(k);
+    }
+  }
+}
 
-        bitset_or(new_in, gen, setwords);
 
-        if(!memcmp(out, o,       setwords * sizeof(uint32_t)) &&
-           !memcmp(in,  new_in,  setwords * sizeof(uint32_t))) {
-          continue;
-        }
+#ifdef VMIR_VM_JIT
+/**
+ * The JIT works on per instruction liveness so expand the basic block
+ * sets into [out] [gen] [in] for each instruction
+ */
+static void
+liveness_materialize(ir_unit_t *iu, ir_function_t *f, int setwords, int ffv)
+{
+  uint32_t *live = calloc(setwords, sizeof(uint32_t));
+  ir_bb_t *ib;
+  ir_instr_t *ii;
 
-        stable = 0;
-        memcpy(out, o,       setwords * sizeof(uint32_t));
-        memcpy(in,  new_in,  setwords * sizeof(uint32_t));
-      }
-    }
-    rounds++;
-    if(!stable)
-      continue;
+  TAILQ_FOREACH(ib, &f->if_bbs, ib_link) {
+    liveset_load(live, &ib->ib_live_out);
 
-    k = SLIST_FIRST(&dead_instr);
-    if(k != NULL) {
-      for(; k != NULL; k = kn) {
-        kn = SLIST_NEXT(k, ii_tmplink);
-        instr_destroy(k);
-      }
-      continue;
+    for(ii = TAILQ_LAST(&ib->ib_instrs, ir_instr_queue); ii != NULL;
+        ii = TAILQ_PREV(ii, ir_instr_queue, ii_link)) {
+      free(ii->ii_liveness);
+      ii->ii_liveness = calloc(1, sizeof(uint32_t) * setwords * 3);
+      memcpy(ii->ii_liveness, live, setwords * sizeof(uint32_t));
+      liveness_set_gen(ii, iu, ii->ii_liveness + setwords);
+      liveness_step(iu, ii, live, ffv);
+      memcpy(ii->ii_liveness + setwords * 2, live,
+             setwords * sizeof(uint32_t));
     }
-    return;
+    liveset_unload(live, &ib->ib_live_in);
   }
+  free(live);
 }
-
+#endif
 
 
 /**
@@ -1897,17 +2599,30 @@ liveness_update(ir_function_t *f, int setwords, int ffv)
 static void __attribute__((unused))
 print_liveout(ir_unit_t *iu, ir_function_t *f, int temp_values, int ffv)
 {
+  const int setwords = (temp_values + 31) / 32;
+  uint32_t *live = calloc(setwords, sizeof(uint32_t));
   ir_bb_t *ib;
   ir_instr_t *ii;
 
   TAILQ_FOREACH(ib, &f->if_bbs, ib_link) {
-    TAILQ_FOREACH(ii, &ib->ib_instrs, ii_link) {
+    printf(".%d:\n", ib->ib_id);
+    for(int j = 0; j < ib->ib_live_in.ls_size; j++)
+      printf("\tLivein: %s\n",
+             value_str_id(iu, ib->ib_live_in.ls_values[j] + ffv));
+
+    // Per instruction liveness is derived backwards, so print backwards
+    liveset_load(live, &ib->ib_live_out);
+    for(ii = TAILQ_LAST(&ib->ib_instrs, ir_instr_queue); ii != NULL;
+        ii = TAILQ_PREV(ii, ir_instr_queue, ii_link)) {
       printf("%s\n", instr_str(iu, ii, 0));
       for(int j = 0; j < temp_values; j++)
-        if(bitchk(ii->ii_liveness, j))
+        if(bitchk(live, j))
           printf("\tLiveout: %s\n", value_str_id(iu, j + ffv));
+      liveness_step(iu, ii, live, ffv);
     }
+    liveset_unload(live, &ib->ib_live_in);
   }
+  free(live);
 }
 
 
@@ -1915,14 +2630,11 @@ print_liveout(ir_unit_t *iu, ir_function_t *f, int temp_values, int ffv)
  *
  */
 static void
-coalesce(ir_unit_t *iu,
-         int setwords, int temp_values,
-         int ffv, ir_function_t *f)
+interference_build(ir_unit_t *iu, uint32_t *mtx, int setwords, int ffv,
+                   ir_function_t *f)
 {
-  // Interference Matrix
-  uint32_t *mtx = tribitmtx_alloc(temp_values);
   ir_bb_t *ib;
-  ir_instr_t *ii, *iin;
+  ir_instr_t *ii;
 
   /*
    * Any non-move instruction that defines variable 'a' add
@@ -1931,10 +2643,17 @@ coalesce(ir_unit_t *iu,
    * Any move instruction a <- b add interference for (a, {liveout} - b)
    *
    */
+  uint32_t *out = calloc(setwords, sizeof(uint32_t));
+
   TAILQ_FOREACH(ib, &f->if_bbs, ib_link) {
-    TAILQ_FOREACH(ii, &ib->ib_instrs, ii_link) {
-      if(ii->ii_ret.value == -1)
+    liveset_load(out, &ib->ib_live_out);
+
+    for(ii = TAILQ_LAST(&ib->ib_instrs, ir_instr_queue); ii != NULL;
+        ii = TAILQ_PREV(ii, ir_instr_queue, ii_link)) {
+      if(ii->ii_ret.value == -1) {
+        liveness_step(iu, ii, out, ffv);
         continue;
+      }
 
       int num_ret_values;
       const ir_valuetype_t *ret_values;
@@ -1950,8 +2669,6 @@ coalesce(ir_unit_t *iu,
       if(ii->ii_class == IR_IC_MOVE)
         v = ((ir_instr_move_t *)ii)->value.value - ffv;
 
-      const uint32_t *out = ii->ii_liveness;
-
       for(int a = 0; a < num_ret_values; a++) {
         int x = ret_values[a].value;
         ir_value_t *xval = value_get(iu, x);
@@ -1974,7 +2691,33 @@ coalesce(ir_unit_t *iu,
         }
         xval->iv_edges += edges;
       }
+      liveness_step(iu, ii, out, ffv);
     }
+    liveset_unload(out, &ib->ib_live_in);
+  }
+  free(out);
+}
+
+
+/**
+ *
+ */
+static void
+coalesce(ir_unit_t *iu,
+         int setwords, int temp_values,
+         int ffv, ir_function_t *f)
+{
+  uint32_t *mtx = NULL;
+  live_interval_t *lis = NULL;
+  ir_bb_t *ib;
+  ir_instr_t *ii, *iin;
+
+  if(temp_values > RA_LINEAR_SCAN_THRESHOLD) {
+    lis = live_intervals_build(iu, setwords, temp_values, ffv, f);
+  } else {
+    // Interference Matrix
+    mtx = tribitmtx_alloc(temp_values);
+    interference_build(iu, mtx, setwords, ffv, f);
   }
 
   /*
@@ -2019,7 +2762,13 @@ coalesce(ir_unit_t *iu,
         if(dst->iv_precolored != -1 && src->iv_precolored != -1)
           continue;
 
-        if(!tribitmtx_get(mtx, ii->ii_ret.value - ffv, v - ffv)) {
+        const int dstidx = ii->ii_ret.value - ffv;
+        const int srcidx = v - ffv;
+        const int interfere = lis != NULL ?
+          live_interval_overlap(&lis[dstidx], &lis[srcidx]) :
+          tribitmtx_get(mtx, dstidx, srcidx);
+
+        if(!interfere) {
           ir_value_t *killed, *saved;
 
           if(src->iv_precolored != -1) {
@@ -2051,22 +2800,21 @@ coalesce(ir_unit_t *iu,
             LIST_REMOVE(ivi, ivi_value_link);
             ivi->ivi_value = saved;
             LIST_INSERT_HEAD(&saved->iv_instructions, ivi, ivi_value_link);
-#ifdef VMIR_VM_JIT
-            if(!(iu->iu_debug_flags_func & VMIR_DBG_DISABLE_JIT)) {
-              memset(ivi->ivi_instr->ii_liveness,
-                     0, setwords * sizeof(uint32_t) * 3);
-              liveness_set_gen(ivi->ivi_instr, iu,
-                               ivi->ivi_instr->ii_liveness + setwords);
-            }
-#endif
             if(iu->iu_debug_flags_func & VMIR_DBG_DUMP_REGALLOC) {
               printf("\tPost altering instruction %s\n",
                      instr_str(iu, ivi->ivi_instr, 1));
             }
           }
 
+          if(lis != NULL) {
+            live_interval_t *kli = &lis[killed->iv_id - ffv];
+            live_interval_t *sli = &lis[saved->iv_id - ffv];
+            live_interval_extend(sli, kli->li_start);
+            live_interval_extend(sli, kli->li_end);
+          }
+
           // Merge nodes in interference matrix
-          for(int i = 0; i < temp_values; i++) {
+          for(int i = 0; mtx != NULL && i < temp_values; i++) {
             if(tribitmtx_get(mtx, killed->iv_id - ffv, i)) {
               tribitmtx_clr(mtx, killed->iv_id - ffv, i);
 
@@ -2091,14 +2839,21 @@ coalesce(ir_unit_t *iu,
   remove_empty_bb(iu, f);
 
 #ifdef VMIR_VM_JIT
-  if(!(iu->iu_debug_flags_func & VMIR_DBG_DISABLE_JIT)) {
-    liveness_update(f, setwords, ffv);
+  // JITed code doesn't emit the function instrumentation ops
+  if(!(iu->iu_debug_flags_func &
+       (VMIR_DBG_DISABLE_JIT | VMIR_DBG_FUNC_INSTRUMENT))) {
+    liveness_update(iu, f, setwords, ffv);
+    liveness_materialize(iu, f, setwords, ffv);
     jit_analyze(iu, f, setwords, ffv);
   }
 #endif
 
-  reg_alloc(iu, mtx, temp_values, ffv, f);
+  if(lis != NULL)
+    reg_alloc_linear_scan(iu, lis, temp_values, ffv, f);
+  else
+    reg_alloc(iu, mtx, temp_values, ffv, f);
   free(mtx);
+  free(lis);
 }
 
 
@@ -2119,17 +2874,24 @@ liveness_analysis(ir_unit_t *iu, ir_function_t *f)
 
   ir_bb_t *ib;
   ir_instr_t *ii;
+  int64_t ts = get_ts_ns();
 
   TAILQ_FOREACH(ib, &f->if_bbs, ib_link) {
-    TAILQ_FOREACH(ii, &ib->ib_instrs, ii_link) {
-      ii->ii_liveness = calloc(1, sizeof(uint32_t) * setwords * 3);
-      liveness_set_gen(ii, iu, ii->ii_liveness + setwords);
+    TAILQ_FOREACH(ii, &ib->ib_instrs, ii_link)
       liveness_set_succ(f, ii);
-    }
   }
 
-  liveness_update(f, setwords, ffv);
+  liveness_update(iu, f, setwords, ffv);
+  ts = phase_mark(iu, VMIR_PHASE_LIVENESS, ts);
   coalesce(iu, setwords, temp_values, ffv, f);
+  phase_mark(iu, VMIR_PHASE_REGALLOC, ts);
+
+  TAILQ_FOREACH(ib, &f->if_bbs, ib_link) {
+    free(ib->ib_live_out.ls_values);
+    free(ib->ib_live_in.ls_values);
+    memset(&ib->ib_live_out, 0, sizeof(ir_liveset_t));
+    memset(&ib->ib_live_in, 0, sizeof(ir_liveset_t));
+  }
 }
 
 
@@ -2478,6 +3240,124 @@ combine_binop_add(ir_unit_t *iu, ir_instr_binary_t *ii)
 }
 
 
+/**
+ * Compute multiply-high magic for unsigned division by d
+ * (Granlund-Montgomery). d must be > 1 and not a power of two
+ */
+static void
+divc_magic_unsigned(ir_instr_divc_t *dc, uint32_t d)
+{
+  const int l = 31 - __builtin_clz(d);
+  const uint64_t n = 1ULL << (32 + l);
+  uint32_t m = n / d;
+  const uint32_t rem = n % d;
+
+  if(d - rem < (1U << l)) {
+    dc->add = 0;
+  } else {
+    // Magic needs 33 bits, use the add-fixup sequence
+    m += m;
+    const uint32_t rem2 = rem * 2;
+    if(rem2 >= d || rem2 < rem)
+      m++;
+    dc->add = 1;
+  }
+  dc->magic = m + 1;
+  dc->shift = l;
+}
+
+
+/**
+ * Compute multiply-high magic for signed division by d.
+ * d must be > 1 and not a power of two
+ */
+static void
+divc_magic_signed(ir_instr_divc_t *dc, uint32_t d)
+{
+  const int l = 31 - __builtin_clz(d);
+  const uint64_t n = 1ULL << (31 + l);
+  uint32_t m = n / d;
+  const uint32_t rem = n % d;
+
+  if(d - rem < (1U << l)) {
+    dc->add = 0;
+    dc->shift = l - 1;
+  } else {
+    m += m;
+    const uint32_t rem2 = rem * 2;
+    if(rem2 >= d || rem2 < rem)
+      m++;
+    dc->add = 1;
+    dc->shift = l;
+  }
+  dc->magic = m + 1;
+}
+
+
+/**
+ * Strength reduce division and remainder by a constant
+ */
+static void
+combine_binop_div_const(ir_unit_t *iu, ir_instr_binary_t *ii)
+{
+  const ir_type_t *ty = type_get(iu, ii->lhs_value.type);
+  if(ty->it_code != IR_TYPE_INT32)
+    return;
+
+  const ir_value_t *lhs = value_get(iu, ii->lhs_value.value);
+  const ir_value_t *rhs = value_get(iu, ii->rhs_value.value);
+  if(lhs->iv_class != IR_VC_TEMPORARY && lhs->iv_class != IR_VC_REGFRAME)
+    return;
+  if(rhs->iv_class != IR_VC_CONSTANT)
+    return;
+
+  const uint32_t d = value_get_const32(iu, rhs);
+  const int is_signed = ii->op == BINOP_SDIV || ii->op == BINOP_SREM;
+  const int pow2 = !(d & (d - 1));
+
+  if(is_signed ? (int32_t)d < 2 : d < 2)
+    return;
+
+  if(pow2 && !is_signed) {
+    // Plain shift or mask, no need for a special instruction
+    if(ii->op == BINOP_UDIV) {
+      ii->op = BINOP_LSHR;
+      ii->rhs_value = value_create_const32(iu, __builtin_ctz(d));
+    } else {
+      ii->op = BINOP_AND;
+      ii->rhs_value = value_create_const32(iu, d - 1);
+    }
+    iu->iu_stats.div_const_reduced++;
+    return;
+  }
+
+  ir_instr_divc_t *dc =
+    instr_add_after(sizeof(ir_instr_divc_t), IR_IC_DIVC, &ii->super);
+
+  dc->super.ii_ret = ii->super.ii_ret;
+  dc->op = ii->op;
+  dc->value = ii->lhs_value;
+  dc->divisor = d;
+
+  if(pow2) {
+    dc->magic = 0;
+    dc->shift = __builtin_ctz(d);
+    dc->add = 0;
+  } else if(is_signed) {
+    divc_magic_signed(dc, d);
+  } else {
+    divc_magic_unsigned(dc, d);
+  }
+
+  instr_bind_input(iu, dc->value, &dc->super);
+  value_bind_return_value(iu, &dc->super);
+
+  instr_destroy(&ii->super);
+
+  iu->iu_stats.div_const_reduced++;
+}
+
+
 /**
  *
  */
@@ -2536,8 +3416,17 @@ combine_binop_cast(ir_unit_t *iu, ir_instr_unary_t *ii)
 static void
 combine_binop(ir_unit_t *iu, ir_instr_binary_t *ii)
 {
-  if(ii->op == BINOP_ADD)
+  switch(ii->op) {
+  case BINOP_ADD:
     combine_binop_add(iu, ii);
+    break;
+  case BINOP_UDIV:
+  case BINOP_SDIV:
+  case BINOP_UREM:
+  case BINOP_SREM:
+    combine_binop_div_const(iu, ii);
+    break;
+  }
 }
 
 /**
@@ -2867,23 +3756,248 @@ legalize_instructions(ir_unit_t *iu, ir_function_t *f)
 }
 
 
+/**
+ *
+ */
+static int
+bb_profile_cmp(const ir_bb_profile_t *a, const ir_bb_profile_t *b)
+{
+  int r = strcmp(a->ibp_func, b->ibp_func);
+  if(r)
+    return r;
+  return a->ibp_bb - b->ibp_bb;
+}
+
+
+/**
+ *
+ */
+static int64_t
+bb_profile_count(ir_unit_t *iu, ir_function_t *f, int bb)
+{
+  const ir_bb_profile_t key = {.ibp_func = f->if_name, .ibp_bb = bb};
+  const ir_bb_profile_t *ibp =
+    bsearch(&key, iu->iu_bb_profile.vh_p, VECTOR_LEN(&iu->iu_bb_profile),
+            sizeof(ir_bb_profile_t), (void *)bb_profile_cmp);
+  return ibp != NULL ? ibp->ibp_count : -1;
+}
+
+
+/**
+ *
+ */
+typedef struct bb_layout_edge {
+  int ble_from;
+  int ble_to;
+  int ble_uncond;
+  int64_t ble_weight;
+} bb_layout_edge_t;
+
+
+/**
+ * Heaviest edges first. Unconditional branches win ties as
+ * those are the only ones we save an instruction on
+ */
+static int
+bb_layout_edge_cmp(const bb_layout_edge_t *a, const bb_layout_edge_t *b)
+{
+  if(a->ble_weight != b->ble_weight)
+    return a->ble_weight > b->ble_weight ? -1 : 1;
+  if(a->ble_uncond != b->ble_uncond)
+    return b->ble_uncond - a->ble_uncond;
+  return a->ble_from - b->ble_from;
+}
+
+
+/**
+ *
+ */
+typedef struct bb_layout_chain {
+  int blc_head;
+  int64_t blc_weight;
+} bb_layout_chain_t;
+
+
+/**
+ *
+ */
+static int
+bb_layout_chain_cmp(const bb_layout_chain_t *a, const bb_layout_chain_t *b)
+{
+  if(a->blc_weight != b->blc_weight)
+    return a->blc_weight > b->blc_weight ? -1 : 1;
+  return a->blc_head - b->blc_head;
+}
+
+
+/**
+ *
+ */
+static int
+bb_layout_find(int *chain, int i)
+{
+  while(chain[i] != i)
+    i = chain[i] = chain[chain[i]];
+  return i;
+}
+
+
+/**
+ * Reorder basic blocks based on execution counts from a profile
+ *
+ * Blocks are greedily merged into chains along the heaviest edges
+ * (Pettis-Hansen) so hot unconditional branches become fallthroughs.
+ * Chains are then placed hottest first with the entry block always
+ * leading. Never executed blocks end up at the end of the function
+ */
+static void
+bb_layout(ir_unit_t *iu, ir_function_t *f)
+{
+  ir_bb_t *ib;
+  int n = 0;
+  int profiled = 0;
+
+  if(VECTOR_LEN(&iu->iu_bb_profile) == 0)
+    return;
+
+  TAILQ_FOREACH(ib, &f->if_bbs, ib_link)
+    n++;
+
+  if(n < 3)
+    return;
+
+  ir_bb_t **bbs = malloc(sizeof(ir_bb_t *) * n);
+  int64_t *count = malloc(sizeof(int64_t) * n);
+  int *next = malloc(sizeof(int) * n * 3);
+  int *prev = next + n;
+  int *chain = prev + n;
+  bb_layout_edge_t *edges = malloc(sizeof(bb_layout_edge_t) * n * 2);
+  bb_layout_chain_t *chains = malloc(sizeof(bb_layout_chain_t) * n);
+  int num_edges = 0;
+  int num_chains = 0;
+
+  n = 0;
+  TAILQ_FOREACH(ib, &f->if_bbs, ib_link) {
+    ib->ib_dfo = n; // Index into arrays above
+    count[n] = bb_profile_count(iu, f, ib->ib_id);
+    if(count[n] >= 0)
+      profiled = 1;
+    else
+      count[n] = 0;
+    next[n] = prev[n] = -1;
+    chain[n] = n;
+    bbs[n++] = ib;
+  }
+
+  if(!profiled)
+    goto out;
+
+  for(int i = 0; i < n; i++) {
+    const ir_instr_t *ii = TAILQ_LAST(&bbs[i]->ib_instrs, ir_instr_queue);
+    int uncond;
+
+    if(ii->ii_class == IR_IC_BR) {
+      uncond = ii->ii_num_succ == 1;
+    } else if(ii->ii_class == IR_IC_CMP_BRANCH) {
+      uncond = 0;
+    } else {
+      continue;
+    }
+
+    if(ii->ii_succ == NULL)
+      continue;
+
+    for(int j = 0; j < ii->ii_num_succ; j++) {
+      const int to = ii->ii_succ[j]->ib_dfo;
+      if(to == 0 || to == i)
+        continue;
+      bb_layout_edge_t *ble = &edges[num_edges++];
+      ble->ble_from = i;
+      ble->ble_to = to;
+      ble->ble_uncond = uncond;
+      ble->ble_weight = uncond ? count[i] : VMIR_MIN(count[i], count[to]);
+    }
+  }
+
+  qsort(edges, num_edges, sizeof(bb_layout_edge_t),
+        (void *)bb_layout_edge_cmp);
+
+  for(int i = 0; i < num_edges; i++) {
+    const int from = edges[i].ble_from;
+    const int to = edges[i].ble_to;
+
+    if(next[from] != -1 || prev[to] != -1)
+      continue;
+
+    // Don't drag cold blocks into a hot chain (or vice versa)
+    if(edges[i].ble_weight == 0 && (count[from] || count[to]))
+      continue;
+
+    const int a = bb_layout_find(chain, from);
+    const int b = bb_layout_find(chain, to);
+    if(a == b)
+      continue;
+
+    next[from] = to;
+    prev[to] = from;
+    chain[b] = a;
+  }
+
+  for(int i = 0; i < n; i++) {
+    if(prev[i] != -1)
+      continue;
+    bb_layout_chain_t *blc = &chains[num_chains++];
+    blc->blc_head = i;
+    blc->blc_weight = 0;
+    for(int j = i; j != -1; j = next[j])
+      blc->blc_weight = VMIR_MAX(blc->blc_weight, count[j]);
+  }
+
+  // Entry block has no predecessors so it's always first chain
+  assert(chains[0].blc_head == 0);
+  qsort(chains + 1, num_chains - 1, sizeof(bb_layout_chain_t),
+        (void *)bb_layout_chain_cmp);
+
+  TAILQ_INIT(&f->if_bbs);
+  for(int i = 0; i < num_chains; i++)
+    for(int j = chains[i].blc_head; j != -1; j = next[j])
+      TAILQ_INSERT_TAIL(&f->if_bbs, bbs[j], ib_link);
+
+  iu->iu_stats.bb_profile_layouts++;
+
+ out:
+  free(chains);
+  free(edges);
+  free(next);
+  free(count);
+  free(bbs);
+}
+
+
 /**
  *
  */
 static void
 transform_function(ir_unit_t *iu, ir_function_t *f)
 {
+  int64_t ts = get_ts_ns();
+
   replace_instructions(iu, f);
+  ts = phase_mark(iu, VMIR_PHASE_REPLACE_INSTRUCTIONS, ts);
 
   function_bind_instr_inputs(iu, f);
 
   construct_cfg(f);
+  ts = phase_mark(iu, VMIR_PHASE_CFG, ts);
 
   break_crtitical_edges(f);
+  ts = phase_mark(iu, VMIR_PHASE_CRITICAL_EDGES, ts);
 
   combine_instructions(iu, f);
+  ts = phase_mark(iu, VMIR_PHASE_COMBINE, ts);
 
   exit_ssa(iu, f);
+  ts = phase_mark(iu, VMIR_PHASE_EXIT_SSA, ts);
 
   int call_arg_base = iu->iu_next_value;
   int num_call_args = prepare_calls(iu, f);
@@ -2891,10 +4005,20 @@ transform_function(ir_unit_t *iu, ir_function_t *f)
   legalize_temporary_values(iu, f);
 
   legalize_instructions(iu, f);
+  ts = phase_mark(iu, VMIR_PHASE_LEGALIZE, ts);
+
+  copy_propagate(iu, f);
+  ts = phase_mark(iu, VMIR_PHASE_COPY_PROPAGATE, ts);
 
   eliminate_dead_code(iu, f);
+  ts = phase_mark(iu, VMIR_PHASE_DCE, ts);
 
-  liveness_analysis(iu, f);
+  liveness_analysis(iu, f); // Accounts liveness and regalloc itself
 
+  ts = get_ts_ns();
   finalize_call_args(iu, f, call_arg_base, num_call_args);
+  ts = phase_mark(iu, VMIR_PHASE_LEGALIZE, ts);
+
+  bb_layout(iu, f);
+  phase_mark(iu, VMIR_PHASE_BB_LAYOUT, ts);
 }
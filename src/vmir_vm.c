@@ -37,6 +37,7 @@ typedef struct vm_frame {
 #ifndef VM_NO_STACK_FRAME
   const ir_function_t *func;
   const struct vm_frame *prev;
+  const uint16_t *retpc;   // Position in prev->func when func was called
   uint32_t *allocapeak;
 
 #ifdef VM_TRACE
@@ -61,7 +62,7 @@ typedef struct vm_frame {
 #define vm_tracef(f, fmt...)
 #endif
 
-#ifdef VM_TRACE
+#ifdef VM_INSTR_BACKREFS
 
 typedef struct ir_instr_backref {
   char *str;
@@ -86,11 +87,20 @@ vm_getfunc(int callee, ir_unit_t *iu)
 static void
 vmir_traceback(struct ir_unit *iu, const char *info)
 {
-  const vm_frame_t *f;
+  const vm_frame_t *f, *callee = NULL;
 
   vmir_log(iu, VMIR_LOG_INFO, "--- Traceback (%s) ---", info);
-  for(f = iu->iu_current_frame; f != NULL; f = f->prev) {
-    vmir_log(iu, VMIR_LOG_INFO, "%s()", f->func->if_name);
+  for(f = iu->iu_current_frame; f != NULL; callee = f, f = f->prev) {
+    // Where we are in f is the return address of the frame it called
+    const ir_line_t *il = NULL;
+    if(callee != NULL && callee->retpc != NULL && f->func->if_vm_text)
+      il = debuginfo_line_lookup(f->func, (const void *)callee->retpc -
+                                 f->func->if_vm_text);
+    if(il != NULL)
+      vmir_log(iu, VMIR_LOG_INFO, "%s() at %s:%d", f->func->if_name,
+               debuginfo_file_name(iu, il->il_file), il->il_line);
+    else
+      vmir_log(iu, VMIR_LOG_INFO, "%s()", f->func->if_name);
   }
   vmir_log(iu, VMIR_LOG_INFO, "--- Traceback end ---");
 }
@@ -282,6 +292,11 @@ vm_strrchr(uint32_t a, int b, void *mem)
 }
 
 
+// stdio slow paths, in vmir_libc.c
+static int vFILE_getc_slow(ir_unit_t *iu, uint32_t vmaddr);
+static int vFILE_putc_slow(ir_unit_t *iu, uint32_t vmaddr, int c);
+
+
 static uint32_t __attribute__((noinline))
 vm_vaarg32(void *rf, void **ptr)
 {
@@ -488,6 +503,43 @@ vm_funcname(int callee, ir_unit_t *iu)
 #define STORE64(ea, v)   vm_store_64(&F, hostmem, ea, v)
 
 
+#elif defined(VM_MEMPROF)
+
+#define MEMPROF(ea, size, store) do {                                   \
+    if(__builtin_expect(iu->iu_memprof != NULL, 0))                     \
+      vm_memprof_access(iu->iu_memprof, P->func, ea, size, store);      \
+  } while(0)
+
+#define MEMPROF_LOAD(r, ea, size, type, rd) do {                        \
+    const uint32_t ea_ = ea;                                            \
+    MEMPROF(ea_, size, 0);                                              \
+    type(r) = rd(HOSTADDR(ea_), iu);                                    \
+  } while(0)
+
+#define MEMPROF_STORE(ea, v, size, wr) do {                             \
+    const uint32_t ea_ = ea;                                            \
+    MEMPROF(ea_, size, 1);                                              \
+    wr(HOSTADDR(ea_), v, iu);                                           \
+  } while(0)
+
+#define LOAD8(r, ea)          MEMPROF_LOAD(r, ea, 1, R32, mem_rd8)
+#define LOAD8_ZEXT_32(r, ea)  MEMPROF_LOAD(r, ea, 1, R32, mem_rd8)
+#define LOAD8_SEXT_32(r, ea)  MEMPROF_LOAD(r, ea, 1, S32, (int8_t)mem_rd8)
+#define LOAD16(r, ea)         MEMPROF_LOAD(r, ea, 2, R32, mem_rd16)
+#define LOAD16_ZEXT_32(r, ea) MEMPROF_LOAD(r, ea, 2, R32, mem_rd16)
+#define LOAD16_SEXT_32(r, ea) MEMPROF_LOAD(r, ea, 2, S32, (int16_t)mem_rd16)
+#define LOAD32(r, ea)         MEMPROF_LOAD(r, ea, 4, R32, mem_rd32)
+#define LOAD64(r, ea)         MEMPROF_LOAD(r, ea, 8, R64, mem_rd64)
+#define STORE8(ea, v)         MEMPROF_STORE(ea, v, 1, mem_wr8)
+#define STORE16(ea, v)        MEMPROF_STORE(ea, v, 2, mem_wr16)
+#define STORE32(ea, v)        MEMPROF_STORE(ea, v, 4, mem_wr32)
+#define STORE64(ea, v)        MEMPROF_STORE(ea, v, 8, mem_wr64)
+
+#define AR32(r, src) R32(r) = src
+#define AR64(r, src) R64(r) = src
+#define AFLT(r, src) RFLT(r) = src
+#define ADBL(r, src) RDBL(r) = src
+
 #else
 
 #define LOAD8(r, ea)          R32(r) = mem_rd8(HOSTADDR(ea), iu)
@@ -527,6 +579,10 @@ vm_funcname(int callee, ir_unit_t *iu)
 
 #define HOSTADDR(x) ((hostmem) + (x))
 
+#ifndef MEMPROF
+#define MEMPROF(ea, size, store)
+#endif
+
 
 static void *
 #ifndef VM_NO_STACK_FRAME
@@ -550,7 +606,7 @@ __attribute__((noinline))
   return r;
 }
 
-#ifdef VM_TRACE
+#ifdef VM_INSTR_BACKREFS
 
 static int vm_find_backref(const void *A, const void *B)
 {
@@ -558,6 +614,9 @@ static int vm_find_backref(const void *A, const void *B)
   const ir_instr_backref_t *b = (const ir_instr_backref_t *)B;
   return a->offset - b->offset;
 }
+#endif
+
+#ifdef VM_TRACE
 
 
 static void
@@ -581,6 +640,63 @@ vm_trace_instruction(const vm_frame_t *frame,
 }
 #endif
 
+
+#ifdef VM_TRACE_RING
+
+/**
+ * Binary trace record, written for every executed VM instruction
+ */
+typedef struct vm_trace_rec {
+  uint32_t vtr_gfid;
+  uint32_t vtr_pc;        // Byte offset of the opcode in the VM text
+  uint16_t vtr_opcode;    // As stored in VM text
+  uint16_t vtr_args[3];   // First three instruction operands
+  uint32_t vtr_regs[3];   // Register contents at vtr_args (0 if outside)
+  uint32_t vtr_reserved;
+} vm_trace_rec_t;
+
+
+/**
+ * Single writer (the thread executing the unit) so no locks needed
+ */
+typedef struct vm_trace_ring {
+  uint64_t vtr_head;      // Number of records ever written
+  uint32_t vtr_mask;
+  vm_trace_rec_t vtr_recs[0];
+} vm_trace_ring_t;
+
+
+static inline void __attribute__((always_inline))
+vm_trace_ring_record(vm_trace_ring_t *ring, const ir_function_t *f,
+                     const uint16_t *I, const void *rf)
+{
+  const uint64_t head = ring->vtr_head;
+  vm_trace_rec_t *r = &ring->vtr_recs[head & ring->vtr_mask];
+  const uint32_t rfsize = f->if_regframe_size;
+
+  r->vtr_gfid = f->if_gfid;
+  r->vtr_pc = (const void *)I - f->if_vm_text;
+  r->vtr_opcode = I[0];
+  for(int i = 0; i < 3; i++) {
+    const uint16_t a = I[1 + i];
+    r->vtr_args[i] = a;
+    r->vtr_regs[i] = a + 4 <= rfsize ? *(const uint32_t *)(rf + a) : 0;
+  }
+  __atomic_store_n(&ring->vtr_head, head + 1, __ATOMIC_RELEASE);
+}
+
+#define TRACE_RING() do {                                           \
+    if(__builtin_expect(iu->iu_trace_ring != NULL, 0))              \
+      vm_trace_ring_record(iu->iu_trace_ring, P->func, I, rf);      \
+  } while(0)
+
+// Records read three operands past the opcode
+#define VM_TEXT_SLACK 6
+#else
+#define TRACE_RING()
+#define VM_TEXT_SLACK 0
+#endif
+
 static inline uint8_t
 rol8(uint8_t x, int r)
 {
@@ -630,6 +746,140 @@ ror64(uint64_t x, int r)
   return (x >> r) | (x << (64 - r));
 }
 
+
+/**
+ * Division by constants, see divc_magic_unsigned() and divc_magic_signed()
+ */
+static inline uint32_t
+udiv_mulhi32(uint32_t x, uint32_t magic, int shift)
+{
+  return (uint32_t)(((uint64_t)x * magic) >> 32) >> shift;
+}
+
+static inline uint32_t
+udiv_mulhi32_add(uint32_t x, uint32_t magic, int shift)
+{
+  uint32_t t = ((uint64_t)x * magic) >> 32;
+  return (((x - t) >> 1) + t) >> shift;
+}
+
+static inline int32_t
+sdiv_mulhi32(int32_t x, uint32_t magic, int shift)
+{
+  int32_t q = ((int64_t)x * (int32_t)magic) >> 32;
+  q >>= shift;
+  return q + ((uint32_t)q >> 31);
+}
+
+static inline int32_t
+sdiv_mulhi32_add(int32_t x, uint32_t magic, int shift)
+{
+  uint32_t t = ((int64_t)x * (int32_t)magic) >> 32;
+  int32_t q = (int32_t)(t + x) >> shift;
+  return q + ((uint32_t)q >> 31);
+}
+
+static inline int32_t
+sdiv_pow2_32(int32_t x, int shift)
+{
+  return (x + (int32_t)((uint32_t)(x >> 31) >> (32 - shift))) >> shift;
+}
+
+/**
+ * Function instrumentation
+ */
+typedef struct vm_fprof_frame {
+  ir_function_t *func;
+  uint64_t ts;
+  uint64_t child;  // Inclusive time of callees
+} vm_fprof_frame_t;
+
+#if defined(__x86_64__) || defined(__i386__)
+static const char vm_fprof_unit[] = "cycles";
+#else
+static const char vm_fprof_unit[] = "ns";
+#endif
+
+static inline uint64_t
+vm_fprof_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+
+/**
+ *
+ */
+static void __attribute__((noinline))
+vm_fprof_enter(ir_unit_t *iu, uint32_t gfid)
+{
+  ir_function_t *f = VECTOR_ITEM(&iu->iu_functions, gfid);
+  f->if_prof_calls++;
+  f->if_prof_active++;
+  vm_fprof_frame_t ff = {f, 0, 0};
+  VECTOR_PUSH_BACK(&iu->iu_fprof_stack, ff);
+  VECTOR_ITEM(&iu->iu_fprof_stack, VECTOR_LEN(&iu->iu_fprof_stack) - 1).ts =
+    vm_fprof_ticks();
+}
+
+
+/**
+ *
+ */
+static ir_function_t *
+vm_fprof_pop(ir_unit_t *iu, uint64_t now)
+{
+  const size_t d = VECTOR_LEN(&iu->iu_fprof_stack) - 1;
+  const vm_fprof_frame_t *ff = &VECTOR_ITEM(&iu->iu_fprof_stack, d);
+  const uint64_t incl = now - ff->ts;
+  ir_function_t *f = ff->func;
+
+  f->if_prof_active--;
+  if(f->if_prof_active == 0)
+    f->if_prof_inclusive += incl; // Only count outermost recursion
+  f->if_prof_exclusive += incl - ff->child;
+  if(d > 0)
+    VECTOR_ITEM(&iu->iu_fprof_stack, d - 1).child += incl;
+  VECTOR_POP(&iu->iu_fprof_stack);
+  return f;
+}
+
+
+/**
+ * Frames above our own were abandoned by exceptions propagating
+ * through functions without landing pads, so pop until we find ourself
+ */
+static void __attribute__((noinline))
+vm_fprof_leave(ir_unit_t *iu, uint32_t gfid)
+{
+  const uint64_t now = vm_fprof_ticks();
+  const ir_function_t *f = VECTOR_ITEM(&iu->iu_functions, gfid);
+  while(VECTOR_LEN(&iu->iu_fprof_stack) > 0)
+    if(vm_fprof_pop(iu, now) == f)
+      break;
+}
+
+
+/**
+ * Unwind frames abandoned by vm_stop()
+ */
+static void
+vm_fprof_unwind(ir_unit_t *iu, size_t depth)
+{
+  if(VECTOR_LEN(&iu->iu_fprof_stack) <= depth)
+    return;
+  const uint64_t now = vm_fprof_ticks();
+  while(VECTOR_LEN(&iu->iu_fprof_stack) > depth)
+    vm_fprof_pop(iu, now);
+}
+
+
 static int16_t vm_resolve(uint16_t opcode);
 
 static int __attribute__((noinline))
@@ -646,6 +896,12 @@ vm_exec(uint16_t *I, void *rf, void *ret, const vm_frame_t *P)
   ir_unit_t *iu = F.iu;
   void *hostmem = iu->iu_mem;
 
+  // Calls go via the function's perf trampoline if enabled
+#define VM_CALL(fid, a, b)                                              \
+  (__builtin_expect(iu->iu_perf_trampolines != NULL, 0) ?               \
+   iu->iu_perf_trampolines[fid](iu->iu_vm_funcs[fid], a, b, &F, vm_exec) : \
+   vm_exec(iu->iu_vm_funcs[fid], a, b, &F))
+
 #ifndef VM_NO_STACK_FRAME
   iu->iu_current_frame = &F;
   F.prev = P;
@@ -655,7 +911,7 @@ vm_exec(uint16_t *I, void *rf, void *ret, const vm_frame_t *P)
 #endif
 
 #define RESTORE_CURRENT_FRAME() iu->iu_current_frame = P
-#define SET_CALLEE_FUNC(x) F.func = vm_getfunc(x, iu)
+#define SET_CALLEE_FUNC(x) do { F.func = vm_getfunc(x, iu); F.retpc = I; } while(0)
 #define ALLOCATRACEPEAK() *F.allocapeak = VMIR_MAX(*F.allocapeak, F.allocaptr)
 #else
 #define RESTORE_CURRENT_FRAME()
@@ -666,7 +922,7 @@ vm_exec(uint16_t *I, void *rf, void *ret, const vm_frame_t *P)
     RESTORE_CURRENT_FRAME();
 
 #ifndef VM_DONT_USE_COMPUTED_GOTO
-#define NEXT(skip) I+=skip; opc = *I++; goto *(&&opz + opc)
+#define NEXT(skip) I+=skip; TRACE_RING(); opc = *I++; goto *(&&opz + opc)
 #define VMOP(x) x:
 
   NEXT(0);
@@ -677,7 +933,7 @@ vm_exec(uint16_t *I, void *rf, void *ret, const vm_frame_t *P)
     vm_stop(iu, VM_STOP_BAD_INSTRUCTION, 0);
 #else
 
-#define NEXT(skip) I+=skip; opc = *I++; goto reswitch
+#define NEXT(skip) I+=skip; TRACE_RING(); opc = *I++; goto reswitch
 
 #ifdef VM_TRACE
 #define VMOP(x) case VM_ ## x : do { if(F.trace) { vm_trace_instruction(&F, P->func, I, #x);} } while(0);
@@ -685,6 +941,7 @@ vm_exec(uint16_t *I, void *rf, void *ret, const vm_frame_t *P)
 #define VMOP(x) case VM_ ## x :
 #endif
 
+  TRACE_RING();
   opc = *I++;
  reswitch:
 
@@ -732,7 +989,7 @@ vm_exec(uint16_t *I, void *rf, void *ret, const vm_frame_t *P)
       r = iu->iu_function_table[I[0]](rf + I[2], rf + I[1], iu, hostmem);
     } else {
       I[-1] = vm_resolve(VM_JSR_VM);
-      r = vm_exec(iu->iu_vm_funcs[I[0]], rf + I[1], rf + I[2], &F);
+      r = VM_CALL(I[0], rf + I[1], rf + I[2]);
     }
     RESTORE_CURRENT_FRAME();
     if(r)
@@ -742,7 +999,7 @@ vm_exec(uint16_t *I, void *rf, void *ret, const vm_frame_t *P)
   VMOP(JSR_VM)
     vm_tracef(&F, "Calling %s", vm_funcname(I[0], iu));
     SET_CALLEE_FUNC(I[0]);
-    r = vm_exec(iu->iu_vm_funcs[I[0]], rf + I[1], rf + I[2], &F);
+    r = VM_CALL(I[0], rf + I[1], rf + I[2]);
     RESTORE_CURRENT_FRAME();
     if(r)
       return r;
@@ -764,7 +1021,7 @@ vm_exec(uint16_t *I, void *rf, void *ret, const vm_frame_t *P)
 
     SET_CALLEE_FUNC(R32(0));
     if(iu->iu_vm_funcs[R32(0)]) {
-      r = vm_exec(iu->iu_vm_funcs[R32(0)], rf + I[1], rf + I[2], &F);
+      r = VM_CALL(R32(0), rf + I[1], rf + I[2]);
       RESTORE_CURRENT_FRAME();
       if(r)
         return r;
@@ -784,14 +1041,14 @@ vm_exec(uint16_t *I, void *rf, void *ret, const vm_frame_t *P)
     if(iu->iu_function_table[I[0]])
       r = iu->iu_function_table[I[0]](rf + I[2], rf + I[1], iu, hostmem);
     else
-      r = vm_exec(iu->iu_vm_funcs[I[0]], rf + I[1], rf + I[2], &F);
+      r = VM_CALL(I[0], rf + I[1], rf + I[2]);
     RESTORE_CURRENT_FRAME();
     I = (void *)I + (int16_t)I[3 + r]; NEXT(0);
 
   VMOP(INVOKE_VM)
     vm_tracef(&F, "Invoking %s", vm_funcname(I[0], iu));
     SET_CALLEE_FUNC(I[0]);
-    r = vm_exec(iu->iu_vm_funcs[I[0]], rf + I[1], rf + I[2], &F);
+    r = VM_CALL(I[0], rf + I[1], rf + I[2]);
     RESTORE_CURRENT_FRAME();
     I = (void *)I + (int16_t)I[3 + r]; NEXT(0);
 
@@ -808,7 +1065,7 @@ vm_exec(uint16_t *I, void *rf, void *ret, const vm_frame_t *P)
     }
     SET_CALLEE_FUNC(R32(0));
     if(iu->iu_vm_funcs[R32(0)]) {
-      r = vm_exec(iu->iu_vm_funcs[R32(0)], rf + I[1], rf + I[2], &F);
+      r = VM_CALL(R32(0), rf + I[1], rf + I[2]);
       RESTORE_CURRENT_FRAME();
     } else if(iu->iu_function_table[R32(0)]) {
       r = iu->iu_function_table[R32(0)](rf + I[2], rf + I[1], iu, hostmem);
@@ -932,6 +1189,37 @@ vm_exec(uint16_t *I, void *rf, void *ret, const vm_frame_t *P)
 
   VMOP(MLA32)     AR32(0, R32(1) * R32(2) + R32(3)); NEXT(4);
 
+  VMOP(MULHI_UDIV32)
+    AR32(0, udiv_mulhi32(R32(1), UIMM32(2), I[4]));
+    NEXT(5);
+  VMOP(MULHI_UDIV32_ADD)
+    AR32(0, udiv_mulhi32_add(R32(1), UIMM32(2), I[4]));
+    NEXT(5);
+  VMOP(MULHI_SDIV32)
+    AR32(0, sdiv_mulhi32(S32(1), UIMM32(2), I[4]));
+    NEXT(5);
+  VMOP(MULHI_SDIV32_ADD)
+    AR32(0, sdiv_mulhi32_add(S32(1), UIMM32(2), I[4]));
+    NEXT(5);
+  VMOP(MULHI_UREM32)
+    AR32(0, R32(1) - udiv_mulhi32(R32(1), UIMM32(2), I[4]) * UIMM32(5));
+    NEXT(7);
+  VMOP(MULHI_UREM32_ADD)
+    AR32(0, R32(1) - udiv_mulhi32_add(R32(1), UIMM32(2), I[4]) * UIMM32(5));
+    NEXT(7);
+  VMOP(MULHI_SREM32)
+    AR32(0, R32(1) - sdiv_mulhi32(S32(1), UIMM32(2), I[4]) * UIMM32(5));
+    NEXT(7);
+  VMOP(MULHI_SREM32_ADD)
+    AR32(0, R32(1) - sdiv_mulhi32_add(S32(1), UIMM32(2), I[4]) * UIMM32(5));
+    NEXT(7);
+  VMOP(SDIV_POW2_32)
+    AR32(0, sdiv_pow2_32(S32(1), I[2]));
+    NEXT(3);
+  VMOP(SREM_POW2_32)
+    AR32(0, R32(1) - ((uint32_t)sdiv_pow2_32(S32(1), I[2]) << I[2]));
+    NEXT(3);
+
   VMOP(ADD_DBL) ADBL(0, RDBL(1) +  RDBL(2)); NEXT(3);
   VMOP(SUB_DBL) ADBL(0, RDBL(1) -  RDBL(2)); NEXT(3);
   VMOP(MUL_DBL) ADBL(0, RDBL(1) *  RDBL(2)); NEXT(3);
@@ -1567,6 +1855,8 @@ vm_exec(uint16_t *I, void *rf, void *ret, const vm_frame_t *P)
 
   VMOP(MEMCPY) {
       uint32_t r = R32(1);
+      MEMPROF(R32(2), R32(3), 0);
+      MEMPROF(R32(1), R32(3), 1);
       memcpy(HOSTADDR(R32(1)), HOSTADDR(R32(2)), R32(3));
       AR32(0, r);
       NEXT(4);
@@ -1574,6 +1864,7 @@ vm_exec(uint16_t *I, void *rf, void *ret, const vm_frame_t *P)
 
   VMOP(MEMSET) {
       uint32_t r = R32(1);
+      MEMPROF(R32(1), R32(3), 1);
       memset(HOSTADDR(R32(1)), R32(2), R32(3));
       AR32(0, r);
       NEXT(4);
@@ -1581,19 +1872,27 @@ vm_exec(uint16_t *I, void *rf, void *ret, const vm_frame_t *P)
 
   VMOP(MEMMOVE) {
       uint32_t r = R32(1);
+      MEMPROF(R32(2), R32(3), 0);
+      MEMPROF(R32(1), R32(3), 1);
       memmove(HOSTADDR(R32(1)), HOSTADDR(R32(2)), R32(3));
       AR32(0, r);
       NEXT(4);
     }
 
   VMOP(LLVM_MEMCPY)
+    MEMPROF(R32(1), R32(2), 0);
+    MEMPROF(R32(0), R32(2), 1);
     memcpy(HOSTADDR(R32(0)), HOSTADDR(R32(1)), R32(2)); NEXT(3);
   VMOP(LLVM_MEMSET)
+    MEMPROF(R32(0), R32(2), 1);
     memset(HOSTADDR(R32(0)), R8(1), R32(2)); NEXT(3);
   VMOP(LLVM_MEMSET64)
+    MEMPROF(R32(0), R64(2), 1);
     memset(HOSTADDR(R32(0)), R8(1), R64(2)); NEXT(3);
 
   VMOP(MEMCMP)
+    MEMPROF(R32(1), R32(3), 0);
+    MEMPROF(R32(2), R32(3), 0);
     AR32(0, memcmp(HOSTADDR(R32(1)), HOSTADDR(R32(2)), R32(3))); NEXT(4);
 
   VMOP(STRCPY) {
@@ -1639,6 +1938,41 @@ vm_exec(uint16_t *I, void *rf, void *ret, const vm_frame_t *P)
   VMOP(STRDUP)
     AR32(0, vm_strdup(R32(1), hostmem)); NEXT(2);
 
+  VMOP(FGETC) {
+      vFILE_t *vf = HOSTADDR(R32(1));
+      if(R32(1) && vf->rpos < vf->rend)
+        AR32(0, *(uint8_t *)HOSTADDR(vf->rpos++));
+      else
+        AR32(0, vFILE_getc_slow(iu, R32(1)));
+      NEXT(2);
+    }
+
+  VMOP(FPUTC) {
+      vFILE_t *vf = HOSTADDR(R32(2));
+      const uint8_t c = R32(1);
+      if(R32(2) && vf->wpos < vf->wend &&
+         (c != '\n' || !(vf->flags & VFILE_LINEBUF))) {
+        *(uint8_t *)HOSTADDR(vf->wpos++) = c;
+        AR32(0, c);
+      } else {
+        AR32(0, vFILE_putc_slow(iu, R32(2), c));
+      }
+      NEXT(3);
+    }
+
+  VMOP(PUTCHAR) {
+      vFILE_t *vf = iu->iu_stdout;
+      const uint8_t c = R32(1);
+      if(vf != NULL && vf->wpos < vf->wend &&
+         (c != '\n' || !(vf->flags & VFILE_LINEBUF))) {
+        *(uint8_t *)HOSTADDR(vf->wpos++) = c;
+        AR32(0, c);
+      } else {
+        AR32(0, vFILE_putc_slow(iu, vmir_host_to_vmaddr(iu, vf), c));
+      }
+      NEXT(2);
+    }
+
   VMOP(VAARG32)
     AR32(0, vm_vaarg32(rf, HOSTADDR(R32(1)))); NEXT(2);
 
@@ -1702,6 +2036,14 @@ vm_exec(uint16_t *I, void *rf, void *ret, const vm_frame_t *P)
 #endif
     VECTOR_ITEM(&iu->iu_instrumentation, UIMM32(0)).ii_count++;
     NEXT(2);
+
+  VMOP(FUNC_ENTER)
+    vm_fprof_enter(iu, UIMM32(0));
+    NEXT(2);
+
+  VMOP(FUNC_LEAVE)
+    vm_fprof_leave(iu, UIMM32(0));
+    NEXT(2);
   }
 
 #ifndef VM_DONT_USE_COMPUTED_GOTO
@@ -1822,6 +2164,17 @@ vm_exec(uint16_t *I, void *rf, void *ret, const vm_frame_t *P)
 
   case VM_MLA32:     return &&MLA32     - &&opz;     break;
 
+  case VM_MULHI_UDIV32:     return &&MULHI_UDIV32     - &&opz; break;
+  case VM_MULHI_UDIV32_ADD: return &&MULHI_UDIV32_ADD - &&opz; break;
+  case VM_MULHI_SDIV32:     return &&MULHI_SDIV32     - &&opz; break;
+  case VM_MULHI_SDIV32_ADD: return &&MULHI_SDIV32_ADD - &&opz; break;
+  case VM_MULHI_UREM32:     return &&MULHI_UREM32     - &&opz; break;
+  case VM_MULHI_UREM32_ADD: return &&MULHI_UREM32_ADD - &&opz; break;
+  case VM_MULHI_SREM32:     return &&MULHI_SREM32     - &&opz; break;
+  case VM_MULHI_SREM32_ADD: return &&MULHI_SREM32_ADD - &&opz; break;
+  case VM_SDIV_POW2_32:     return &&SDIV_POW2_32     - &&opz; break;
+  case VM_SREM_POW2_32:     return &&SREM_POW2_32     - &&opz; break;
+
   case VM_ADD_DBL:   return &&ADD_DBL  - &&opz;     break;
   case VM_SUB_DBL:   return &&SUB_DBL  - &&opz;     break;
   case VM_MUL_DBL:   return &&MUL_DBL  - &&opz;     break;
@@ -2289,9 +2642,15 @@ vm_exec(uint16_t *I, void *rf, void *ret, const vm_frame_t *P)
   case VM_STRLEN:   return &&STRLEN  - &&opz; break;
   case VM_STRDUP:   return &&STRDUP  - &&opz; break;
 
+  case VM_FGETC:    return &&FGETC   - &&opz; break;
+  case VM_FPUTC:    return &&FPUTC   - &&opz; break;
+  case VM_PUTCHAR:  return &&PUTCHAR - &&opz; break;
+
   case VM_UNREACHABLE: return &&UNREACHABLE - &&opz; break;
 
   case VM_INSTRUMENT_COUNT: return &&INSTRUMENT_COUNT - &&opz; break;
+  case VM_FUNC_ENTER:   return &&FUNC_ENTER - &&opz; break;
+  case VM_FUNC_LEAVE:   return &&FUNC_LEAVE - &&opz; break;
 
   default:
     printf("Can't emit op %d\n", I[0]);
@@ -2455,6 +2814,11 @@ vm_align32(ir_unit_t *iu, int imm_at_odd)
 static void
 emit_ret(ir_unit_t *iu, ir_instr_unary_t *ii)
 {
+  if(iu->iu_debug_flags_func & VMIR_DBG_FUNC_INSTRUMENT) {
+    emit_op(iu, VM_FUNC_LEAVE);
+    emit_i32(iu, iu->iu_current_function->if_gfid);
+  }
+
   if(ii->value.value == -1) {
     emit_op(iu, VM_RET_VOID);
     return;
@@ -4445,6 +4809,47 @@ emit_mla(ir_unit_t *iu, ir_instr_ternary_t *ii)
 }
 
 
+/**
+ *
+ */
+static void
+emit_divc(ir_unit_t *iu, ir_instr_divc_t *ii)
+{
+  const ir_value_t *ret = value_get(iu, ii->super.ii_ret.value);
+  const ir_value_t *val = value_get(iu, ii->value.value);
+  vm_op_t op;
+
+  if(val->iv_class != IR_VC_REGFRAME)
+    parser_error(iu, "Can't emit divc for value class %d", val->iv_class);
+
+  if(ii->magic == 0) {
+    switch(ii->op) {
+    case BINOP_SDIV: op = VM_SDIV_POW2_32; break;
+    case BINOP_SREM: op = VM_SREM_POW2_32; break;
+    default:
+      parser_error(iu, "Can't emit divc pow2 op %d", ii->op);
+    }
+    emit_op3(iu, op, value_reg(ret), value_reg(val), ii->shift);
+    return;
+  }
+
+  switch(ii->op) {
+  case BINOP_UDIV: op = ii->add ? VM_MULHI_UDIV32_ADD : VM_MULHI_UDIV32; break;
+  case BINOP_SDIV: op = ii->add ? VM_MULHI_SDIV32_ADD : VM_MULHI_SDIV32; break;
+  case BINOP_UREM: op = ii->add ? VM_MULHI_UREM32_ADD : VM_MULHI_UREM32; break;
+  case BINOP_SREM: op = ii->add ? VM_MULHI_SREM32_ADD : VM_MULHI_SREM32; break;
+  default:
+    parser_error(iu, "Can't emit divc op %d", ii->op);
+  }
+
+  emit_op2(iu, op, value_reg(ret), value_reg(val));
+  emit_i32(iu, ii->magic);
+  emit_i16(iu, ii->shift);
+  if(ii->op == BINOP_UREM || ii->op == BINOP_SREM)
+    emit_i32(iu, ii->divisor);
+}
+
+
 /**
  *
  */
@@ -4473,6 +4878,10 @@ emit_resume(ir_unit_t *iu, ir_instr_resume_t *r)
   if(r->num_values != 2) {
     parser_error(iu, "Unable to emit resume with %d args", r->num_values);
   }
+  if(iu->iu_debug_flags_func & VMIR_DBG_FUNC_INSTRUMENT) {
+    emit_op(iu, VM_FUNC_LEAVE);
+    emit_i32(iu, iu->iu_current_function->if_gfid);
+  }
   emit_op(iu, VM_RESUME);
   emit_i16(iu, value_reg(value_get(iu, r->values[0].value)));
   emit_i16(iu, value_reg(value_get(iu, r->values[1].value)));
@@ -4500,7 +4909,7 @@ instr_emit(ir_unit_t *iu, ir_bb_t *bb, ir_function_t *f
     if(bb->ib_only_jit_sucessors)
       return;
     assert(jitoffset >= 0);
-#ifdef VM_TRACE
+#ifdef VM_INSTR_BACKREFS
     char tmp[128];
     ir_instr_backref_t *iib = f->if_instr_backrefs + f->if_instr_backref_size;
     iib->offset = iu->iu_text_ptr - iu->iu_text_alloc;
@@ -4522,7 +4931,7 @@ instr_emit(ir_unit_t *iu, ir_bb_t *bb, ir_function_t *f
     //    printf("EMIT INSTR: %s\n", instr_str(iu, ii, 1));
     assert(ii->ii_jit == 0);
 
-#ifdef VM_TRACE
+#ifdef VM_INSTR_BACKREFS
     ir_instr_backref_t *iib = f->if_instr_backrefs + f->if_instr_backref_size;
     iib->offset = iu->iu_text_ptr - iu->iu_text_alloc;
     iib->str = instr_stra(iu, ii, 0);
@@ -4530,6 +4939,7 @@ instr_emit(ir_unit_t *iu, ir_bb_t *bb, ir_function_t *f
     f->if_instr_backref_size++;
 #endif
 
+    debuginfo_line_add(iu, ii);
 
     switch(ii->ii_class) {
 
@@ -4605,6 +5015,9 @@ instr_emit(ir_unit_t *iu, ir_bb_t *bb, ir_function_t *f
     case IR_IC_MLA:
       emit_mla(iu, (ir_instr_ternary_t *)ii);
       break;
+    case IR_IC_DIVC:
+      emit_divc(iu, (ir_instr_divc_t *)ii);
+      break;
     default:
       parser_error(iu, "Unable to emit instruction %d", ii->ii_class);
     }
@@ -4713,8 +5126,9 @@ vm_emit_function(ir_unit_t *iu, ir_function_t *f)
   VECTOR_RESIZE(&iu->iu_jit_vmbb_fixups, 0);
   VECTOR_RESIZE(&iu->iu_jit_branch_fixups, 0);
   VECTOR_RESIZE(&iu->iu_jit_bb_to_addr_fixups, 0);
+  VECTOR_RESIZE(&iu->iu_lines, 0);
 
-#ifdef VM_TRACE
+#ifdef VM_INSTR_BACKREFS
   int total_instructions = 0;
   TAILQ_FOREACH(ib, &f->if_bbs, ib_link) {
     TAILQ_FOREACH(i, &ib->ib_instrs, ii_link) {
@@ -4731,6 +5145,12 @@ vm_emit_function(ir_unit_t *iu, ir_function_t *f)
   f->if_jit_offset = iu->iu_jit_ptr;
 #endif
 
+  if(iu->iu_debug_flags_func & VMIR_DBG_FUNC_INSTRUMENT && !f->if_full_jit) {
+    // The entry block has no predecessors so this is only executed once
+    emit_op(iu, VM_FUNC_ENTER);
+    emit_i32(iu, f->if_gfid);
+  }
+
   TAILQ_FOREACH(ib, &f->if_bbs, ib_link) {
 #ifdef VMIR_VM_JIT
     if(f->if_full_jit) {
@@ -4744,10 +5164,21 @@ vm_emit_function(ir_unit_t *iu, ir_function_t *f)
       emit_i32(iu, VECTOR_LEN(&iu->iu_instrumentation));
 
       int num_instructions = 0;
-      TAILQ_FOREACH(i, &ib->ib_instrs, ii_link)
+      int num_moves = 0;
+      int file = -1;
+      uint32_t line = 0;
+      TAILQ_FOREACH(i, &ib->ib_instrs, ii_link) {
         num_instructions++;
+        if(i->ii_class == IR_IC_MOVE)
+          num_moves++;
+        if(line == 0 && i->ii_line) {
+          line = i->ii_line;
+          file = i->ii_file;
+        }
+      }
 
-      ir_instrumentation_t ii = {f, ib->ib_id, num_instructions, 0};
+      ir_instrumentation_t ii = {f, ib->ib_id, num_instructions, num_moves,
+                                 file, line, 0};
       VECTOR_PUSH_BACK(&iu->iu_instrumentation, ii);
     }
     instr_emit(iu, ib, f
@@ -4765,11 +5196,12 @@ vm_emit_function(ir_unit_t *iu, ir_function_t *f)
     assert(f->if_vm_text_size == 0);
     f->if_ext_func = iu->iu_jit_mem + f->if_jit_offset;
   } else {
-    f->if_vm_text = malloc(f->if_vm_text_size);
+    f->if_vm_text = malloc(f->if_vm_text_size + VM_TEXT_SLACK);
     memcpy(f->if_vm_text, iu->iu_text_alloc, f->if_vm_text_size);
 
     iu->iu_stats.vm_code_size += f->if_vm_text_size;
     branch_fixup(iu);
+    debuginfo_lines_finalize(iu, f);
   }
 #ifdef VMIR_VM_JIT
   jit_branch_fixup(iu, f);
@@ -4780,6 +5212,28 @@ vm_emit_function(ir_unit_t *iu, ir_function_t *f)
 
  
 
+/**
+ * Keep track of the N functions that took longest to load
+ */
+static void
+function_load_time_record(ir_unit_t *iu, const ir_function_t *f,
+                          int64_t time)
+{
+  vmir_function_load_time_t *v = iu->iu_stats.slowest_functions;
+  const int n = VMIR_STATS_SLOWEST_FUNCTIONS;
+  int i = n;
+  while(i > 0 && (v[i - 1].name == NULL || v[i - 1].time < time))
+    i--;
+  if(i == n)
+    return;
+  memmove(v + i + 1, v + i, (n - i - 1) * sizeof(v[0]));
+  v[i].name = f->if_name;
+  v[i].time = time;
+  v[i].temporaries = iu->iu_next_value - iu->iu_first_func_value;
+  v[i].basic_blocks = f->if_num_bbs;
+}
+
+
 /**
  *
  */
@@ -4790,12 +5244,22 @@ function_process(ir_unit_t *iu, ir_function_t *f)
   if(iu->iu_debug_flags_func & VMIR_DBG_DUMP_PARSED_FUNCTION)
     function_print(iu, iu->iu_current_function, "parsed");
 
+  const int64_t start = get_ts_ns();
+
   transform_function(iu, f);
 
+  iu->iu_stats.regframe_size_total += f->if_regframe_size;
+  iu->iu_stats.regframe_size_max =
+    VMIR_MAX(iu->iu_stats.regframe_size_max, f->if_regframe_size);
+
   if(iu->iu_debug_flags_func & VMIR_DBG_DUMP_LOWERED_FUNCTION)
     function_print(iu, iu->iu_current_function, "lowered");
 
+  int64_t ts = get_ts_ns();
   vm_emit_function(iu, f);
+  ts = phase_mark(iu, VMIR_PHASE_EMIT, ts);
+
+  function_load_time_record(iu, f, ts - start);
 }
 
 
@@ -4845,6 +5309,12 @@ static const vmop_tab_t vmop_map[] = {
   FN_VMOP("strncmp", VM_STRNCMP, 3),
   FN_VMOP("strdup",  VM_STRDUP, 1),
 
+  FN_VMOP("fgetc",   VM_FGETC, 1),
+  FN_VMOP("getc",    VM_FGETC, 1),
+  FN_VMOP("fputc",   VM_FPUTC, 2),
+  FN_VMOP("putc",    VM_FPUTC, 2),
+  FN_VMOP("putchar", VM_PUTCHAR, 1),
+
 
   FN_VMOP("llvm.va_start", VM_VASTART, 2),
 
@@ -4970,6 +5440,10 @@ vmir_vm_function_call(ir_unit_t *iu, ir_function_t *f, void *out, ...)
 
   jmp_buf *prevjb = iu->iu_err_jmpbuf;
   iu->iu_err_jmpbuf = &jb;
+#ifndef VM_NO_STACK_FRAME
+  const vm_frame_t *prevframe = iu->iu_current_frame;
+#endif
+  const size_t fprof_depth = VECTOR_LEN(&iu->iu_fprof_stack);
 
   int r = setjmp(jb);
   if(!r) {
@@ -4981,12 +5455,16 @@ vmir_vm_function_call(ir_unit_t *iu, ir_function_t *f, void *out, ...)
       .allocaptr = allocaptr,
 #ifndef VM_NO_STACK_FRAME
       .func = f,
+      .prev = prevframe,
       .allocapeak = &allocapeak,
 #endif
     };
 
     if(f->if_ext_func != NULL) {
       r = f->if_ext_func(out, rfa, iu, iu->iu_mem);
+    } else if(iu->iu_perf_trampolines != NULL) {
+      r = iu->iu_perf_trampolines[f->if_gfid](f->if_vm_text, rfa, out, &F,
+                                              vm_exec);
     } else {
       r = vm_exec(f->if_vm_text, rfa, out, &F);
     }
@@ -4995,6 +5473,10 @@ vmir_vm_function_call(ir_unit_t *iu, ir_function_t *f, void *out, ...)
       r = VM_STOP_UNCAUGHT_EXCEPTION;
   }
   iu->iu_err_jmpbuf = prevjb;
+#ifndef VM_NO_STACK_FRAME
+  iu->iu_current_frame = prevframe;
+#endif
+  vm_fprof_unwind(iu, fprof_depth);
 
 #ifndef VM_NO_STACK_FRAME
   uint32_t stackuse = allocapeak - allocaptr;
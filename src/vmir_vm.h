@@ -160,6 +160,17 @@ typedef enum {
 
   VM_MLA32,
 
+  VM_MULHI_UDIV32,
+  VM_MULHI_UDIV32_ADD,
+  VM_MULHI_SDIV32,
+  VM_MULHI_SDIV32_ADD,
+  VM_MULHI_UREM32,
+  VM_MULHI_UREM32_ADD,
+  VM_MULHI_SREM32,
+  VM_MULHI_SREM32_ADD,
+  VM_SDIV_POW2_32,
+  VM_SREM_POW2_32,
+
   VM_LOAD8,
   VM_LOAD8_G,
   VM_LOAD8_OFF,
@@ -614,6 +625,10 @@ typedef enum {
   VM_STRCAT,
   VM_STRNCAT,
 
+  VM_FGETC,
+  VM_FPUTC,
+  VM_PUTCHAR,
+
   VM_MEMMOVE,
   VM_MEMCMP,
 
@@ -639,5 +654,7 @@ typedef enum {
   VM_NOP,
 
   VM_INSTRUMENT_COUNT,
+  VM_FUNC_ENTER,
+  VM_FUNC_LEAVE,
 
 } vm_op_t;
@@ -15,6 +15,8 @@ pid_t getppid(void);
 
 ssize_t read(int fildes, void *buf, size_t nbyte);
 ssize_t write(int fildes, void *buf, size_t nbyte);
+ssize_t pread(int fildes, void *buf, size_t nbyte, off_t offset);
+ssize_t pwrite(int fildes, const void *buf, size_t nbyte, off_t offset);
 
 off_t lseek(int fd, off_t offset, int whence);
 
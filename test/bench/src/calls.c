@@ -0,0 +1,40 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * Call heavy recursive code, direct and through function pointers
+ */
+
+static int
+fib(int n)
+{
+  return n < 2 ? n : fib(n - 1) + fib(n - 2);
+}
+
+static int
+ack(int m, int n)
+{
+  if(m == 0)
+    return n + 1;
+  if(n == 0)
+    return ack(m - 1, 1);
+  return ack(m - 1, ack(m, n - 1));
+}
+
+static int tak(int x, int y, int z);
+
+static int (*volatile takp)(int, int, int) = tak;
+
+static int
+tak(int x, int y, int z)
+{
+  if(y >= x)
+    return z;
+  return takp(takp(x - 1, y, z), takp(y - 1, z, x), takp(z - 1, x, y));
+}
+
+int main(int argc, char **argv)
+{
+  printf("%d %d %d\n", fib(35), ack(2, 3000), tak(28, 20, 10));
+  return 0;
+}
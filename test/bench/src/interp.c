@@ -0,0 +1,68 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+ * A small stack machine interpreter, dominated by a big switch
+ */
+
+enum {
+  OP_PUSH, OP_LOAD, OP_STORE, OP_ADD, OP_SUB, OP_MUL, OP_AND, OP_XOR,
+  OP_SHL, OP_SHR, OP_DUP, OP_DROP, OP_JNZ, OP_JMP, OP_LT, OP_HALT,
+};
+
+static const int32_t program[] = {
+  // i = 3000000, a = 1, b = 0
+  OP_PUSH, 3000000, OP_STORE, 0,
+  OP_PUSH, 1, OP_STORE, 1,
+  OP_PUSH, 0, OP_STORE, 2,
+  // loop: (pc 12)
+  OP_LOAD, 1, OP_PUSH, 13, OP_SHL, OP_LOAD, 1, OP_XOR, OP_STORE, 1,
+  OP_LOAD, 1, OP_PUSH, 17, OP_SHR, OP_LOAD, 1, OP_XOR, OP_STORE, 1,
+  OP_LOAD, 1, OP_PUSH, 5, OP_SHL, OP_LOAD, 1, OP_XOR, OP_STORE, 1,
+  OP_LOAD, 2, OP_LOAD, 1, OP_PUSH, 255, OP_AND, OP_ADD, OP_STORE, 2,
+  OP_LOAD, 0, OP_PUSH, 1, OP_SUB, OP_DUP, OP_STORE, 0,
+  OP_JNZ, 12,
+  OP_LOAD, 2, OP_HALT,
+};
+
+static int32_t
+run(const int32_t *code)
+{
+  int32_t stack[64];
+  int32_t vars[8] = {0};
+  int sp = 0;
+  int pc = 0;
+
+  while(1) {
+    const int32_t op = code[pc++];
+    switch(op) {
+    case OP_PUSH:  stack[sp++] = code[pc++]; break;
+    case OP_LOAD:  stack[sp++] = vars[code[pc++]]; break;
+    case OP_STORE: vars[code[pc++]] = stack[--sp]; break;
+    case OP_ADD:   sp--; stack[sp - 1] += stack[sp]; break;
+    case OP_SUB:   sp--; stack[sp - 1] -= stack[sp]; break;
+    case OP_MUL:   sp--; stack[sp - 1] *= stack[sp]; break;
+    case OP_AND:   sp--; stack[sp - 1] &= stack[sp]; break;
+    case OP_XOR:   sp--; stack[sp - 1] ^= stack[sp]; break;
+    case OP_SHL:   sp--; stack[sp - 1] = (uint32_t)stack[sp - 1] << stack[sp];
+      break;
+    case OP_SHR:   sp--; stack[sp - 1] = (uint32_t)stack[sp - 1] >> stack[sp];
+      break;
+    case OP_DUP:   stack[sp] = stack[sp - 1]; sp++; break;
+    case OP_DROP:  sp--; break;
+    case OP_JNZ:   pc = stack[--sp] ? code[pc] : pc + 1; break;
+    case OP_JMP:   pc = code[pc]; break;
+    case OP_LT:    sp--; stack[sp - 1] = stack[sp - 1] < stack[sp]; break;
+    case OP_HALT:  return stack[sp - 1];
+    default:
+      abort();
+    }
+  }
+}
+
+int main(int argc, char **argv)
+{
+  printf("%d\n", run(program));
+  return 0;
+}
@@ -0,0 +1,65 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Random malloc / realloc / free of mixed sizes with a working set of
+ * a few thousand live allocations
+ */
+
+#define SLOTS 4096
+#define ROUNDS 2000000
+
+static uint32_t seed = 1;
+
+static uint32_t
+rnd(void)
+{
+  seed = seed * 1103515245 + 12345;
+  return seed >> 8;
+}
+
+static size_t
+rndsize(void)
+{
+  const uint32_t r = rnd();
+  switch(r & 7) {
+  case 0: return 1024 + r % 16384;
+  case 1:
+  case 2: return 64 + r % 512;
+  default: return 8 + r % 56;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  uint8_t *slots[SLOTS] = {0};
+  size_t sizes[SLOTS] = {0};
+  uint32_t sum = 0;
+
+  for(int i = 0; i < ROUNDS; i++) {
+    const int s = rnd() % SLOTS;
+    if(slots[s] == NULL) {
+      sizes[s] = rndsize();
+      slots[s] = malloc(sizes[s]);
+      memset(slots[s], s, sizes[s]);
+    } else if(rnd() & 1) {
+      sum += slots[s][sizes[s] - 1];
+      free(slots[s]);
+      slots[s] = NULL;
+    } else {
+      size_t n = rndsize();
+      slots[s] = realloc(slots[s], n);
+      if(n > sizes[s])
+        memset(slots[s] + sizes[s], s, n - sizes[s]);
+      sizes[s] = n;
+      sum += slots[s][0];
+    }
+  }
+
+  for(int i = 0; i < SLOTS; i++)
+    free(slots[i]);
+  printf("%u\n", sum);
+  return 0;
+}
@@ -0,0 +1,48 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+/*
+ * Single and double precision matrix multiplication plus a bit of
+ * libm
+ */
+
+#define N 200
+
+static float fa[N][N], fb[N][N], fc[N][N];
+static double da[N][N], db[N][N], dc[N][N];
+
+int main(int argc, char **argv)
+{
+  for(int i = 0; i < N; i++) {
+    for(int j = 0; j < N; j++) {
+      fa[i][j] = (i * 7 + j) % 13 * 0.25f;
+      fb[i][j] = (i + j * 3) % 11 * 0.5f;
+      da[i][j] = sqrt(i + j + 1.0);
+      db[i][j] = 1.0 / (i + 2 * j + 1.0);
+    }
+  }
+
+  double sum = 0;
+  for(int r = 0; r < 24; r++) {
+    for(int i = 0; i < N; i++) {
+      for(int j = 0; j < N; j++) {
+        float fs = 0;
+        double ds = 0;
+        for(int k = 0; k < N; k++) {
+          fs += fa[i][k] * fb[k][j];
+          ds += da[i][k] * db[k][j];
+        }
+        fc[i][j] = fs;
+        dc[i][j] = ds;
+      }
+    }
+    for(int i = 0; i < N; i++)
+      for(int j = 0; j < N; j++)
+        sum += fc[i][j] * 1e-6 + sqrt(fabs(dc[i][j]));
+    fa[r % N][r % N] += 1.0f;
+    da[r % N][r % N] += 1.0;
+  }
+  printf("%.6e\n", sum);
+  return 0;
+}
@@ -0,0 +1,34 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "../../misc/src/sha1_c.h"
+
+/*
+ * SHA1 over 16MB of pseudo random data (same workload as the README
+ * figures, but without depending on file I/O)
+ */
+
+static uint8_t buf[65536];
+
+int main(int argc, char **argv)
+{
+  SHA1Context ctx;
+  uint8_t digest[20];
+  uint32_t seed = 1;
+
+  SHA1Reset(&ctx);
+  for(int i = 0; i < 256; i++) {
+    for(int j = 0; j < sizeof(buf); j++) {
+      seed = seed * 1103515245 + 12345;
+      buf[j] = seed >> 16;
+    }
+    SHA1Input(&ctx, buf, sizeof(buf));
+  }
+  SHA1Finish(&ctx, digest);
+
+  for(int j = 0; j < 20; j++)
+    printf("%02x", digest[j]);
+  printf("\n");
+  return 0;
+}
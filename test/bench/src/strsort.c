@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Sort random strings with a generic (comparator based) quicksort and
+ * do some scanning with the str* functions
+ */
+
+#define NUM_STRINGS 200000
+
+static uint32_t seed = 1;
+
+static uint32_t
+rnd(void)
+{
+  seed = seed * 1103515245 + 12345;
+  return seed >> 8;
+}
+
+static void
+swap(char **a, char **b)
+{
+  char *t = *a;
+  *a = *b;
+  *b = t;
+}
+
+static void
+sort(char **v, int n, int (*cmp)(const char *, const char *))
+{
+  while(n > 1) {
+    char *pivot = v[n / 2];
+    int i = 0, j = n - 1;
+    while(i <= j) {
+      while(cmp(v[i], pivot) < 0)
+        i++;
+      while(cmp(v[j], pivot) > 0)
+        j--;
+      if(i <= j)
+        swap(&v[i++], &v[j--]);
+    }
+    // Recurse into the smaller part
+    if(j + 1 < n - i) {
+      sort(v, j + 1, cmp);
+      v += i;
+      n -= i;
+    } else {
+      sort(v + i, n - i, cmp);
+      n = j + 1;
+    }
+  }
+}
+
+static int
+cmp_str(const char *a, const char *b)
+{
+  return strcmp(a, b);
+}
+
+int main(int argc, char **argv)
+{
+  char **v = malloc(sizeof(char *) * NUM_STRINGS);
+  char tmp[64];
+
+  for(int i = 0; i < NUM_STRINGS; i++) {
+    int len = 4 + rnd() % 40;
+    for(int j = 0; j < len; j++)
+      tmp[j] = 'a' + rnd() % 26;
+    tmp[len] = 0;
+    v[i] = strdup(tmp);
+  }
+
+  sort(v, NUM_STRINGS, cmp_str);
+
+  uint32_t sum = 0;
+  for(int i = 0; i < NUM_STRINGS; i++) {
+    if(i && strcmp(v[i - 1], v[i]) > 0) {
+      printf("Not sorted at %d\n", i);
+      exit(1);
+    }
+    const char *q = strchr(v[i], 'q');
+    sum = sum * 31 + strlen(v[i]) + (q ? q - v[i] : 0);
+  }
+
+  for(int i = 0; i < NUM_STRINGS; i++)
+    free(v[i]);
+  free(v);
+  printf("%08x\n", sum);
+  return 0;
+}
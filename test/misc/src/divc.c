@@ -0,0 +1,95 @@
+#include <stdlib.h>
+#include <limits.h>
+
+/**
+ * Division and remainder by constants are strength reduced, compare
+ * them against the same operations with the divisor only known at
+ * runtime
+ */
+
+static volatile int sdivisor;
+static volatile unsigned int udivisor;
+
+static const int snum[] = {
+  0, 1, -1, 2, -2, 3, 6, 7, -7, 8, -8, 100, -100, 640, 641, -641, 1282,
+  -1283, 65535, 65536, -65536, 123456789, -123456789,
+  INT_MAX, INT_MAX - 1, INT_MIN, INT_MIN + 1, INT_MIN + 7,
+};
+
+static const unsigned int unum[] = {
+  0, 1, 2, 3, 6, 7, 8, 100, 640, 641, 1282, 1283, 65535, 65536,
+  123456789, 0x7fffffff, 0x80000000, 0x80000001, 0xfffffff9,
+  0xfffffffe, 0xffffffff,
+};
+
+#define NUM_SNUM (sizeof(snum) / sizeof(snum[0]))
+#define NUM_UNUM (sizeof(unum) / sizeof(unum[0]))
+
+
+#define CHECK_S(d) do {                         \
+    sdivisor = d;                               \
+    for(int i = 0; i < NUM_SNUM; i++) {         \
+      volatile int x = snum[i];                 \
+      if(x / d != x / sdivisor)                 \
+        abort();                                \
+      if(x % d != x % sdivisor)                 \
+        abort();                                \
+    }                                           \
+  } while(0)
+
+
+#define CHECK_U(d) do {                         \
+    udivisor = d;                               \
+    for(int i = 0; i < NUM_UNUM; i++) {         \
+      volatile unsigned int x = unum[i];        \
+      if(x / d != x / udivisor)                 \
+        abort();                                \
+      if(x % d != x % udivisor)                 \
+        abort();                                \
+    }                                           \
+  } while(0)
+
+
+int
+main(void)
+{
+  // Powers of two
+  CHECK_S(1);
+  CHECK_S(2);
+  CHECK_S(4);
+  CHECK_S(8);
+  CHECK_S(1024);
+  CHECK_S(65536);
+  CHECK_S(0x40000000);
+
+  // Others
+  CHECK_S(3);
+  CHECK_S(5);
+  CHECK_S(7);
+  CHECK_S(10);
+  CHECK_S(641);
+  CHECK_S(1000000);
+  CHECK_S(INT_MAX);
+
+  // Negative divisors are not strength reduced but must still work
+  CHECK_S(-7);
+  CHECK_S(-641);
+
+  CHECK_U(1);
+  CHECK_U(2);
+  CHECK_U(4);
+  CHECK_U(8);
+  CHECK_U(1024);
+  CHECK_U(65536);
+  CHECK_U(0x80000000);
+
+  CHECK_U(3);
+  CHECK_U(5);
+  CHECK_U(7);
+  CHECK_U(10);
+  CHECK_U(641);
+  CHECK_U(1000000);
+  CHECK_U(0x7fffffff);
+  CHECK_U(0xfffffff9);
+  return 0;
+}
@@ -1,13 +1,55 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static char tmp[320];
+
+static void
+check(int r, const char *expect)
+{
+  if(strcmp(tmp, expect) || r != strlen(expect)) {
+    printf("got '%s' expected '%s'\n", tmp, expect);
+    abort();
+  }
+}
+
+
+static int
+bracketed(int x)
+{
+  return snprintf(tmp, sizeof(tmp), "[%5d]", x);
+}
 
 
 int
 main(void)
 {
-  char tmp[320];
   int x = snprintf(tmp, sizeof(tmp), "output is %*.*f\n", 2,3,20.3);
 
   puts(tmp);
   printf("snprintf returned %d\n", x);
+
+  check(snprintf(tmp, sizeof(tmp), "%*f", 12, 1.5), "    1.500000");
+  check(snprintf(tmp, sizeof(tmp), "%-*f|", 10, 2.25), "2.250000  |");
+  check(snprintf(tmp, sizeof(tmp), "100%%"), "100%");
+  check(snprintf(tmp, sizeof(tmp), "%d%%%d", 5, 6), "5%6");
+  check(snprintf(tmp, sizeof(tmp), "a%db%sc%xd", 1, "str", 255),
+        "a1bstrcffd");
+  check(snprintf(tmp, sizeof(tmp), "%lld %lld", 1234567890123LL,
+                 -9876543210LL), "1234567890123 -9876543210");
+  check(snprintf(tmp, sizeof(tmp), "%llx|%d", 0x123456789abcULL, 7),
+        "123456789abc|7");
+
+  // Same constant format from two call sites
+  check(bracketed(42), "[   42]");
+  check(snprintf(tmp, sizeof(tmp), "[%5d]", -7), "[   -7]");
+  check(bracketed(123456), "[123456]");
+
+  // Format in writable memory must be reparsed when it changes
+  char fmt[] = "w%dw";
+  check(snprintf(tmp, sizeof(tmp), fmt, 3), "w3w");
+  fmt[0] = 'v';
+  fmt[2] = 'x';
+  check(snprintf(tmp, sizeof(tmp), fmt, 255), "vffw");
   return 0;
 }
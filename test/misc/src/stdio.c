@@ -0,0 +1,95 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define PATH "/tmp/vmirstdio"
+#define LEN  10000  // Spans a couple of 4k stdio buffers
+
+static int
+expect(int i)
+{
+  return 'a' + i % 26;
+}
+
+
+static void
+check_file(int len)
+{
+  FILE *fp = fopen(PATH, "rb");
+  if(fp == NULL)
+    abort();
+
+  int c, i = 0;
+  while((c = getc(fp)) != EOF) {
+    if(i == 101 ? c != 'X' : c != expect(i))
+      abort();
+    i++;
+  }
+  if(i != len || !feof(fp))
+    abort();
+  fclose(fp);
+}
+
+
+int
+main(void)
+{
+  FILE *fp = fopen(PATH, "w+b");
+  if(fp == NULL)
+    abort();
+
+  for(int i = 0; i < LEN; i++) {
+    if((i & 1 ? fputc(expect(i), fp) : putc(expect(i), fp)) != expect(i))
+      abort();
+  }
+  if(ftell(fp) != LEN)
+    abort();
+
+  // Mixed reads and writes
+  if(fseek(fp, 100, SEEK_SET))
+    abort();
+  if(fgetc(fp) != expect(100) || ftell(fp) != 101)
+    abort();
+  fseek(fp, 0, SEEK_CUR);
+  fputc('X', fp);
+  if(ftell(fp) != 102)
+    abort();
+  fseek(fp, 101, SEEK_SET);
+  if(getc(fp) != 'X' || getc(fp) != expect(102) || ftell(fp) != 103)
+    abort();
+
+  // Write across the buffer boundary and read it back
+  fseek(fp, 4090, SEEK_SET);
+  for(int i = 4090; i < 4110; i++)
+    fputc(expect(i), fp);
+  fseek(fp, 4090, SEEK_SET);
+  for(int i = 4090; i < 4110; i++)
+    if(fgetc(fp) != expect(i))
+      abort();
+  if(ftell(fp) != 4110)
+    abort();
+
+  fseek(fp, 0, SEEK_END);
+  if(ftell(fp) != LEN)
+    abort();
+
+  // Contents must reach the file without closing the stream
+  fflush(NULL);
+  check_file(LEN);
+  fclose(fp);
+
+  // stdout is always line buffered so "line 1" is output before
+  // "line 2" which bypasses the buffer. puts() appends the newline.
+  // Expected output:
+  //   line 1
+  //   line 2
+  //   line 3
+  //   line 4
+  const char *s = "line 1\n";
+  while(*s)
+    putchar(*s++);
+  write(fileno(stdout), "line 2\n", 7);
+  puts("line 3");
+  write(fileno(stdout), "line 4\n", 7);
+  return 0;
+}